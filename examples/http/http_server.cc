@@ -13,7 +13,12 @@ class Server
 public:
    NETPOLL_TCP_CONNECTION(conn)
    {
-      if (conn->connected()) { conn->setContext(Context{}); }
+      if (conn->connected())
+      {
+         conn->setContext(Context{});
+         // A request which is still incomplete at 64KB is dropped.
+         conn->setRecvBufferLimit(64 * 1024, true);
+      }
       if (conn->disconnected()) { elog::Log::info("disconnected"); }
    }
 
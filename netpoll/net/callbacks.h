@@ -18,5 +18,6 @@ using CloseCallback           = std::function<void(const TcpConnectionPtr &)>;
 using WriteCompleteCallback   = std::function<void(const TcpConnectionPtr &)>;
 using HighWaterMarkCallback =
   std::function<void(const TcpConnectionPtr &, const size_t)>;
+using DeadlineCallback = std::function<void(const TcpConnectionPtr &)>;
 
 }   // namespace netpoll
@@ -12,12 +12,22 @@
 #else
 #include <poll.h>
 #endif
+#ifdef __linux__
+#include <sys/epoll.h>
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE (1u << 28)
+#endif
+#endif
 using namespace netpoll;
 
 const int Channel::kNoneEvent = 0;
 
 const int Channel::kReadEvent  = POLLIN | POLLPRI;
 const int Channel::kWriteEvent = POLLOUT;
+#ifdef __linux__
+// The kernel rejects POLLPRI together with EPOLLEXCLUSIVE.
+const int Channel::kExclusiveReadEvent = POLLIN | EPOLLEXCLUSIVE;
+#endif
 
 Channel::Channel(EventLoop *loop, int fd)
   : m_loop(loop),
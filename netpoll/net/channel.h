@@ -1,6 +1,7 @@
 #pragma once
 
 #include <netpoll/util/noncopyable.h>
+#include <netpoll/util/object_pool.h>
 
 #include <cassert>
 #include <functional>
@@ -14,10 +15,11 @@ class Acceptor;
  * events on the socket it manages.
  *
  */
-class Channel : noncopyable
+class Channel : noncopyable, public PoolAllocated<Channel>
 {
 private:
    friend class Acceptor;
+   friend class TcpConnectionImpl;
    // To support  EventLoop decoupling,for internal encapsulation only.
    void setLoop(EventLoop *loop) { m_loop = loop; }
 
@@ -151,6 +153,23 @@ public:
       update();
    }
 
+#ifdef __linux__
+   /**
+    * @brief Enable the read event with EPOLLEXCLUSIVE. When several event
+    * loops watch the same file, only one of them is woken up per event.
+    *
+    * @note It must be called before the channel is added to the event loop,
+    * and the events of the channel cannot be modified afterwards, only be
+    * disabled all together.
+    */
+   void enableExclusiveReading()
+   {
+      assert(m_index == -1);
+      m_events |= kExclusiveReadEvent;
+      update();
+   }
+#endif
+
    /**
     * @brief Disable the read event on the socket.
     *
@@ -226,6 +245,9 @@ public:
    static const int kNoneEvent;
    static const int kReadEvent;
    static const int kWriteEvent;
+#ifdef __linux__
+   static const int kExclusiveReadEvent;
+#endif
 
 private:
    friend class EventLoop;
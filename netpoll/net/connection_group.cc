@@ -0,0 +1,99 @@
+#include "connection_group.h"
+
+#include <cassert>
+#include <utility>
+#include <vector>
+
+#include "eventloop.h"
+#include "tcp_connection.h"
+
+using namespace netpoll;
+
+// The tasks are queued out of the lock and never run inline, even in the
+// thread of the loop: a send may call back into the group, and the members of
+// a loop must not change while a task walks them. Being queued keeps the
+// joins, leaves and publishes of one thread in order on each loop.
+
+bool ConnectionGroup::join(const TcpConnectionPtr &conn)
+{
+   auto                     loop = conn->getLoop();
+   std::shared_ptr<Members> members;
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (!m_memberLoops.emplace(conn.get(), loop).second) { return false; }
+      auto &loopMembers = m_loopMembers[loop];
+      if (!loopMembers.members)
+      {
+         loopMembers.members = std::make_shared<Members>();
+      }
+      ++loopMembers.count;
+      members = loopMembers.members;
+   }
+   loop->queueInLoop(
+     [members, conn]() { members->emplace(conn.get(), conn); });
+   return true;
+}
+
+bool ConnectionGroup::leave(const TcpConnectionPtr &conn)
+{
+   EventLoop               *loop = nullptr;
+   std::shared_ptr<Members> members;
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      auto                        iter = m_memberLoops.find(conn.get());
+      if (iter == m_memberLoops.end()) { return false; }
+      loop = iter->second;
+      m_memberLoops.erase(iter);
+      auto loopIter = m_loopMembers.find(loop);
+      assert(loopIter != m_loopMembers.end());
+      members = loopIter->second.members;
+      if (--loopIter->second.count == 0) { m_loopMembers.erase(loopIter); }
+   }
+   const TcpConnection *key = conn.get();
+   loop->queueInLoop([members, key]() { members->erase(key); });
+   return true;
+}
+
+void ConnectionGroup::publish(const StringView &data)
+{
+   auto buffer = std::make_shared<MessageBuffer>(data.size());
+   buffer->pushBack(data);
+   publish(buffer);
+}
+
+void ConnectionGroup::publish(MessageBuffer &&buffer)
+{
+   publish(std::make_shared<MessageBuffer>(std::move(buffer)));
+}
+
+void ConnectionGroup::publish(
+  const std::shared_ptr<const MessageBuffer> &buffer)
+{
+   if (buffer->readableBytes() == 0) { return; }
+   std::vector<std::pair<EventLoop *, std::shared_ptr<Members>>> targets;
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      targets.reserve(m_loopMembers.size());
+      for (auto &item : m_loopMembers)
+      {
+         targets.emplace_back(item.first, item.second.members);
+      }
+   }
+   for (auto &target : targets)
+   {
+      auto &members = target.second;
+      target.first->queueInLoop([members, buffer]() {
+         for (auto &member : *members)
+         {
+            // A member moved to another loop has the send queued there.
+            if (member.second->connected()) { member.second->send(buffer); }
+         }
+      });
+   }
+}
+
+size_t ConnectionGroup::size() const
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   return m_memberLoops.size();
+}
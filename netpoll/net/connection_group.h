@@ -0,0 +1,91 @@
+#pragma once
+
+#include <netpoll/net/callbacks.h>
+#include <netpoll/util/message_buffer.h>
+#include <netpoll/util/noncopyable.h>
+#include <netpoll/util/string_view.h>
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+namespace netpoll {
+class EventLoop;
+
+/**
+ * @brief This class represents a group of connections which receive the same
+ * messages, such as the subscribers of a topic. A message is published once:
+ * it is stored in one shared buffer, one task is queued to each loop holding
+ * members, and that task puts the buffer on the write queue of each member of
+ * the loop without copying it.
+ *
+ */
+class ConnectionGroup : noncopyable
+{
+public:
+   ConnectionGroup() = default;
+
+   /**
+    * @brief Add the connection to the group, it receives the messages
+    * published after the call.
+    *
+    * @param conn
+    * @return false if it is already a member.
+    * @note It can be called in any thread.
+    */
+   bool join(const TcpConnectionPtr &conn);
+
+   /**
+    * @brief Remove the connection from the group.
+    *
+    * @param conn
+    * @return false if it is not a member.
+    * @note It can be called in any thread. The group holds its members, call
+    * it when a member is closed, e.g. in the connection callback, so that the
+    * connection is released.
+    */
+   bool leave(const TcpConnectionPtr &conn);
+
+   /**
+    * @brief Send the data to every member, members which are not connected
+    * are skipped.
+    *
+    * @param data Copied once into the shared buffer.
+    * @note It can be called in any thread. The messages published by one
+    * thread reach each member in order.
+    */
+   void publish(const StringView &data);
+   void publish(MessageBuffer &&buffer);
+
+   /**
+    * @brief Send the buffer to every member without copying it.
+    *
+    * @param buffer
+    * @note The buffer must not be changed after the call, it may still be
+    * sent from.
+    */
+   void publish(const std::shared_ptr<const MessageBuffer> &buffer);
+
+   /**
+    * @brief Return the number of members.
+    *
+    * @return size_t
+    */
+   size_t size() const;
+
+private:
+   // The members placed on one loop, only touched in the thread of the loop.
+   using Members = std::unordered_map<const TcpConnection *, TcpConnectionPtr>;
+   struct LoopMembers
+   {
+      std::shared_ptr<Members> members;
+      size_t                   count{0};
+   };
+
+   mutable std::mutex                m_mutex;
+   std::map<EventLoop *, LoopMembers> m_loopMembers;
+   // The loop each member was placed on when it joined.
+   std::unordered_map<const TcpConnection *, EventLoop *> m_memberLoops;
+};
+}   // namespace netpoll
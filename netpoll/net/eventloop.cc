@@ -8,6 +8,7 @@
 #include <thread>
 
 #include "channel.h"
+#include "inner/deadline_wheel.h"
 #include "inner/poller.h"
 #include "inner/timer_queue.h"
 #ifdef _WIN32
@@ -168,6 +169,10 @@ void EventLoop::loop()
 #else
          m_poller->poll(static_cast<int>(m_timerQueue->getTimeout()),
                         &m_activeChannels);
+#endif
+         auto busyBegin = std::chrono::steady_clock::now();
+         m_funcsDone    = false;
+#ifndef __linux__
          m_timerQueue->processTimers();
 #endif
          // TODO sort channel by priority?
@@ -180,6 +185,11 @@ void EventLoop::loop()
          m_currentActiveChannel = nullptr;
          m_eventHandling        = false;
          doRunInLoopFuncs();
+         // What is queued from now on waits for the next iteration.
+         m_funcsDone = true;
+         if (!m_iterationHooks.empty()) { doRunIterationHooks(); }
+         if (!m_iterationEndFuncs.empty()) { doRunIterationEndFuncs(); }
+         updateBusyTime(busyBegin);
       }
       // loopFlagCleaner clears the loop flag here
    }
@@ -214,7 +224,8 @@ void EventLoop::abortNotInLoopThread()
 void EventLoop::queueInLoop(const Functor &cb)
 {
    m_funcs.enqueue(cb);
-   if (!isInLoopThread() || !m_looping.load(std::memory_order_acquire))
+   if (!isInLoopThread() || !m_looping.load(std::memory_order_acquire) ||
+       m_funcsDone)
    {
       wakeup();
    }
@@ -223,7 +234,8 @@ void EventLoop::queueInLoop(const Functor &cb)
 void EventLoop::queueInLoop(Functor &&cb)
 {
    m_funcs.enqueue(std::move(cb));
-   if (!isInLoopThread() || !m_looping.load(std::memory_order_acquire))
+   if (!isInLoopThread() || !m_looping.load(std::memory_order_acquire) ||
+       m_funcsDone)
    {
       wakeup();
    }
@@ -288,6 +300,16 @@ void EventLoop::cancelTimer(TimerId id)
    if (isRunning() && m_timerQueue) m_timerQueue->cancelTimer(id);
 }
 
+DeadlineWheel &EventLoop::deadlineWheel()
+{
+   assertInLoopThread();
+   if (!m_deadlineWheel)
+   {
+      m_deadlineWheel = std::make_unique<DeadlineWheel>(this);
+   }
+   return *m_deadlineWheel;
+}
+
 void EventLoop::doRunInLoopFuncs()
 {
    m_callingFuncs = true;
@@ -300,10 +322,95 @@ void EventLoop::doRunInLoopFuncs()
       // TODO: The following is exception-unsafe. If one  of the funcs throws,
       // the remaining ones will not get run. The simplest fix is to catch any
       // exceptions and rethrow them later, but somehow that seems fishy...
+      uint32_t funcNum = 0;
       while (!m_funcs.empty())
       {
          Functor func;
-         while (m_funcs.dequeue(func)) { func(); }
+         while (m_funcs.dequeue(func))
+         {
+            func();
+            ++funcNum;
+         }
+      }
+      m_queueDepth.store(funcNum, std::memory_order_relaxed);
+   }
+}
+
+void EventLoop::updateBusyTime(
+  const std::chrono::steady_clock::time_point &begin)
+{
+   auto sample = static_cast<uint32_t>(
+     std::chrono::duration_cast<std::chrono::microseconds>(
+       std::chrono::steady_clock::now() - begin)
+       .count());
+   // Exponential moving average with a weight of 1/8 for the new sample.
+   auto avg = m_busyTimeUs.load(std::memory_order_relaxed);
+   avg      = (avg * 7 + sample + 4) / 8;
+   m_busyTimeUs.store(avg, std::memory_order_relaxed);
+}
+
+uint64_t EventLoop::addIterationHook(Functor &&cb)
+{
+   assertInLoopThread();
+   auto id = ++m_iterationHookId;
+   m_iterationHooks.emplace_back(id, std::move(cb));
+   return id;
+}
+
+void EventLoop::removeIterationHook(uint64_t id)
+{
+   assertInLoopThread();
+   for (auto &hook : m_iterationHooks)
+   {
+      if (hook.first == id)
+      {
+         // Only marked by clearing the ID, a hook may remove itself or others
+         // while it is running, and the function is destroyed after the round.
+         hook.first     = 0;
+         m_hooksRemoved = true;
+         return;
+      }
+   }
+}
+
+void EventLoop::runAtIterationEnd(Functor &&cb)
+{
+   assertInLoopThread();
+   m_iterationEndFuncs.push_back(std::move(cb));
+   // Called before the loop runs, the first iteration must not wait in poll.
+   if (!m_looping.load(std::memory_order_acquire)) { wakeup(); }
+}
+
+void EventLoop::doRunIterationEndFuncs()
+{
+   // Index based, a function may add more which run in this round.
+   for (size_t i = 0; i < m_iterationEndFuncs.size(); ++i)
+   {
+      auto func = std::move(m_iterationEndFuncs[i]);
+      func();
+   }
+   m_iterationEndFuncs.clear();
+}
+
+void EventLoop::doRunIterationHooks()
+{
+   // Index based, a hook may register new hooks while running.
+   for (size_t i = 0; i < m_iterationHooks.size(); ++i)
+   {
+      if (m_iterationHooks[i].first != 0) { m_iterationHooks[i].second(); }
+   }
+   if (m_hooksRemoved)
+   {
+      m_hooksRemoved = false;
+      // The removed functions are destroyed once the hooks are consistent
+      // again, the last reference they hold may add or remove hooks.
+      std::vector<Functor>                     removed;
+      std::deque<std::pair<uint64_t, Functor>> hooks;
+      hooks.swap(m_iterationHooks);
+      for (auto &hook : hooks)
+      {
+         if (hook.first != 0) { m_iterationHooks.push_back(std::move(hook)); }
+         else { removed.push_back(std::move(hook.second)); }
       }
    }
 }
@@ -5,8 +5,10 @@
 #include <netpoll/util/noncopyable.h>
 #include <netpoll/util/time_stamp.h>
 
+#include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <deque>
 #include <functional>
 #include <limits>
 #include <memory>
@@ -18,6 +20,7 @@
 namespace netpoll {
 class Poller;
 class TimerQueue;
+class DeadlineWheel;
 class Channel;
 using ChannelList = std::vector<Channel *>;
 using Functor     = std::function<void()>;
@@ -36,6 +39,10 @@ class EventLoop : noncopyable
 {
 public:
    friend class TimingWheel;
+   friend class TcpConnectionImpl;
+   friend class TcpServer;
+   template <typename T>
+   friend class SpscLoopChannel;
    EventLoop();
    ~EventLoop();
 
@@ -209,6 +216,16 @@ public:
     */
    void cancelTimer(TimerId id);
 
+   /**
+    * @brief Return the wheel holding the deadlines of the connections in the
+    * event loop, it is created on the first call. This method is usually used
+    * internally.
+    *
+    * @return DeadlineWheel&
+    * @note This method must be called in the thread of the event loop.
+    */
+   DeadlineWheel &deadlineWheel();
+
    /**
     * @brief Move the EventLoop to the current thread, this method must be
     * called before the loop is running.
@@ -257,6 +274,61 @@ public:
              (!m_quit.load(std::memory_order_acquire));
    }
 
+   /**
+    * @brief Return the average time in microseconds the event loop spends on
+    * one iteration, excluding the time blocked in the poller.
+    *
+    * @return uint32_t
+    * @note It can be called in any thread, the value is a moving average.
+    */
+   uint32_t busyTimeUs() const
+   {
+      return m_busyTimeUs.load(std::memory_order_relaxed);
+   }
+
+   /**
+    * @brief Return the number of queued functions run in the last iteration.
+    *
+    * @return uint32_t
+    * @note It can be called in any thread.
+    */
+   uint32_t queueDepth() const
+   {
+      return m_queueDepth.load(std::memory_order_relaxed);
+   }
+
+   /**
+    * @brief Limit the memory held by the receive buffers of the connections
+    * of the loop. While the total is over the budget, the connections holding
+    * at least an equal share of it pause their reading until the total drops
+    * below it again, the connections holding less keep reading.
+    *
+    * @param bytes 0 removes the budget.
+    * @note It can be called in any thread. The connections which pause do not
+    * drop what they hold, pair it with TcpConnection::setReadTimeout() so
+    * that the peers which never complete a message are closed.
+    */
+   void setRecvMemoryBudget(size_t bytes)
+   {
+      m_recvMemoryBudget.store(bytes, std::memory_order_relaxed);
+   }
+   size_t recvMemoryBudget() const
+   {
+      return m_recvMemoryBudget.load(std::memory_order_relaxed);
+   }
+
+   /**
+    * @brief Return the bytes held by the receive buffers of the connections
+    * of the loop, as of their last read.
+    *
+    * @return size_t
+    * @note It can be called in any thread.
+    */
+   size_t recvMemory() const
+   {
+      return m_recvMemory.load(std::memory_order_relaxed);
+   }
+
    /**
     * @brief Check if the event loop is calling a function.
     *
@@ -274,6 +346,34 @@ public:
    void runOnQuit(Functor &&cb);
    void runOnQuit(const Functor &cb);
 
+   /**
+    * @brief Run a function at the end of every iteration of the event loop,
+    * after the I/O events and the queued functions have been handled.
+    *
+    * @param cb the function to run
+    * @return uint64_t The ID used to remove the function.
+    * @note This method must be called in the thread of the event loop.
+    */
+   uint64_t addIterationHook(Functor &&cb);
+
+   /**
+    * @brief Stop running the function registered by addIterationHook().
+    *
+    * @param id The ID of the function.
+    * @note This method must be called in the thread of the event loop.
+    */
+   void removeIterationHook(uint64_t id);
+
+   /**
+    * @brief Run a function once at the end of the current iteration of the
+    * event loop, after the iteration hooks. It lets the work of the several
+    * handlers of one iteration be batched, such as their writes.
+    *
+    * @param cb the function to run
+    * @note This method must be called in the thread of the event loop.
+    */
+   void runAtIterationEnd(Functor &&cb);
+
    /**
     * @brief New a context that can access any type
     *
@@ -298,13 +398,40 @@ private:
    void wakeupRead() const;
 #endif
    void doRunInLoopFuncs();
+   void doRunIterationHooks();
+   void doRunIterationEndFuncs();
+   void updateBusyTime(const std::chrono::steady_clock::time_point &begin);
+   // Replace the accounted bytes of a receive buffer, in the loop thread.
+   void updateRecvMemory(size_t oldBytes, size_t newBytes)
+   {
+      m_recvMemory.store(
+        m_recvMemory.load(std::memory_order_relaxed) - oldBytes + newBytes,
+        std::memory_order_relaxed);
+      if (oldBytes == 0 && newBytes > 0) { ++m_recvHolders; }
+      else if (oldBytes > 0 && newBytes == 0) { --m_recvHolders; }
+   }
+   // The bytes of the budget for each receive buffer holding some.
+   size_t recvMemoryShare() const
+   {
+      return recvMemoryBudget() / std::max<size_t>(m_recvHolders, 1);
+   }
 
    std::atomic<bool> m_looping;
    std::atomic<bool> m_quit;
 
+   // Load metrics, written by the loop thread only
+   std::atomic<uint32_t> m_busyTimeUs{0};
+   std::atomic<uint32_t> m_queueDepth{0};
+   std::atomic<size_t>   m_recvMemory{0};
+   std::atomic<size_t>   m_recvMemoryBudget{0};
+   // The receive buffers holding some bytes, in the loop thread
+   size_t                m_recvHolders{0};
+
    // For internal use only
    bool m_eventHandling;
    bool m_callingFuncs{false};
+   // Set once the queued functions of the iteration have run
+   bool m_funcsDone{false};
 
    std::thread::id         m_tid;
    std::unique_ptr<Poller> m_poller;
@@ -314,7 +441,15 @@ private:
 
    MpscQueue<Functor>          m_funcs;
    std::unique_ptr<TimerQueue> m_timerQueue;
+   // Destroyed before the timer queue which turns it
+   std::unique_ptr<DeadlineWheel> m_deadlineWheel;
    MpscQueue<Functor>          m_funcOnQuit;
+
+   // deque keeps a running hook in place when another one is registered
+   std::deque<std::pair<uint64_t, Functor>> m_iterationHooks;
+   uint64_t                                 m_iterationHookId{0};
+   bool                                     m_hooksRemoved{false};
+   std::vector<Functor>                     m_iterationEndFuncs;
 #ifdef __linux__
    int                      m_wakeupFd;
    std::unique_ptr<Channel> m_wakeupChannelPtr;
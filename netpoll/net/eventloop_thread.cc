@@ -1,7 +1,10 @@
 #include "eventloop_thread.h"
 
+#define ENABLE_ELG_LOG
 #include <elog/logger.h>
 #ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
 #include <sys/prctl.h>
 #endif
 
@@ -54,3 +57,24 @@ void EventLoopThread::run()
       (void)f.get();
    });
 }
+
+bool EventLoopThread::setCpuAffinity(int cpu)
+{
+#ifdef __linux__
+   cpu_set_t cpuSet;
+   CPU_ZERO(&cpuSet);
+   CPU_SET(cpu, &cpuSet);
+   int ret =
+     ::pthread_setaffinity_np(m_thread.native_handle(), sizeof(cpuSet), &cpuSet);
+   if (ret != 0)
+   {
+      ELG_ERROR("EventLoopThread [{}] failed to pin to cpu {}",
+                m_loopThreadName, cpu);
+      return false;
+   }
+   return true;
+#else
+   (void)cpu;
+   return false;
+#endif
+}
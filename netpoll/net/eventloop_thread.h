@@ -43,6 +43,14 @@ public:
     */
    void run();
 
+   /**
+    * @brief Pin the thread to the CPU.
+    *
+    * @param cpu
+    * @return false if it is failed or not supported.
+    */
+   bool setCpuAffinity(int cpu);
+
 private:
    void threadWorker();
 
@@ -1,14 +1,22 @@
 #include "eventloop_threadpool.h"
 
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include <cassert>
+
 using namespace netpoll;
 
 EventLoopThreadPool::EventLoopThreadPool(size_t            threadNum,
                                          const StringView &name)
-  : m_loopIndex(0)
+  : m_loopIndex(0), m_loads(new LoopLoad[threadNum])
 {
    for (size_t i = 0; i < threadNum; ++i)
    {
       m_loopThreadList.emplace_back(std::make_unique<EventLoopThread>(name));
+      // The loop is not running yet, the index maps it to its load counters.
+      m_loopThreadList.back()->getLoop()->setIndex(i);
    }
 }
 
@@ -48,4 +56,137 @@ std::vector<EventLoop *> EventLoopThreadPool::getLoops() const
       ret.push_back(loopThread->getLoop());
    }
    return ret;
-}
\ No newline at end of file
+}
+
+EventLoop *EventLoopThreadPool::getLoopForPeer(const InetAddress &peer)
+{
+   return getLoopForPeer(peer, m_placement, m_selector);
+}
+
+EventLoop *EventLoopThreadPool::getLoopForPeer(const InetAddress &peer,
+                                               LoopPlacement      placement,
+                                               const LoopSelector &selector)
+{
+   auto loopNum = m_loopThreadList.size();
+   if (loopNum == 0) return nullptr;
+   if (selector)
+   {
+      auto id = selector(*this, peer);
+      assert(id < loopNum);
+      return m_loopThreadList[id]->getLoop();
+   }
+   size_t id = 0;
+   switch (placement)
+   {
+      case LoopPlacement::RoundRobin: return getNextLoop();
+      case LoopPlacement::LeastConnections: {
+         for (size_t i = 1; i < loopNum; ++i)
+         {
+            if (connectionNum(i) < connectionNum(id)) { id = i; }
+         }
+         break;
+      }
+      case LoopPlacement::PowerOfTwoChoices: {
+         if (loopNum == 1) break;
+         // xorshift64, good enough to pick two loops
+         m_randomState ^= m_randomState << 13;
+         m_randomState ^= m_randomState >> 7;
+         m_randomState ^= m_randomState << 17;
+         auto first  = static_cast<size_t>(m_randomState % loopNum);
+         auto second =
+           static_cast<size_t>((m_randomState >> 32) % (loopNum - 1));
+         if (second >= first) ++second;
+         auto firstLoad  = loadOf(first);
+         auto secondLoad = loadOf(second);
+         if (firstLoad == secondLoad)
+         {
+            id = connectionNum(first) <= connectionNum(second) ? first : second;
+         }
+         else { id = firstLoad < secondLoad ? first : second; }
+         break;
+      }
+      case LoopPlacement::PeerHash: {
+         // FNV-1a over the address bytes, the port is left out on purpose.
+         uint64_t hash = 14695981039346656037ULL;
+         auto     mix  = [&hash](uint32_t word) {
+            for (int i = 0; i < 4; ++i)
+            {
+               hash ^= (word >> (i * 8)) & 0xff;
+               hash *= 1099511628211ULL;
+            }
+         };
+         if (peer.isIpV6())
+         {
+            const uint32_t *ip6 = peer.ip6NetEndian();
+            for (int i = 0; i < 4; ++i) { mix(ip6[i]); }
+         }
+         else { mix(peer.ipNetEndian()); }
+         id = static_cast<size_t>(hash % loopNum);
+         break;
+      }
+   }
+   return m_loopThreadList[id]->getLoop();
+}
+
+size_t EventLoopThreadPool::indexOf(EventLoop *loop) const
+{
+   auto id = loop->index();
+   if (id < m_loopThreadList.size() && m_loopThreadList[id]->getLoop() == loop)
+   {
+      return id;
+   }
+   return m_loopThreadList.size();
+}
+
+void EventLoopThreadPool::onConnectionOpened(EventLoop *loop)
+{
+   auto id = indexOf(loop);
+   if (id < m_loopThreadList.size())
+   {
+      m_loads[id].connections.fetch_add(1, std::memory_order_relaxed);
+   }
+}
+
+void EventLoopThreadPool::onConnectionClosed(EventLoop *loop)
+{
+   auto id = indexOf(loop);
+   if (id < m_loopThreadList.size())
+   {
+      m_loads[id].connections.fetch_sub(1, std::memory_order_relaxed);
+   }
+}
+
+size_t EventLoopThreadPool::loadOf(size_t id) const
+{
+   auto *loop = m_loopThreadList[id]->getLoop();
+   if (!loop) return 0;
+   return static_cast<size_t>(loop->busyTimeUs()) + loop->queueDepth();
+}
+
+bool EventLoopThreadPool::pinToCpus(std::vector<int> *cpus)
+{
+   if (cpus) { cpus->assign(m_loopThreadList.size(), -1); }
+#ifdef __linux__
+   // The process may be confined to some CPUs by taskset or a cgroup.
+   cpu_set_t allowed;
+   CPU_ZERO(&allowed);
+   if (::sched_getaffinity(0, sizeof(allowed), &allowed) != 0) { return false; }
+   std::vector<int> allowedCpus;
+   for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+   {
+      if (CPU_ISSET(cpu, &allowed)) { allowedCpus.push_back(cpu); }
+   }
+   if (allowedCpus.empty()) { return false; }
+   bool ok = true;
+   for (size_t i = 0; i < m_loopThreadList.size(); ++i)
+   {
+      auto cpu    = allowedCpus[i % allowedCpus.size()];
+      bool pinned = m_loopThreadList[i]->setCpuAffinity(cpu);
+      if (pinned && cpus) { (*cpus)[i] = cpu; }
+      ok = pinned && ok;
+   }
+   return ok;
+#else
+   return false;
+#endif
+}
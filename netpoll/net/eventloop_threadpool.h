@@ -1,11 +1,38 @@
 #pragma once
 
 #include <netpoll/net/eventloop_thread.h>
+#include <netpoll/net/inet_address.h>
 
+#include <atomic>
+#include <functional>
 #include <memory>
 #include <vector>
 
 namespace netpoll {
+class EventLoopThreadPool;
+
+/**
+ * @brief The built-in policies used by EventLoopThreadPool::getLoopForPeer()
+ * to place a new connection.
+ */
+enum class LoopPlacement {
+   // Strict rotation, the same as getNextLoop().
+   RoundRobin,
+   // The loop holding the fewest connections.
+   LeastConnections,
+   // The less loaded of two random loops, the load is the busy time and the
+   // queue depth of the loop.
+   PowerOfTwoChoices,
+   // A hash of the peer IP, connections from one host share a loop.
+   PeerHash
+};
+
+/**
+ * Custom placement, returns the index of the loop for the peer.
+ */
+using LoopSelector =
+  std::function<size_t(const EventLoopThreadPool &, const InetAddress &)>;
+
 /**
  * @brief This class represents a pool of EventLoopThread objects
  *
@@ -42,7 +69,7 @@ public:
     *
     * @return size_t
     */
-   size_t size() { return m_loopThreadList.size(); }
+   size_t size() const { return m_loopThreadList.size(); }
 
    /**
     * @brief New the next event loop in the pool.
@@ -51,6 +78,75 @@ public:
     */
    EventLoop *getNextLoop();
 
+   /**
+    * @brief New the event loop for a new connection from the peer according
+    * to the placement policy.
+    *
+    * @param peer
+    * @return EventLoop*
+    * @note It is not thread-safe, call it from the accepting loop only.
+    */
+   EventLoop *getLoopForPeer(const InetAddress &peer);
+
+   /**
+    * @brief Same as above with the policy of the caller, so that the servers
+    * sharing the pool can place their connections differently.
+    *
+    * @param peer
+    * @param placement
+    * @param selector Used instead of placement if it is not empty.
+    * @return EventLoop*
+    */
+   EventLoop *getLoopForPeer(const InetAddress &peer, LoopPlacement placement,
+                             const LoopSelector &selector);
+
+   /**
+    * @brief Set the policy used by getLoopForPeer(), the default one is
+    * LoopPlacement::RoundRobin.
+    *
+    * @param placement
+    */
+   void setPlacement(LoopPlacement placement)
+   {
+      m_placement = placement;
+      m_selector  = nullptr;
+   }
+   void setPlacement(LoopSelector selector)
+   {
+      m_selector = std::move(selector);
+   }
+
+   /**
+    * @brief Update the connection counter of the loop, the counters are read
+    * by the placement policies.
+    *
+    * @param loop An event loop of the pool, other loops are ignored.
+    * @note It can be called in any thread.
+    */
+   void onConnectionOpened(EventLoop *loop);
+   void onConnectionClosed(EventLoop *loop);
+
+   /**
+    * @brief Return the number of connections placed on the loop in the `id`
+    * position and not closed yet.
+    *
+    * @param id
+    * @return size_t
+    */
+   size_t connectionNum(size_t id) const
+   {
+      return m_loads[id].connections.load(std::memory_order_relaxed);
+   }
+
+   /**
+    * @brief Return the live load of the loop in the `id` position, it is the
+    * busy time in microseconds plus the queue depth of the loop.
+    *
+    * @param id
+    * @return size_t
+    */
+   size_t loadOf(size_t id) const;
+
    /**
     * @brief New the event loop in the `id` position in the pool.
     *
@@ -67,8 +163,30 @@ public:
     */
    std::vector<EventLoop *> getLoops() const;
 
+   /**
+    * @brief Pin the loops round-robin to the CPUs the process may run on,
+    * the loop in the `id` position to the (id % their number)-th of them, so
+    * that the loop of a connection can be chosen by the CPU which received
+    * it.
+    *
+    * @param cpus If not nullptr, set to the CPU of each loop by its `id`, -1
+    * for a loop which is not pinned.
+    * @return false if any loop is not pinned.
+    */
+   bool pinToCpus(std::vector<int> *cpus = nullptr);
+
 private:
+   struct alignas(64) LoopLoad
+   {
+      std::atomic<size_t> connections{0};
+   };
+   size_t indexOf(EventLoop *loop) const;
+
    std::vector<std::unique_ptr<EventLoopThread>> m_loopThreadList;
    size_t                                        m_loopIndex;
+   std::unique_ptr<LoopLoad[]>                   m_loads;
+   LoopPlacement m_placement{LoopPlacement::RoundRobin};
+   LoopSelector  m_selector;
+   uint64_t      m_randomState{0x9E3779B97F4A7C15ULL};
 };
 }   // namespace netpoll
@@ -32,8 +32,39 @@ Acceptor::Acceptor(EventLoop *loop, const InetAddress &addr, bool reUseAddr,
    }
 }
 
+#ifndef _WIN32
+Acceptor::Acceptor(EventLoop *loop, const Acceptor &listener)
+  : m_idleFd(::open("/dev/null", O_RDONLY | O_CLOEXEC)),
+    // A duplicated fd refers to the same listening socket and can be closed
+    // independently.
+    m_sock(::fcntl(listener.m_sock.fd(), F_DUPFD_CLOEXEC, 0)),
+    m_addr(listener.m_addr),
+    m_loop(loop),
+    m_acceptChannel(loop, m_sock.fd()),
+    m_shared(true)
+{
+   if (m_sock.fd() < 0) { ELG_FATAL("Acceptor dup listening socket failed"); }
+   m_acceptChannel.setReadCallback([this] { handleRead(); });
+}
+#endif
+
+Acceptor::Acceptor(EventLoop *loop, int listenFd)
+  :
+#ifndef _WIN32
+    m_idleFd(::open("/dev/null", O_RDONLY | O_CLOEXEC)),
+#endif
+    m_sock(listenFd),
+    m_addr(Socket::getLocalAddr(listenFd)),
+    m_loop(loop),
+    m_acceptChannel(loop, m_sock.fd()),
+    m_listening(true)
+{
+   m_acceptChannel.setReadCallback([this] { handleRead(); });
+}
+
 Acceptor::~Acceptor()
 {
+   if (paused()) { m_loop->cancelTimer(m_resumeTimer); }
    m_acceptChannel.disableAll();
    m_acceptChannel.remove();
 #ifndef _WIN32
@@ -41,20 +72,54 @@ Acceptor::~Acceptor()
 #endif
 }
 
+void Acceptor::listenSocket()
+{
+   if (m_listening) { return; }
+   m_listening = true;
+   m_sock.listen();
+}
+
 void Acceptor::listen()
 {
    m_loop->assertInLoopThread();
-   m_sock.listen();
+   listenSocket();
+   watch();
+}
+
+void Acceptor::watch()
+{
+#ifdef __linux__
+   if (m_shared)
+   {
+      m_acceptChannel.enableExclusiveReading();
+      return;
+   }
+#endif
    m_acceptChannel.enableReading();
 }
 
 void Acceptor::handleRead()
 {
-   InetAddress peer;
-   int         newsock = m_sock.accept(&peer);
-   if (newsock >= 0)
+   // Drain the backlog instead of going back through the poller once per
+   // connection.
+   m_accepted.clear();
+   for (size_t i = 0; i < m_batchSize && !paused(); ++i)
    {
-      if (m_newConnectionCallback) { m_newConnectionCallback(newsock, peer); }
+      InetAddress peer;
+      int         newsock = m_sock.accept(&peer);
+      if (newsock < 0)
+      {
+         handleAcceptError();
+         break;
+      }
+      if (m_newConnectionBatchCallback)
+      {
+         m_accepted.emplace_back(newsock, peer);
+      }
+      else if (m_newConnectionCallback)
+      {
+         m_newConnectionCallback(newsock, peer);
+      }
       else
       {
 #ifndef _WIN32
@@ -64,21 +129,48 @@ void Acceptor::handleRead()
 #endif
       }
    }
-   else
-   {
-      ELG_ERROR("Accpetor::handleRead");
+   if (!m_accepted.empty()) { m_newConnectionBatchCallback(m_accepted); }
+}
+
+void Acceptor::pauseUntil(std::function<bool()> &&ready, double interval)
+{
+   m_loop->assertInLoopThread();
+   if (paused() || m_acceptChannel.isNoneEvent()) { return; }
+   // Removed rather than only disabled, an exclusive watch can only be added
+   // again.
+   m_acceptChannel.disableAll();
+   m_acceptChannel.remove();
+   m_resumeTimer = m_loop->runEvery(
+     interval, [this, ready = std::move(ready)](TimerId id) {
+        if (!ready()) { return; }
+        m_loop->cancelTimer(id);
+        m_resumeTimer = InvalidTimerId;
+        watch();
+     });
+}
+
+void Acceptor::handleAcceptError()
+{
+#ifndef _WIN32
+   // The backlog is drained, or another event loop sharing the socket took the
+   // connection.
+   if (errno == EAGAIN || errno == EWOULDBLOCK) { return; }
+#else
+   if (WSAGetLastError() == WSAEWOULDBLOCK) { return; }
+#endif
+   ELG_ERROR("Accpetor::handleRead");
 // Read the section named "The special problem of
 // accept()ing when you can't" in libev's doc.
 // By Marc Lehmann, author of libev.
 /// errno is thread safe
 #ifndef _WIN32
-      if (errno == EMFILE)
-      {
-         ::close(m_idleFd);
-         m_idleFd = m_sock.accept(&peer);
-         ::close(m_idleFd);
-         m_idleFd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
-      }
-#endif
+   if (errno == EMFILE)
+   {
+      InetAddress peer;
+      ::close(m_idleFd);
+      m_idleFd = m_sock.accept(&peer);
+      ::close(m_idleFd);
+      m_idleFd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
    }
+#endif
 }
@@ -6,6 +6,8 @@
 #include <netpoll/util/noncopyable.h>
 
 #include <functional>
+#include <utility>
+#include <vector>
 
 #include "socket.h"
 
@@ -15,6 +17,9 @@ namespace netpoll {
  * A class used to replace the accept operation
  */
 using NewConnectionCallback = std::function<void(int fd, const InetAddress &)>;
+using AcceptedList          = std::vector<std::pair<int, InetAddress>>;
+
+using NewConnectionBatchCallback = std::function<void(const AcceptedList &)>;
 class TcpServer;
 class Acceptor : noncopyable
 {
@@ -31,19 +36,122 @@ public:
    Acceptor(EventLoop *loop, const InetAddress &addr, bool reUseAddr = true,
             bool reUsePort = true);
 
+   /**
+    * @brief Construct an acceptor watching the listening socket of another
+    * acceptor in its own event loop. The event loops sharing a socket are woken
+    * up one at a time with EPOLLEXCLUSIVE where it is supported.
+    *
+    * @param loop
+    * @param listener The acceptor that bound the socket.
+    */
+#ifndef _WIN32
+   Acceptor(EventLoop *loop, const Acceptor &listener);
+#endif
+
+   /**
+    * @brief Construct an acceptor taking over a socket which is already
+    * bound and listening, such as one handed over by another process.
+    *
+    * @param loop
+    * @param listenFd
+    */
+   Acceptor(EventLoop *loop, int listenFd);
+
    ~Acceptor();
 
    const InetAddress &addr() const { return m_addr; }
 
+   EventLoop *getLoop() const { return m_loop; }
+
+   int fd() const { return m_sock.fd(); }
+
+   bool listening() const { return m_listening; }
+
+   bool shared() const { return m_shared; }
+
    void setNewConnectionCallback(const NewConnectionCallback &cb)
    {
       m_newConnectionCallback = cb;
    };
 
+   /**
+    * @brief Set the callback called once with all the connections accepted in
+    * one readiness event, it takes the place of the new connection callback.
+    *
+    * @param cb
+    */
+   void setNewConnectionBatchCallback(const NewConnectionBatchCallback &cb)
+   {
+      m_newConnectionBatchCallback = cb;
+   }
+
+   /**
+    * @brief Set the maximum number of connections accepted in one readiness
+    * event, the default is kDefaultBatchSize.
+    *
+    * @param size
+    */
+   void setBatchSize(size_t size)
+   {
+      assert(size > 0);
+      m_batchSize = size;
+   }
+
+   static constexpr size_t kDefaultBatchSize = 32;
+
+   /**
+    * @brief Start listening on the socket without watching it, it can be
+    * called in any thread. It makes the order in which the sockets of a
+    * SO_REUSEPORT group listen deterministic.
+    *
+    */
+   void listenSocket();
+
+   /**
+    * @brief Start listening on the socket if it is not yet, and watch it in
+    * the event loop.
+    *
+    */
    void listen();
 
+   /**
+    * @brief Steer connections to the listening sockets of the SO_REUSEPORT
+    * group of this acceptor by the receiving CPU.
+    *
+    * @param cpus The CPU of each listening socket of the group, in the order
+    * they joined it.
+    * @return false if it is not supported.
+    */
+   bool steerByCpu(const std::vector<int> &cpus)
+   {
+      return m_sock.attachReusePortCpuProgram(cpus);
+   }
+
+   /**
+    * @brief Accept connections once their first data arrives, see
+    * Socket::setDeferAccept().
+    *
+    * @param timeout
+    * @return false if it is not supported.
+    */
+   bool deferAccept(int timeout) { return m_sock.setDeferAccept(timeout); }
+
+   /**
+    * @brief Stop watching the socket until ready() returns true, it is checked
+    * every interval seconds in the loop. The connections wait in the backlog
+    * of the socket meanwhile.
+    *
+    * @param ready
+    * @param interval
+    */
+   void pauseUntil(std::function<bool()> &&ready, double interval);
+
+   bool paused() const { return m_resumeTimer != InvalidTimerId; }
+
 protected:
+   void watch();
    void handleRead();
+   void handleAcceptError();
 #ifndef _WIN32
    int m_idleFd;
 #endif
@@ -52,5 +160,12 @@ protected:
    EventLoop            *m_loop;
    NewConnectionCallback m_newConnectionCallback;
    Channel               m_acceptChannel;
+   bool                  m_shared{false};
+   bool                  m_listening{false};
+
+   NewConnectionBatchCallback m_newConnectionBatchCallback;
+   AcceptedList               m_accepted;
+   size_t                     m_batchSize{kDefaultBatchSize};
+   TimerId                    m_resumeTimer{InvalidTimerId};
 };
 }   // namespace netpoll
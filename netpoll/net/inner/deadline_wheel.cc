@@ -0,0 +1,229 @@
+#include "deadline_wheel.h"
+
+#include <netpoll/util/defer_call.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+using namespace netpoll;
+
+DeadlineWheel::DeadlineWheel(EventLoop *loop, double tickInterval,
+                             size_t slotNum)
+  : m_loop(loop),
+    m_tickInterval(tickInterval),
+    m_start(std::chrono::steady_clock::now()),
+    m_slots(slotNum, kNil)
+{
+   assert(tickInterval > 0);
+   assert(slotNum > 0);
+}
+
+DeadlineWheel::~DeadlineWheel()
+{
+   if (m_timerId != InvalidTimerId) { m_loop->cancelTimer(m_timerId); }
+}
+
+double DeadlineWheel::elapsedTicks() const
+{
+   return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                        m_start)
+            .count() /
+          m_tickInterval;
+}
+
+uint32_t DeadlineWheel::insert(double delay)
+{
+   m_loop->assertInLoopThread();
+   uint32_t index;
+   if (m_freeEntries.empty())
+   {
+      index = static_cast<uint32_t>(m_entries.size());
+      m_entries.emplace_back();
+   }
+   else
+   {
+      index = m_freeEntries.back();
+      m_freeEntries.pop_back();
+   }
+   auto &entry = m_entries[index];
+   // The first tick at or after the deadline, which has not been passed yet.
+   auto expireTick = static_cast<uint64_t>(
+     std::ceil(elapsedTicks() + std::max(delay, 0.0) / m_tickInterval));
+   entry.expireTick = std::max(expireTick, m_currentTick + 1);
+   entry.pending    = true;
+   auto &head       = m_slots[entry.expireTick % m_slots.size()];
+   entry.prev       = kNil;
+   entry.next       = head;
+   if (head != kNil) { m_entries[head].prev = index; }
+   head = index;
+   ++m_size;
+   if (m_timerId == InvalidTimerId)
+   {
+      m_timerId =
+        m_loop->runEvery(m_tickInterval, [this](TimerId) { advance(); });
+   }
+   return index;
+}
+
+DeadlineWheel::Id DeadlineWheel::idOf(uint32_t index) const
+{
+   return (static_cast<uint64_t>(m_entries[index].generation) << 32) | index;
+}
+
+DeadlineWheel::Id DeadlineWheel::add(double delay, Functor &&cb)
+{
+   auto index          = insert(delay);
+   m_entries[index].cb = std::move(cb);
+   return idOf(index);
+}
+
+DeadlineWheel::Id DeadlineWheel::add(double delay, Owner *owner,
+                                     DeadlineCallback &&cb)
+{
+   auto  index   = insert(delay);
+   auto &entry   = m_entries[index];
+   entry.owner   = owner;
+   entry.ownerCb = std::move(cb);
+   return idOf(index);
+}
+
+DeadlineWheel::Entry *DeadlineWheel::find(Id id)
+{
+   auto index = static_cast<uint32_t>(id);
+   if (index >= m_entries.size()) { return nullptr; }
+   auto &entry = m_entries[index];
+   if (!entry.pending || entry.generation != static_cast<uint32_t>(id >> 32))
+   {
+      return nullptr;
+   }
+   return &entry;
+}
+
+bool DeadlineWheel::cancel(Id id)
+{
+   m_loop->assertInLoopThread();
+   auto *entry = find(id);
+   if (!entry)
+   {
+      if (!m_running) { return false; }
+      for (auto &expired : *m_running)
+      {
+         if (expired.id == id && (expired.cb || expired.owner))
+         {
+            expired.cb    = nullptr;
+            expired.owner = nullptr;
+            return true;
+         }
+      }
+      return false;
+   }
+   unlink(static_cast<uint32_t>(id));
+   recycle(static_cast<uint32_t>(id));
+   return true;
+}
+
+Functor DeadlineWheel::release(Id id, double *remaining)
+{
+   m_loop->assertInLoopThread();
+   auto *entry = find(id);
+   if (!entry) { return Functor(); }
+   *remaining =
+     std::max((static_cast<double>(entry->expireTick) - elapsedTicks()) *
+                m_tickInterval,
+              0.0);
+   auto cb = std::move(entry->cb);
+   unlink(static_cast<uint32_t>(id));
+   recycle(static_cast<uint32_t>(id));
+   return cb;
+}
+
+bool DeadlineWheel::release(Id id, double *remaining, DeadlineCallback *cb)
+{
+   m_loop->assertInLoopThread();
+   auto *entry = find(id);
+   if (!entry) { return false; }
+   *remaining =
+     std::max((static_cast<double>(entry->expireTick) - elapsedTicks()) *
+                m_tickInterval,
+              0.0);
+   *cb = std::move(entry->ownerCb);
+   unlink(static_cast<uint32_t>(id));
+   recycle(static_cast<uint32_t>(id));
+   return true;
+}
+
+void DeadlineWheel::unlink(uint32_t index)
+{
+   auto &entry = m_entries[index];
+   if (entry.prev != kNil) { m_entries[entry.prev].next = entry.next; }
+   else { m_slots[entry.expireTick % m_slots.size()] = entry.next; }
+   if (entry.next != kNil) { m_entries[entry.next].prev = entry.prev; }
+}
+
+void DeadlineWheel::recycle(uint32_t index)
+{
+   auto &entry   = m_entries[index];
+   entry.pending = false;
+   entry.cb      = nullptr;
+   entry.owner   = nullptr;
+   entry.ownerCb = nullptr;
+   // The ID of the old deadline must not cancel the next one in this entry.
+   if (++entry.generation == 0) { entry.generation = 1; }
+   m_freeEntries.push_back(index);
+   --m_size;
+}
+
+void DeadlineWheel::advance()
+{
+   auto now = static_cast<uint64_t>(elapsedTicks());
+   if (now > m_currentTick)
+   {
+      // After a long stall one turn visits every slot.
+      auto steps = std::min<uint64_t>(now - m_currentTick, m_slots.size());
+      for (uint64_t i = 1; i <= steps; ++i)
+      {
+         auto index = m_slots[(m_currentTick + i) % m_slots.size()];
+         while (index != kNil)
+         {
+            auto  next  = m_entries[index].next;
+            auto &entry = m_entries[index];
+            if (entry.expireTick <= now)
+            {
+               m_expired.push_back({idOf(index), std::move(entry.cb),
+                                    entry.owner, std::move(entry.ownerCb)});
+               unlink(index);
+               recycle(index);
+            }
+            index = next;
+         }
+      }
+      m_currentTick = now;
+      // The callbacks may add and cancel deadlines, they run after the slots
+      // have been walked. A callback may cancel one expired after it.
+      std::vector<Expired> expired;
+      expired.swap(m_expired);
+      m_running         = &expired;
+      auto runningReset = makeDeferCall([this]() { m_running = nullptr; });
+      for (size_t i = 0; i < expired.size(); ++i)
+      {
+         // Taken out first, so that it no longer counts as cancellable.
+         auto *owner      = expired[i].owner;
+         expired[i].owner = nullptr;
+         if (owner)
+         {
+            owner->onDeadline(expired[i].id, std::move(expired[i].ownerCb));
+            continue;
+         }
+         auto cb = std::move(expired[i].cb);
+         if (cb) { cb(); }
+      }
+      expired.clear();
+      if (m_expired.empty()) { m_expired.swap(expired); }
+   }
+   if (m_size == 0)
+   {
+      m_loop->cancelTimer(m_timerId);
+      m_timerId = InvalidTimerId;
+   }
+}
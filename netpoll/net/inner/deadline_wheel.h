@@ -0,0 +1,152 @@
+#pragma once
+#include <netpoll/util/noncopyable.h>
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#include "../callbacks.h"
+#include "../eventloop.h"
+
+namespace netpoll {
+/**
+ * @brief A hashed timing wheel holding the deadlines of the connections of
+ * one event loop. Adding and cancelling a deadline take constant time and do
+ * not allocate once the wheel has grown, a single repeating timer of the loop
+ * turns the wheel while it holds deadlines.
+ *
+ * @note A deadline fires on the first tick at or after its time, so it may be
+ * late by up to one tick interval. All methods must be called in the thread of
+ * the event loop.
+ */
+class DeadlineWheel : noncopyable
+{
+public:
+   // 0 is never the ID of a deadline.
+   using Id = uint64_t;
+
+   /**
+    * @brief The owner of the deadlines added with a DeadlineCallback, such as
+    * a connection. The wheel keeps the callback next to the owner, so adding
+    * the deadline allocates nothing.
+    *
+    * @note The owner must cancel its deadlines before it is destroyed.
+    */
+   class Owner
+   {
+   public:
+      virtual void onDeadline(Id id, DeadlineCallback &&cb) = 0;
+
+   protected:
+      ~Owner() = default;
+   };
+
+   /**
+    * @brief Construct a new deadline wheel.
+    *
+    * @param loop The event loop in which the wheel turns.
+    * @param tickInterval The resolution of the deadlines in seconds.
+    * @param slotNum The number of slots, deadlines later than one turn of the
+    * wheel wait in their slot for more turns.
+    */
+   explicit DeadlineWheel(EventLoop *loop, double tickInterval = 0.01,
+                          size_t slotNum = 1024);
+   ~DeadlineWheel();
+
+   /**
+    * @brief Run cb after delay seconds unless the deadline is cancelled.
+    *
+    * @param delay
+    * @param cb
+    * @return Id
+    */
+   Id add(double delay, Functor &&cb);
+
+   /**
+    * @brief Call owner->onDeadline() with the ID and cb after delay seconds
+    * unless the deadline is cancelled.
+    *
+    * @param delay
+    * @param owner
+    * @param cb
+    * @return Id
+    */
+   Id add(double delay, Owner *owner, DeadlineCallback &&cb);
+
+   /**
+    * @brief Cancel a deadline. A deadline which has expired but whose
+    * callback has not run yet, because it expired on the tick being handled,
+    * is cancelled too.
+    *
+    * @param id
+    * @return true if the deadline was pending.
+    */
+   bool cancel(Id id);
+
+   /**
+    * @brief Cancel a deadline and hand back its callback and the seconds
+    * left, so that it can be added to the wheel of another loop.
+    *
+    * @param id
+    * @param remaining
+    * @return Functor empty if the deadline was not pending.
+    */
+   Functor release(Id id, double *remaining);
+
+   /**
+    * @brief Like release() for a deadline added with an owner.
+    *
+    * @param id
+    * @param remaining
+    * @param cb
+    * @return false if the deadline was not pending.
+    */
+   bool release(Id id, double *remaining, DeadlineCallback *cb);
+
+   size_t size() const { return m_size; }
+
+private:
+   static constexpr uint32_t kNil = UINT32_MAX;
+   struct Entry
+   {
+      uint64_t         expireTick{0};
+      uint32_t         prev{kNil};
+      uint32_t         next{kNil};
+      uint32_t         generation{1};
+      bool             pending{false};
+      Functor          cb;
+      // Set instead of cb for a deadline added with an owner
+      Owner           *owner{nullptr};
+      DeadlineCallback ownerCb;
+   };
+   struct Expired
+   {
+      Id               id;
+      Functor          cb;
+      Owner           *owner;
+      DeadlineCallback ownerCb;
+   };
+   double   elapsedTicks() const;
+   // Link a free entry into the slot of the deadline and return its index.
+   uint32_t insert(double delay);
+   Id       idOf(uint32_t index) const;
+   Entry   *find(Id id);
+   void     unlink(uint32_t index);
+   void     recycle(uint32_t index);
+   void     advance();
+
+   EventLoop                            *m_loop;
+   double                                m_tickInterval;
+   std::chrono::steady_clock::time_point m_start;
+   // The first entry of every slot
+   std::vector<uint32_t>                 m_slots;
+   std::vector<Entry>                    m_entries;
+   std::vector<uint32_t>                 m_freeEntries;
+   std::vector<Expired>                  m_expired;
+   // The expired deadlines whose callbacks are running
+   std::vector<Expired>                 *m_running{nullptr};
+   uint64_t                              m_currentTick{0};
+   size_t                                m_size{0};
+   TimerId                               m_timerId{InvalidTimerId};
+};
+}   // namespace netpoll
@@ -3,13 +3,41 @@
 #include <elog/logger.h>
 #include <sys/types.h>
 
+#include <algorithm>
 #include <cassert>
+#include <climits>
 #ifdef _WIN32
 #include <ws2tcpip.h>
 #else
 #include <netinet/tcp.h>
 #include <sys/socket.h>
 #endif
+#ifdef __linux__
+#include <linux/errqueue.h>
+#include <linux/filter.h>
+#include <netinet/in.h>
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49
+#endif
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef TCP_NOTSENT_LOWAT
+#define TCP_NOTSENT_LOWAT 25
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+#endif
 
 using namespace netpoll;
 using namespace elog;
@@ -274,6 +302,176 @@ int Socket::getSocketError()
 	{ return optval; }
 }
 
+int Socket::getIncomingCpu() const
+{
+#ifdef __linux__
+	int cpu = -1;
+	auto optlen = static_cast<socklen_t>(sizeof cpu);
+	if (::getsockopt(m_sockFd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &optlen) < 0)
+	{ return -1; }
+	return cpu;
+#else
+	return -1;
+#endif
+}
+
+bool Socket::attachReusePortCpuProgram(const std::vector<int> &cpus)
+{
+#ifdef __linux__
+	assert(!cpus.empty());
+	auto groupSize = static_cast<uint32_t>(cpus.size());
+	// A = raw_smp_processor_id()
+	std::vector<struct sock_filter> code = {
+		{BPF_LD | BPF_W | BPF_ABS, 0, 0,
+		 static_cast<uint32_t>(SKF_AD_OFF + SKF_AD_CPU)},
+	};
+	// if (A == cpus[i]) return i, for the first socket of each CPU
+	std::vector<int> mapped;
+	for (uint32_t i = 0; i < groupSize && code.size() + 4 <= BPF_MAXINSNS; ++i)
+	{
+		auto cpu = cpus[i];
+		if (cpu < 0 ||
+			std::find(mapped.begin(), mapped.end(), cpu) != mapped.end())
+		{ continue; }
+		mapped.push_back(cpu);
+		code.push_back(
+		  {BPF_JMP | BPF_JEQ | BPF_K, 0, 1, static_cast<uint32_t>(cpu)});
+		code.push_back({BPF_RET | BPF_K, 0, 0, i});
+	}
+	// A = A % groupSize
+	code.push_back({BPF_ALU | BPF_MOD | BPF_K, 0, 0, groupSize});
+	// return A
+	code.push_back({BPF_RET | BPF_A, 0, 0, 0});
+	struct sock_fprog prog;
+	prog.len = static_cast<unsigned short>(code.size());
+	prog.filter = code.data();
+	if (::setsockopt(m_sockFd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+		static_cast<socklen_t>(sizeof prog)) < 0)
+	{
+		ELG_ERROR("SO_ATTACH_REUSEPORT_CBPF failed.");
+		return false;
+	}
+	return true;
+#else
+	(void)cpus;
+	ELG_ERROR("SO_ATTACH_REUSEPORT_CBPF is not supported.");
+	return false;
+#endif
+}
+
+bool Socket::setDeferAccept(int timeout)
+{
+#ifdef TCP_DEFER_ACCEPT
+	if (::setsockopt(m_sockFd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &timeout,
+		static_cast<socklen_t>(sizeof timeout)) < 0)
+	{
+		ELG_ERROR("TCP_DEFER_ACCEPT failed.");
+		return false;
+	}
+	return true;
+#else
+	(void)timeout;
+	ELG_ERROR("TCP_DEFER_ACCEPT is not supported.");
+	return false;
+#endif
+}
+
+bool Socket::setMaxPacingRate(uint64_t rate)
+{
+#ifdef SO_MAX_PACING_RATE
+	// The option is 32 bits wide on older kernels, ~0U means unlimited.
+	uint64_t value = rate == 0 ? ~0ULL : rate;
+	if (::setsockopt(m_sockFd, SOL_SOCKET, SO_MAX_PACING_RATE, &value,
+		static_cast<socklen_t>(sizeof value)) < 0)
+	{
+		uint32_t value32 = rate == 0 || rate >= ~0U ? ~0U
+			: static_cast<uint32_t>(rate);
+		if (::setsockopt(m_sockFd, SOL_SOCKET, SO_MAX_PACING_RATE, &value32,
+			static_cast<socklen_t>(sizeof value32)) < 0)
+		{
+			ELG_TRACE("SO_MAX_PACING_RATE failed, errno={}", errno);
+			return false;
+		}
+	}
+	return true;
+#else
+	(void)rate;
+	return false;
+#endif
+}
+
+bool Socket::setZeroCopy(bool on)
+{
+#ifdef __linux__
+	int optval = on ? 1 : 0;
+	if (::setsockopt(m_sockFd, SOL_SOCKET, SO_ZEROCOPY, &optval,
+		static_cast<socklen_t>(sizeof optval)) < 0)
+	{
+		ELG_TRACE("SO_ZEROCOPY failed, errno={}", errno);
+		return false;
+	}
+	return true;
+#else
+	(void)on;
+	return false;
+#endif
+}
+
+bool Socket::setNotSentLowat(size_t bytes)
+{
+#ifdef TCP_NOTSENT_LOWAT
+	int optval = static_cast<int>(std::min<size_t>(bytes, INT_MAX));
+	if (::setsockopt(m_sockFd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &optval,
+		static_cast<socklen_t>(sizeof optval)) < 0)
+	{
+		ELG_TRACE("TCP_NOTSENT_LOWAT failed, errno={}", errno);
+		return false;
+	}
+	return true;
+#else
+	(void)bytes;
+	return false;
+#endif
+}
+
+#ifdef __linux__
+ssize_t Socket::sendZeroCopy(const void *data, size_t length)
+{
+	return ::send(m_sockFd, data, length, MSG_ZEROCOPY);
+}
+
+bool Socket::readErrorQueue(bool *completed, uint32_t *last, bool *copied)
+{
+	char   control[128];
+	msghdr msg{};
+	msg.msg_control    = control;
+	msg.msg_controllen = sizeof control;
+	*completed         = false;
+	if (::recvmsg(m_sockFd, &msg, MSG_ERRQUEUE) < 0)
+	{
+		return false;
+	}
+	for (auto *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+			!(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+		{
+			continue;
+		}
+		auto *err = reinterpret_cast<sock_extended_err *>(CMSG_DATA(cmsg));
+		if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+		{
+			continue;
+		}
+		// ee_info to ee_data is the range of the completed sends.
+		*completed = true;
+		*last      = err->ee_data;
+		*copied    = (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0;
+	}
+	return true;
+}
+#endif
+
 Socket::~Socket()
 {
 	ELG_TRACE("Socket deconstructed:{}", m_sockFd);
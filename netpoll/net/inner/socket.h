@@ -2,15 +2,17 @@
 
 #include <netpoll/net/inet_address.h>
 #include <netpoll/util/noncopyable.h>
+#include <netpoll/util/object_pool.h>
 
 #include <string>
+#include <vector>
 #ifndef _WIN32
 #include <unistd.h>
 #endif
 #include <fcntl.h>
 
 namespace netpoll {
-class Socket : noncopyable
+class Socket : noncopyable, public PoolAllocated<Socket>
 {
 public:
    static int createNonblockingSocketOrDie(int family);
@@ -57,6 +59,63 @@ public:
    void setKeepAlive(bool on);
    int  getSocketError();
 
+   ///
+   /// Get SO_INCOMING_CPU, the CPU that handled the packets of the socket,
+   /// return -1 if it is unknown or not supported.
+   ///
+   int getIncomingCpu() const;
+
+   ///
+   /// Attach a SO_ATTACH_REUSEPORT_CBPF program to the SO_REUSEPORT group of
+   /// the socket. cpus has the CPU of each listening socket in listen() order,
+   /// a connection received on one of them goes to the first socket of that
+   /// CPU, the others to the socket at index (cpu % cpus.size()).
+   ///
+   bool attachReusePortCpuProgram(const std::vector<int> &cpus);
+
+   ///
+   /// Set TCP_DEFER_ACCEPT on a listening socket, a connection is accepted
+   /// once its first data arrives or after about timeout seconds. Return false
+   /// if it is not supported.
+   ///
+   bool setDeferAccept(int timeout);
+
+   ///
+   /// Set SO_MAX_PACING_RATE, the kernel paces the packets of the socket to
+   /// rate bytes per second, 0 removes the limit. Return false if it is not
+   /// supported.
+   ///
+   bool setMaxPacingRate(uint64_t rate);
+
+   ///
+   /// Set SO_ZEROCOPY, so that the sends of sendZeroCopy() are not copied
+   /// into the kernel. Return false if it is not supported.
+   ///
+   bool setZeroCopy(bool on);
+
+   ///
+   /// Set TCP_NOTSENT_LOWAT, the socket is writable only while less than
+   /// bytes of the sent data wait unsent in the kernel, 0 restores the system
+   /// default. Return false if it is not supported.
+   ///
+   bool setNotSentLowat(size_t bytes);
+
+#ifdef __linux__
+   ///
+   /// Send with MSG_ZEROCOPY, the kernel reads the data from the memory of
+   /// the caller until it reports the send complete on the error queue.
+   ///
+   ssize_t sendZeroCopy(const void *data, size_t length);
+
+   ///
+   /// Read one message of the error queue, return false once it is empty.
+   /// *completed is set for a zero copy notification, which reports the sends
+   /// up to *last (they count from 0) complete, *copied is set if the kernel
+   /// copied the data anyway.
+   ///
+   bool readErrorQueue(bool *completed, uint32_t *last, bool *copied);
+#endif
+
 protected:
    int m_sockFd;
 };
@@ -0,0 +1,297 @@
+#include "socket_handoff.h"
+#ifndef _WIN32
+#define ENABLE_ELG_LOG
+#include <elog/logger.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+using namespace netpoll;
+using namespace elog;
+
+namespace {
+// Linux refuses more than 253 fds in one message.
+constexpr size_t   kMaxFdsPerMessage = 250;
+constexpr uint32_t kMagic            = 0x6e706866;   // "nphf"
+// Written by the receiver once it holds every socket, a receiver which fails
+// after reading the data closes without it.
+constexpr char     kAck              = 'k';
+// A larger unread input is taken as a broken sender.
+constexpr uint64_t kMaxUnreadSize    = 64 * 1024 * 1024;
+
+// Every message carries its fds on the header, the unread input of the
+// connections follows as plain data.
+struct Header
+{
+   uint32_t magic;
+   uint32_t listenNum;
+   uint32_t connNum;
+   uint32_t more;
+};
+
+bool makeAddress(const std::string &path, sockaddr_un *addr)
+{
+   if (path.size() >= sizeof(addr->sun_path))
+   {
+      ELG_ERROR("handoff path too long: {}", path);
+      return false;
+   }
+   std::memset(addr, 0, sizeof(*addr));
+   addr->sun_family = AF_UNIX;
+   std::memcpy(addr->sun_path, path.data(), path.size());
+   return true;
+}
+
+// Bound the blocking calls on the socket, they fail with EAGAIN on timeout.
+bool setTimeout(int sock, double timeout)
+{
+   timeval tv{};
+   tv.tv_sec  = static_cast<time_t>(timeout);
+   tv.tv_usec = static_cast<suseconds_t>((timeout - tv.tv_sec) * 1000000);
+   return ::setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == 0 &&
+          ::setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == 0;
+}
+
+bool writeAll(int sock, const void *data, size_t len)
+{
+   auto *ptr = static_cast<const char *>(data);
+   while (len > 0)
+   {
+      auto n = ::send(sock, ptr, len, MSG_NOSIGNAL);
+      if (n < 0)
+      {
+         if (errno == EINTR) { continue; }
+         return false;
+      }
+      ptr += n;
+      len -= static_cast<size_t>(n);
+   }
+   return true;
+}
+
+bool readAll(int sock, void *data, size_t len)
+{
+   auto *ptr = static_cast<char *>(data);
+   while (len > 0)
+   {
+      auto n = ::read(sock, ptr, len);
+      if (n <= 0)
+      {
+         if (n < 0 && errno == EINTR) { continue; }
+         return false;
+      }
+      ptr += n;
+      len -= static_cast<size_t>(n);
+   }
+   return true;
+}
+
+bool sendMessage(int sock, const Header &header, const std::vector<int> &fds)
+{
+   char   control[CMSG_SPACE(kMaxFdsPerMessage * sizeof(int))]{};
+   iovec  iov{const_cast<Header *>(&header), sizeof(header)};
+   msghdr msg{};
+   msg.msg_iov    = &iov;
+   msg.msg_iovlen = 1;
+   if (!fds.empty())
+   {
+      msg.msg_control    = control;
+      msg.msg_controllen = CMSG_SPACE(fds.size() * sizeof(int));
+      auto *cmsg         = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level   = SOL_SOCKET;
+      cmsg->cmsg_type    = SCM_RIGHTS;
+      cmsg->cmsg_len     = CMSG_LEN(fds.size() * sizeof(int));
+      std::memcpy(CMSG_DATA(cmsg), fds.data(), fds.size() * sizeof(int));
+   }
+   ssize_t n;
+   do {
+      n = ::sendmsg(sock, &msg, MSG_NOSIGNAL);
+   } while (n < 0 && errno == EINTR);
+   if (n < 0) { return false; }
+   // The fds went with the first byte.
+   return writeAll(sock, reinterpret_cast<const char *>(&header) + n,
+                   sizeof(header) - static_cast<size_t>(n));
+}
+
+bool receiveMessage(int sock, Header *header, std::vector<int> *fds)
+{
+   char   control[CMSG_SPACE(kMaxFdsPerMessage * sizeof(int))]{};
+   iovec  iov{header, sizeof(*header)};
+   msghdr msg{};
+   msg.msg_iov        = &iov;
+   msg.msg_iovlen     = 1;
+   msg.msg_control    = control;
+   msg.msg_controllen = sizeof(control);
+   ssize_t n;
+   do {
+      n = ::recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+   } while (n < 0 && errno == EINTR);
+   if (n <= 0) { return false; }
+   for (auto *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+   {
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      {
+         continue;
+      }
+      auto num = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      auto pos = fds->size();
+      fds->resize(pos + num);
+      std::memcpy(fds->data() + pos, CMSG_DATA(cmsg), num * sizeof(int));
+   }
+   if (msg.msg_flags & MSG_CTRUNC) { return false; }
+   return readAll(sock, reinterpret_cast<char *>(header) + n,
+                  sizeof(*header) - static_cast<size_t>(n));
+}
+}   // namespace
+
+bool handoff::send(const std::string &path, const HandoffState &state,
+                   double timeout)
+{
+   sockaddr_un addr;
+   if (!makeAddress(path, &addr)) { return false; }
+   int sock = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+   if (sock < 0) { return false; }
+   // SO_SNDTIMEO bounds the connect of a Unix socket too.
+   if (!setTimeout(sock, timeout) ||
+       ::connect(sock, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0)
+   {
+      ELG_ERROR("handoff connect to {} failed, errno={}", path, errno);
+      ::close(sock);
+      return false;
+   }
+   // The listening sockets go first, then the connections, at most
+   // kMaxFdsPerMessage fds per message.
+   size_t listenPos = 0, connPos = 0;
+   bool   ok        = true;
+   do {
+      Header           header{kMagic, 0, 0, 0};
+      std::vector<int> fds;
+      while (listenPos < state.listenFds.size() &&
+             fds.size() < kMaxFdsPerMessage)
+      {
+         fds.push_back(state.listenFds[listenPos++]);
+         ++header.listenNum;
+      }
+      auto connBegin = connPos;
+      while (connPos < state.connections.size() &&
+             fds.size() < kMaxFdsPerMessage)
+      {
+         fds.push_back(state.connections[connPos++].first);
+         ++header.connNum;
+      }
+      header.more = listenPos < state.listenFds.size() ||
+                    connPos < state.connections.size();
+      ok          = sendMessage(sock, header, fds);
+      for (auto i = connBegin; ok && i < connPos; ++i)
+      {
+         uint64_t size = state.connections[i].second.size();
+         ok            = writeAll(sock, &size, sizeof(size));
+      }
+      for (auto i = connBegin; ok && i < connPos; ++i)
+      {
+         auto &unread = state.connections[i].second;
+         ok           = writeAll(sock, unread.data(), unread.size());
+      }
+      if (!ok) { break; }
+      if (!header.more) { break; }
+   } while (true);
+   // Wait for the receiver to take everything.
+   char c = 0;
+   ok     = ok && ::read(sock, &c, 1) == 1 && c == kAck;
+   ::close(sock);
+   if (!ok) { ELG_ERROR("handoff to {} failed, errno={}", path, errno); }
+   return ok;
+}
+
+bool handoff::receive(const std::string &path, double timeout,
+                      HandoffState *state)
+{
+   sockaddr_un addr;
+   if (!makeAddress(path, &addr)) { return false; }
+   int listenSock = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+   if (listenSock < 0) { return false; }
+   ::unlink(path.c_str());
+   if (::bind(listenSock, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) <
+         0 ||
+       ::listen(listenSock, 1) < 0)
+   {
+      ELG_ERROR("handoff listen on {} failed, errno={}", path, errno);
+      ::close(listenSock);
+      return false;
+   }
+   pollfd pfd{listenSock, POLLIN, 0};
+   int    sock = -1;
+   if (::poll(&pfd, 1, static_cast<int>(timeout * 1000)) == 1)
+   {
+      sock = ::accept4(listenSock, nullptr, nullptr, SOCK_CLOEXEC);
+   }
+   ::close(listenSock);
+   ::unlink(path.c_str());
+   if (sock < 0)
+   {
+      ELG_ERROR("no handoff received on {}", path);
+      return false;
+   }
+   if (!setTimeout(sock, timeout))
+   {
+      ::close(sock);
+      return false;
+   }
+
+   HandoffState received;
+   bool         ok = true;
+   Header       header{};
+   do {
+      std::vector<int> fds;
+      ok = receiveMessage(sock, &header, &fds);
+      // Keep what arrived so that it is closed on failure.
+      if (ok && (header.magic != kMagic ||
+                 fds.size() != header.listenNum + header.connNum))
+      {
+         ok = false;
+      }
+      auto listenNum = ok ? header.listenNum : fds.size();
+      received.listenFds.insert(received.listenFds.end(), fds.begin(),
+                                fds.begin() + listenNum);
+      auto connBegin = received.connections.size();
+      for (auto i = listenNum; i < fds.size(); ++i)
+      {
+         received.connections.emplace_back(fds[i], std::string());
+      }
+      for (auto i = connBegin; ok && i < received.connections.size(); ++i)
+      {
+         uint64_t size = 0;
+         ok = readAll(sock, &size, sizeof(size)) && size <= kMaxUnreadSize;
+         if (ok) { received.connections[i].second.resize(size); }
+      }
+      for (auto i = connBegin; ok && i < received.connections.size(); ++i)
+      {
+         auto &unread = received.connections[i].second;
+         ok           = readAll(sock, &unread[0], unread.size());
+      }
+   } while (ok && header.more);
+   // The sender keeps the sockets unless it reads the acknowledgement.
+   ok = ok && writeAll(sock, &kAck, 1);
+   ::close(sock);
+   if (!ok)
+   {
+      ELG_ERROR("broken handoff received on {}", path);
+      closeAll(received);
+      return false;
+   }
+   *state = std::move(received);
+   return true;
+}
+
+void handoff::closeAll(const HandoffState &state)
+{
+   for (auto fd : state.listenFds) { ::close(fd); }
+   for (auto &conn : state.connections) { ::close(conn.first); }
+}
+#endif
@@ -0,0 +1,51 @@
+#pragma once
+#ifndef _WIN32
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace netpoll {
+/**
+ * @brief The sockets a process hands over to its successor over a Unix
+ * socket with SCM_RIGHTS, see TcpServer::handOff() and TcpServer::adoptFrom().
+ *
+ */
+struct HandoffState
+{
+   // Bound and listening sockets.
+   std::vector<int>                         listenFds;
+   // Connected sockets with the input read from them but not yet consumed.
+   std::vector<std::pair<int, std::string>> connections;
+};
+
+namespace handoff {
+/**
+ * @brief Connect to the Unix socket at path and send the state, the sockets
+ * stay open in this process.
+ *
+ * @param path
+ * @param state
+ * @param timeout The maximum seconds each step may block, the connecting,
+ * the writes and the wait for the acknowledgement.
+ * @return true only if the receiver acknowledged that it took everything.
+ */
+bool send(const std::string &path, const HandoffState &state,
+          double timeout = 5);
+
+/**
+ * @brief Listen on the Unix socket at path, wait for one sender and take
+ * over the sockets it sends. The sender is acknowledged once everything is
+ * received and checked.
+ *
+ * @param path
+ * @param timeout The maximum seconds to wait for the sender, and for each
+ * read from it.
+ * @param state
+ * @return false on timeout or failure, no socket is received then.
+ */
+bool receive(const std::string &path, double timeout, HandoffState *state);
+
+void closeAll(const HandoffState &state);
+}   // namespace handoff
+}   // namespace netpoll
+#endif
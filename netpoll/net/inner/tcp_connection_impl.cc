@@ -4,13 +4,15 @@
 #include <netpoll/util/encode_util.h>
 #define ENABLE_ELG_LOG
 #include <elog/logger.h>
-#include <netpoll/util/make_copy_mv.h>
 
 #include "socket.h"
 
 #ifdef __linux__
 #include <sys/sendfile.h>
 #endif
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
 #ifdef _WIN32
 #include <wincrypt.h>
 #include <windows.h>
@@ -19,6 +21,8 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 
+#include <algorithm>
+
 using namespace netpoll;
 
 #ifdef _WIN32
@@ -68,7 +72,9 @@ TcpConnectionImpl::TcpConnectionImpl(EventLoop *loop, int socketfd,
     m_ioChannelPtr(new Channel(loop, socketfd)),
     m_socketPtr(new Socket(socketfd)),
     m_localAddr(localAddr),
-    m_peerAddr(peerAddr)
+    m_peerAddr(peerAddr),
+    m_ownerLoop(loop),
+    m_currentLoop(loop)
 {
    ELG_TRACE("new connection:{} -> {}", peerAddr.toIpPort(),
              localAddr.toIpPort());
@@ -84,16 +90,31 @@ TcpConnectionPtr TcpConnectionImpl::New(netpoll::EventLoop *loop, int socketfd,
                                         const netpoll::InetAddress &localAddr,
                                         const netpoll::InetAddress &peerAddr)
 {
-   return std::make_shared<TcpConnectionImpl>(loop, socketfd, localAddr,
-                                              peerAddr);
+   return std::allocate_shared<TcpConnectionImpl>(
+     PoolAllocator<TcpConnectionImpl>(), loop, socketfd, localAddr, peerAddr);
 }
 
 void TcpConnectionImpl::handleRead()
 {
    m_loop->assertInLoopThread();
-   int ret = 0;
+   if (m_recvBucket.enabled() && m_recvBucket.refill() == 0)
+   {
+      throttleReading();
+      return;
+   }
+   int    ret       = 0;
+   size_t maxLength = SIZE_MAX;
+   if (m_recvBufferLimit > 0)
+   {
+      if (m_readBuffer.readableBytes() >= m_recvBufferLimit)
+      {
+         checkRecvLimits();
+         return;
+      }
+      maxLength = m_recvBufferLimit - m_readBuffer.readableBytes();
+   }
 
-   ssize_t n = m_readBuffer.readFd(m_socketPtr->fd(), &ret);
+   ssize_t n = m_readBuffer.readFd(m_socketPtr->fd(), &ret, maxLength);
    if (n == 0)
    {
       // socket closed by peer
@@ -134,10 +155,18 @@ void TcpConnectionImpl::handleRead()
    if (n > 0)
    {
       m_bytesReceived += n;
+      if (m_recvBucket.enabled())
+      {
+         m_recvBucket.consume(n);
+         if (m_recvBucket.refill() == 0) { throttleReading(); }
+      }
+      auto unconsumed = m_readBuffer.readableBytes();
       if (m_recvMsgCallback)
       {
          m_recvMsgCallback(shared_from_this(), &m_readBuffer);
       }
+      updateReadDeadline(unconsumed);
+      checkRecvLimits();
    }
 }
 
@@ -159,24 +188,17 @@ void TcpConnectionImpl::extendLife()
 
 void TcpConnectionImpl::sendNext()
 {
-   assert(!m_writeBufferList.empty());
+   assert(!m_writeQueue.empty());
    // next is not a file
-   if (!m_writeBufferList.front()->isFile())
+   if (!m_writeQueue.front().isFile())
    {
       // There is data to be sent in the buffer.
-      auto n =
-        writeInLoop(m_writeBufferList.front()->msgBuffer_->peek(),
-                    m_writeBufferList.front()->msgBuffer_->readableBytes());
-      if (n >= 0) { m_writeBufferList.front()->msgBuffer_->retrieve(n); }
-      else
-      {
-         if (util::WriteSocketError("send data in sendNext")) { return; }
-      }
+      flushBuffers();
    }
    else
    {
       // next is a file
-      sendFileInLoop(m_writeBufferList.front());
+      sendFileInLoop();
    }
 }
 
@@ -191,21 +213,22 @@ void TcpConnectionImpl::handleWrite()
       ELG_ERROR("no writing but write callback called");
       return;
    }
-   assert(!m_writeBufferList.empty());
-   auto writeBuffer = m_writeBufferList.front();
+   assert(!m_writeQueue.empty());
+   auto &writeBuffer = m_writeQueue.front();
    // Case 1, is a file
-   if (writeBuffer->isFile())
+   if (writeBuffer.isFile())
    {
       // finished sending
-      if (writeBuffer->fileBytesToSend_ <= 0)
+      if (writeBuffer.fileBytesToSend_ <= 0)
       {
-         m_writeBufferList.pop_front();
+         popFrontNode();
          // All write buffer data has been processed. You need to stop focusing
          // on write events.
-         if (m_writeBufferList.empty())
+         if (m_writeQueue.empty())
          {
             // stop writing
             m_ioChannelPtr->disableWriting();
+            clearDeadline(m_writeDeadline);
             if (m_writeCompleteCallback)
                m_writeCompleteCallback(shared_from_this());
             if (m_status == ConnStatus::Disconnecting)
@@ -219,19 +242,20 @@ void TcpConnectionImpl::handleWrite()
             sendNext();
          }
       }
-      else { sendFileInLoop(writeBuffer); }
+      else { sendFileInLoop(); }
       return;
    }
 
    // Case 2, not a file
-   if (writeBuffer->msgBuffer_->readableBytes() <= 0)
+   if (writeBuffer.bytesToWrite() == 0)
    {
       // finished sending
-      m_writeBufferList.pop_front();
-      if (m_writeBufferList.empty())
+      popFrontNode();
+      if (m_writeQueue.empty())
       {
          // stop writing
          m_ioChannelPtr->disableWriting();
+         clearDeadline(m_writeDeadline);
          if (m_writeCompleteCallback)
             m_writeCompleteCallback(shared_from_this());
          if (m_status == ConnStatus::Disconnecting)
@@ -248,14 +272,75 @@ void TcpConnectionImpl::handleWrite()
    else
    {
       // continue sending
-      auto n = writeInLoop(writeBuffer->msgBuffer_->peek(),
-                           writeBuffer->msgBuffer_->readableBytes());
-      if (n >= 0) { writeBuffer->msgBuffer_->retrieve(n); }
-      else
+      flushBuffers();
+   }
+}
+
+void TcpConnectionImpl::flushBuffers()
+{
+#ifndef _WIN32
+#ifdef __linux__
+   // A zero copy buffer goes alone, its pages are pinned by the send.
+   auto &front = m_writeQueue.front();
+   if (front.zeroCopy_)
+   {
+      auto n = writeZeroCopy(front);
+      if (n < 0)
+      {
+         util::WriteSocketError("send data in flushBuffers");
+         return;
+      }
+      retrieveNode(front, static_cast<size_t>(n));
+      return;
+   }
+#endif
+   // Gather the buffers up to the next file, so that many small messages
+   // take one system call.
+   iovec vec[kMaxGather];
+   int   count = 0;
+   int   flags = 0;
+   for (size_t i = 0; i < m_writeQueue.size(); ++i)
+   {
+      auto &node = m_writeQueue[i];
+      if (node.isFile())
       {
-         if (util::WriteSocketError("send data in writeBuffer")) { return; }
+#ifdef MSG_MORE
+         // The data of the file follows, it may share the last segment.
+         flags = MSG_MORE;
+#endif
+         break;
       }
+      if (node.zeroCopy_ || count == kMaxGather) { break; }
+      auto length = node.bytesToWrite();
+      if (length == 0) { continue; }
+      vec[count].iov_base = const_cast<char *>(node.peek());
+      vec[count].iov_len  = length;
+      ++count;
    }
+   auto n = writevInLoop(vec, count, flags);
+   if (n < 0)
+   {
+      util::WriteSocketError("send data in flushBuffers");
+      return;
+   }
+   // Drop the buffers written out, the last one stays for handleWrite() to
+   // complete the writing.
+   size_t left = static_cast<size_t>(n);
+   while (!m_writeQueue.front().isFile() && !m_writeQueue.front().zeroCopy_)
+   {
+      auto &node  = m_writeQueue.front();
+      auto  taken = std::min(left, node.bytesToWrite());
+      retrieveNode(node, taken);
+      left -= taken;
+      if (node.bytesToWrite() > 0 || m_writeQueue.size() == 1) { break; }
+      popFrontNode();
+   }
+#else
+   auto &node = m_writeQueue.front();
+   auto  n    = writeInLoop(node.peek(), node.bytesToWrite());
+   if (n >= 0) { retrieveNode(node, n); }
+   else { util::WriteSocketError("send data in flushBuffers"); }
+#endif
 }
 
 void TcpConnectionImpl::connectEstablished()
@@ -265,7 +350,7 @@ void TcpConnectionImpl::connectEstablished()
       ELG_TRACE("connectEstablished");
       assert(self->m_status == ConnStatus::Connecting);
       self->m_ioChannelPtr->tie(self);
-      self->m_ioChannelPtr->enableReading();
+      if (self->m_readPauses == 0) { self->m_ioChannelPtr->enableReading(); }
       self->m_status = ConnStatus::Connected;
       if (self->m_connectionCallback) self->m_connectionCallback(self);
    });
@@ -277,6 +362,8 @@ void TcpConnectionImpl::handleClose()
    m_loop->assertInLoopThread();
    m_status = ConnStatus::Disconnected;
    m_ioChannelPtr->disableAll();
+   clearDeadlines();
+   releaseReader();
    auto self = shared_from_this();
    if (m_connectionCallback) m_connectionCallback(self);
    if (m_closeCallback)
@@ -288,6 +375,13 @@ void TcpConnectionImpl::handleClose()
 
 void TcpConnectionImpl::handleError()
 {
+#ifdef __linux__
+   // The completions of the zero copy sends wait on the error queue.
+   if (m_zeroCopyThreshold > 0 || !m_zeroCopyPins.empty())
+   {
+      readZeroCopyCompletions();
+   }
+#endif
    int err = m_socketPtr->getSocketError();
    if (err == 0) return;
    if (err == EPIPE ||
@@ -298,35 +392,870 @@ void TcpConnectionImpl::handleError()
    {
       ELG_TRACE("[{}] - SO_ERROR:{} - ", m_name, err);
    }
-   else { ELG_TRACE("[{}] - SO_ERROR:{} - ", m_name, err); }
+   else { ELG_TRACE("[{}] - SO_ERROR:{} - ", m_name, err); }
+}
+
+void TcpConnectionImpl::setTcpNoDelay(bool on)
+{
+   m_socketPtr->setTcpNoDelay(on);
+}
+
+namespace {
+// The rate limits pause for at least this long, so that a slow rate does not
+// wake the loop up for every few bytes.
+constexpr double kMinThrottleSeconds = 0.01;
+// How often a connection paused by its receive limits checks them again
+constexpr double kRecvLimitCheckSeconds = 0.05;
+}   // namespace
+
+void TcpConnectionImpl::setRecvRateLimit(size_t rate, size_t burst)
+{
+   auto self = shared_from_this();
+   runInOwnLoop([self, rate, burst]() {
+      self->m_recvBucket.reset(rate, burst);
+      if (self->m_readResumeTimer != InvalidTimerId)
+      {
+         self->m_loop->cancelTimer(self->m_readResumeTimer);
+         self->m_readResumeTimer = InvalidTimerId;
+      }
+      self->resumeReading(kReadPausedByRateLimit);
+   });
+}
+
+void TcpConnectionImpl::setRecvBufferLimit(size_t limit, bool closeOnLimit)
+{
+   auto self = shared_from_this();
+   runInOwnLoop([self, limit, closeOnLimit]() {
+      self->m_recvBufferLimit  = limit;
+      self->m_closeOnRecvLimit = closeOnLimit;
+      self->checkRecvLimits();
+   });
+}
+
+void TcpConnectionImpl::setSendRateLimit(size_t rate, size_t burst)
+{
+   auto self = shared_from_this();
+   runInOwnLoop([self, rate, burst]() {
+      // The token bucket is only the fallback of the kernel pacing.
+      bool paced = self->m_socketPtr->setMaxPacingRate(rate);
+      self->m_sendBucket.reset(paced ? 0 : rate, burst);
+      if (self->m_sendResumeTimer != InvalidTimerId)
+      {
+         self->m_loop->cancelTimer(self->m_sendResumeTimer);
+         self->m_sendResumeTimer = InvalidTimerId;
+         self->watchWritable();
+      }
+   });
+}
+
+bool TcpConnectionImpl::setZeroCopyThreshold(size_t threshold)
+{
+   if (threshold > 0 && !m_socketPtr->setZeroCopy(true)) { return false; }
+   auto self = shared_from_this();
+   runInOwnLoop(
+     [self, threshold]() { self->m_zeroCopyThreshold = threshold; });
+   return true;
+}
+
+void TcpConnectionImpl::setAutoCork(bool on)
+{
+   auto self = shared_from_this();
+   runInOwnLoop([self, on]() {
+      self->m_autoCork = on;
+      if (!on) { self->flushInLoop(); }
+   });
+}
+
+void TcpConnectionImpl::flush()
+{
+   auto self = shared_from_this();
+   runInOwnLoop([self]() { self->flushInLoop(); });
+}
+
+void TcpConnectionImpl::scheduleFlush()
+{
+   if (m_flushPending) { return; }
+   m_flushPending = true;
+   auto self      = shared_from_this();
+   auto loop      = m_loop;
+   m_loop->runAtIterationEnd([self, loop]() {
+      // Moved to another loop in the meantime, which writes the data.
+      if (self->m_loop == loop) { self->flushInLoop(); }
+   });
+}
+
+void TcpConnectionImpl::flushInLoop()
+{
+   // A detached connection flushes when it is reattached.
+   if (!m_flushPending || m_detached) { return; }
+   m_flushPending = false;
+   if (m_writeQueue.empty() || m_ioChannelPtr->isWriting() ||
+       m_sendResumeTimer != InvalidTimerId ||
+       (m_status != ConnStatus::Connected &&
+        m_status != ConnStatus::Disconnecting))
+   {
+      return;
+   }
+   if (!m_writeQueue.front().isFile())
+   {
+      flushBuffers();
+      auto &front = m_writeQueue.front();
+      if (m_writeQueue.size() == 1 && !front.isFile() &&
+          front.bytesToWrite() == 0)
+      {
+         popFrontNode();
+         if (m_status == ConnStatus::Disconnecting)
+         {
+            m_socketPtr->closeWrite();
+         }
+         return;
+      }
+   }
+   // The rest is written when the socket is writable, a file right away.
+   if (m_writeQueue.front().isFile()) { sendFileInLoop(); }
+   else { watchWritable(); }
+}
+
+void TcpConnectionImpl::pauseReading(uint8_t reason)
+{
+   m_loop->assertInLoopThread();
+   if (m_readPauses == 0 && m_ioChannelPtr->isReading())
+   {
+      m_ioChannelPtr->disableReading();
+   }
+   m_readPauses |= reason;
+}
+
+void TcpConnectionImpl::resumeReading(uint8_t reason)
+{
+   m_loop->assertInLoopThread();
+   if ((m_readPauses & reason) == 0) { return; }
+   m_readPauses &= ~reason;
+   if (m_readPauses == 0 && !m_detached &&
+       (m_status == ConnStatus::Connected ||
+        m_status == ConnStatus::Disconnecting))
+   {
+      m_ioChannelPtr->enableReading();
+   }
+}
+
+void TcpConnectionImpl::checkRecvLimits()
+{
+   m_loop->assertInLoopThread();
+   if (m_status == ConnStatus::Disconnected) { return; }
+   auto buffered = m_readBuffer.readableBytes();
+   m_loop->updateRecvMemory(m_recvAccounted, buffered);
+   m_recvAccounted = buffered;
+   bool full = m_recvBufferLimit > 0 && buffered >= m_recvBufferLimit;
+   if (full && m_closeOnRecvLimit)
+   {
+      ELG_WARN("[{}] receive buffer reached {} bytes, close it", m_name,
+               buffered);
+      forceClose();
+      return;
+   }
+   // Over the budget, the connections holding less than their share keep
+   // reading, so that a few peers parked on it do not stall the others.
+   auto budget     = m_loop->recvMemoryBudget();
+   bool overBudget = budget > 0 && m_loop->recvMemory() > budget &&
+                     buffered > 0 && buffered >= m_loop->recvMemoryShare();
+   if (!full && !overBudget)
+   {
+      resumeReading(kReadPausedByRecvLimit);
+      return;
+   }
+   pauseReading(kReadPausedByRecvLimit);
+   if (m_recvLimitTimer != InvalidTimerId) { return; }
+   // The application consumes the buffer, or the other connections theirs,
+   // out of the message callback, nothing tells when.
+   std::weak_ptr<TcpConnectionImpl> weak = shared_from_this();
+   m_recvLimitTimer = m_loop->runAfter(kRecvLimitCheckSeconds, [weak](TimerId) {
+      auto self = weak.lock();
+      if (!self) { return; }
+      self->m_recvLimitTimer = InvalidTimerId;
+      self->checkRecvLimits();
+   });
+}
+
+void TcpConnectionImpl::holdReading(bool hold)
+{
+   auto self = shared_from_this();
+   runInOwnLoop([self, hold]() {
+      if (hold)
+      {
+         if (self->m_readHolds++ == 0)
+         {
+            self->pauseReading(kReadPausedByWatermark);
+         }
+      }
+      else if (self->m_readHolds > 0 && --self->m_readHolds == 0)
+      {
+         self->resumeReading(kReadPausedByWatermark);
+      }
+   });
+}
+
+void TcpConnectionImpl::retrieveNode(BufferNode &node, size_t length)
+{
+   node.retrieve(length);
+   m_queuedBytes -= length;
+   if (m_holdingReader && m_queuedBytes <= m_lowWatermark) { releaseReader(); }
+}
+
+void TcpConnectionImpl::checkWatermarks()
+{
+   if (m_holdingReader || m_highWatermark == 0 ||
+       m_queuedBytes <= m_highWatermark)
+   {
+      return;
+   }
+   // The reader is gone, nothing to pause.
+   auto reader = m_watermarkReader.lock();
+   if (!reader) { return; }
+   m_holdingReader = true;
+   m_heldReader    = reader;
+   reader->holdReading(true);
+}
+
+void TcpConnectionImpl::releaseReader()
+{
+   if (!m_holdingReader) { return; }
+   m_holdingReader = false;
+   auto reader     = m_heldReader.lock();
+   m_heldReader.reset();
+   if (reader) { reader->holdReading(false); }
+}
+
+void TcpConnectionImpl::setWriteWatermarks(size_t                  highMark,
+                                           size_t                  lowMark,
+                                           const TcpConnectionPtr &reader)
+{
+   auto self       = shared_from_this();
+   auto readerImpl = reader ? std::static_pointer_cast<TcpConnectionImpl>(reader)
+                            : self;
+   runInOwnLoop([self, highMark, lowMark, readerImpl]() {
+      // The new marks take over from a hold of the old ones.
+      self->releaseReader();
+      self->m_highWatermark = highMark;
+      self->m_lowWatermark =
+        lowMark > 0 && lowMark < highMark ? lowMark : highMark / 2;
+      self->m_watermarkReader = readerImpl;
+      self->m_socketPtr->setNotSentLowat(highMark > 0 ? self->m_lowWatermark
+                                                      : 0);
+      self->checkWatermarks();
+   });
+}
+
+void TcpConnectionImpl::throttleReading()
+{
+   pauseReading(kReadPausedByRateLimit);
+   if (m_readResumeTimer != InvalidTimerId) { return; }
+   std::weak_ptr<TcpConnectionImpl> weak = shared_from_this();
+   m_readResumeTimer                     = m_loop->runAfter(
+     std::max(m_recvBucket.secondsToRefill(), kMinThrottleSeconds),
+     [weak](TimerId) {
+        auto self = weak.lock();
+        if (!self) { return; }
+        self->m_readResumeTimer = InvalidTimerId;
+        // handleRead() pauses again if the bucket is still empty.
+        self->resumeReading(kReadPausedByRateLimit);
+     });
+}
+
+size_t TcpConnectionImpl::sendAllowance(size_t length)
+{
+   if (!m_sendBucket.enabled() || length == 0) { return length; }
+   auto allowed = m_sendBucket.refill();
+   if (allowed == 0)
+   {
+      throttleWriting();
+      return 0;
+   }
+   return std::min(length, allowed);
+}
+
+void TcpConnectionImpl::throttleWriting()
+{
+   if (m_ioChannelPtr->isWriting()) { m_ioChannelPtr->disableWriting(); }
+   if (m_sendResumeTimer != InvalidTimerId) { return; }
+   std::weak_ptr<TcpConnectionImpl> weak = shared_from_this();
+   m_sendResumeTimer                     = m_loop->runAfter(
+     std::max(m_sendBucket.secondsToRefill(), kMinThrottleSeconds),
+     [weak](TimerId) {
+        auto self = weak.lock();
+        if (!self) { return; }
+        self->m_sendResumeTimer = InvalidTimerId;
+        if (!self->m_writeQueue.empty() &&
+            (self->m_status == ConnStatus::Connected ||
+             self->m_status == ConnStatus::Disconnecting))
+        {
+           self->watchWritable();
+        }
+     });
+}
+
+void TcpConnectionImpl::watchWritable()
+{
+   if (m_detached) { return; }
+   if (m_sendResumeTimer == InvalidTimerId && !m_ioChannelPtr->isWriting())
+   {
+      m_ioChannelPtr->enableWriting();
+   }
+   if (m_writeTimeout > 0 && m_writeDeadline == 0) { armWriteDeadline(); }
+}
+
+void TcpConnectionImpl::setReadTimeout(double timeout)
+{
+   auto self = shared_from_this();
+   runInOwnLoop([self, timeout]() {
+      self->m_readTimeout = timeout;
+      self->clearDeadline(self->m_readDeadline);
+      if (timeout > 0 && self->m_readBuffer.readableBytes() > 0)
+      {
+         self->armReadDeadline();
+      }
+   });
+}
+
+void TcpConnectionImpl::setWriteTimeout(double timeout)
+{
+   auto self = shared_from_this();
+   runInOwnLoop([self, timeout]() {
+      self->m_writeTimeout = timeout;
+      self->clearDeadline(self->m_writeDeadline);
+      if (timeout > 0 && !self->m_writeQueue.empty())
+      {
+         self->armWriteDeadline();
+      }
+   });
+}
+
+uint64_t TcpConnectionImpl::armDeadline(double timeout, DeadlineCallback cb)
+{
+   auto id = ++m_deadlineIdSeq;
+   if (canSendInLoop())
+   {
+      armDeadlineInLoop(id, timeout, std::move(cb));
+      return id;
+   }
+   auto self = shared_from_this();
+   queueSend([self, id, timeout, cb = std::move(cb)]() mutable {
+      self->armDeadlineInLoop(id, timeout, std::move(cb));
+   });
+   return id;
+}
+
+void TcpConnectionImpl::cancelDeadline(uint64_t id)
+{
+   if (canSendInLoop())
+   {
+      cancelDeadlineInLoop(id);
+      return;
+   }
+   auto self = shared_from_this();
+   queueSend([self, id]() { self->cancelDeadlineInLoop(id); });
+}
+
+void TcpConnectionImpl::cancelDeadlineInLoop(uint64_t id)
+{
+   // A connection holds few deadlines, a scan is cheaper than a map.
+   auto &deadlines = m_deadlines;
+   for (auto &deadline : deadlines)
+   {
+      if (deadline.first == id)
+      {
+         m_loop->deadlineWheel().cancel(deadline.second);
+         deadline = deadlines.back();
+         deadlines.pop_back();
+         return;
+      }
+   }
+   auto &moving = m_movingDeadlines;
+   for (auto it = moving.begin(); it != moving.end(); ++it)
+   {
+      if (!it->target && it->id == id)
+      {
+         moving.erase(it);
+         return;
+      }
+   }
+}
+
+void TcpConnectionImpl::armDeadlineInLoop(uint64_t id, double timeout,
+                                          DeadlineCallback &&cb)
+{
+   if (m_status == ConnStatus::Disconnected) { return; }
+   if (m_detached)
+   {
+      m_movingDeadlines.push_back(
+        {id, nullptr, timeout, Functor(), std::move(cb)});
+      return;
+   }
+   // The wheel keeps the callback with this connection, which cancels its
+   // deadlines before it is destroyed.
+   auto wheelId = m_loop->deadlineWheel().add(timeout, this, std::move(cb));
+   m_deadlines.emplace_back(id, wheelId);
+}
+
+void TcpConnectionImpl::onDeadline(DeadlineWheel::Id wheelId,
+                                   DeadlineCallback &&cb)
+{
+   auto &deadlines = m_deadlines;
+   auto  iter      = std::find_if(
+     deadlines.begin(), deadlines.end(),
+     [wheelId](const std::pair<uint64_t, DeadlineWheel::Id> &deadline) {
+        return deadline.second == wheelId;
+     });
+   // Cancelled by the callback of another deadline expiring on the same tick.
+   if (iter == deadlines.end()) { return; }
+   *iter = deadlines.back();
+   deadlines.pop_back();
+   auto self = shared_from_this();
+   if (cb) { cb(self); }
+   else { forceClose(); }
+}
+
+void TcpConnectionImpl::addDeadline(DeadlineWheel::Id *target, double timeout,
+                                    Functor &&cb)
+{
+   if (m_detached)
+   {
+      m_movingDeadlines.push_back({0, target, timeout, std::move(cb), nullptr});
+      return;
+   }
+   *target = m_loop->deadlineWheel().add(timeout, std::move(cb));
+}
+
+void TcpConnectionImpl::armReadDeadline()
+{
+   clearDeadline(m_readDeadline);
+   std::weak_ptr<TcpConnectionImpl> weak = shared_from_this();
+   addDeadline(&m_readDeadline, m_readTimeout, [weak]() {
+      auto self = weak.lock();
+      if (!self) { return; }
+      self->m_readDeadline = 0;
+      ELG_TRACE("[{}] read timeout", self->m_name);
+      self->forceClose();
+   });
+}
+
+void TcpConnectionImpl::updateReadDeadline(size_t unconsumed)
+{
+   if (m_readTimeout <= 0 || m_status == ConnStatus::Disconnected) { return; }
+   auto left = m_readBuffer.readableBytes();
+   if (left == 0) { clearDeadline(m_readDeadline); }
+   else if (m_readDeadline == 0 || left < unconsumed) { armReadDeadline(); }
+}
+
+void TcpConnectionImpl::armWriteDeadline()
+{
+   std::weak_ptr<TcpConnectionImpl> weak = shared_from_this();
+   addDeadline(&m_writeDeadline, m_writeTimeout, [weak]() {
+      auto self = weak.lock();
+      if (!self) { return; }
+      self->m_writeDeadline = 0;
+      ELG_TRACE("[{}] write timeout", self->m_name);
+      self->forceClose();
+   });
+}
+
+void TcpConnectionImpl::clearDeadline(DeadlineWheel::Id &id)
+{
+   if (m_detached)
+   {
+      auto &moving = m_movingDeadlines;
+      moving.erase(std::remove_if(moving.begin(), moving.end(),
+                                  [&id](const MovingDeadline &deadline) {
+                                     return deadline.target == &id;
+                                  }),
+                   moving.end());
+   }
+   if (id == 0) { return; }
+   m_loop->deadlineWheel().cancel(id);
+   id = 0;
+}
+
+void TcpConnectionImpl::clearDeadlines()
+{
+   clearDeadline(m_readDeadline);
+   clearDeadline(m_writeDeadline);
+   for (auto &deadline : m_deadlines)
+   {
+      m_loop->deadlineWheel().cancel(deadline.second);
+   }
+   m_deadlines.clear();
+   if (m_detached) { m_movingDeadlines.clear(); }
+}
+
+void TcpConnectionImpl::releaseDeadlines()
+{
+   auto  &wheel   = m_loop->deadlineWheel();
+   auto   release = [this, &wheel](DeadlineWheel::Id *target) {
+      double remaining = 0;
+      auto   cb        = wheel.release(*target, &remaining);
+      if (cb)
+      {
+         m_movingDeadlines.push_back(
+           {0, target, remaining, std::move(cb), nullptr});
+      }
+   };
+   if (m_readDeadline != 0) { release(&m_readDeadline); }
+   if (m_writeDeadline != 0) { release(&m_writeDeadline); }
+   for (auto &deadline : m_deadlines)
+   {
+      double           remaining = 0;
+      DeadlineCallback cb;
+      if (wheel.release(deadline.second, &remaining, &cb))
+      {
+         m_movingDeadlines.push_back(
+           {deadline.first, nullptr, remaining, Functor(), std::move(cb)});
+      }
+   }
+   m_readDeadline  = 0;
+   m_writeDeadline = 0;
+   m_deadlines.clear();
+}
+
+void TcpConnectionImpl::restoreDeadlines()
+{
+   auto moving = std::move(m_movingDeadlines);
+   m_movingDeadlines.clear();
+   for (auto &deadline : moving)
+   {
+      if (deadline.target)
+      {
+         addDeadline(deadline.target, deadline.remaining,
+                     std::move(deadline.cb));
+      }
+      else
+      {
+         armDeadlineInLoop(deadline.id, deadline.remaining,
+                           std::move(deadline.userCb));
+      }
+   }
+}
+
+int TcpConnectionImpl::incomingCpu() const
+{
+   return m_socketPtr->getIncomingCpu();
+}
+
+bool TcpConnectionImpl::detach(std::string *unread)
+{
+   m_loop->assertInLoopThread();
+   if (m_status != ConnStatus::Connected || !m_writeQueue.empty() ||
+       m_pending.load() > 0)
+   {
+      return false;
+   }
+   m_ioChannelPtr->disableAll();
+   releaseDeadlines();
+   m_detached = true;
+   unread->assign(m_readBuffer.peek(), m_readBuffer.readableBytes());
+   return true;
+}
+
+void TcpConnectionImpl::reattach()
+{
+   m_loop->assertInLoopThread();
+   if (!m_detached) { return; }
+   m_detached = false;
+   restoreDeadlines();
+   if (m_status != ConnStatus::Connected &&
+       m_status != ConnStatus::Disconnecting)
+   {
+      return;
+   }
+   if (m_readPauses == 0) { m_ioChannelPtr->enableReading(); }
+   // Write what was sent while detached, then the shutdown() waiting for it.
+   if (!m_writeQueue.empty())
+   {
+      m_flushPending = true;
+      flushInLoop();
+   }
+   else if (m_status == ConnStatus::Disconnecting)
+   {
+      m_socketPtr->closeWrite();
+   }
+}
+
+int TcpConnectionImpl::socketFd() const { return m_socketPtr->fd(); }
+
+void TcpConnectionImpl::deliverInput(const StringView &data)
+{
+   m_loop->assertInLoopThread();
+   if (m_status != ConnStatus::Connected || data.empty()) { return; }
+   m_readBuffer.pushBack(data);
+   auto unconsumed = m_readBuffer.readableBytes();
+   if (m_recvMsgCallback)
+   {
+      m_recvMsgCallback(shared_from_this(), &m_readBuffer);
+   }
+   updateReadDeadline(unconsumed);
+}
+
+void TcpConnectionImpl::connectDestroyed()
+{
+   m_loop->assertInLoopThread();
+   // The wheel calls back into this connection, even one still shutting down
+   // must leave it.
+   clearDeadlines();
+   if (m_status == ConnStatus::Connected)
+   {
+      m_status = ConnStatus::Disconnected;
+      m_ioChannelPtr->disableAll();
+      releaseReader();
+
+      m_connectionCallback(shared_from_this());
+   }
+   m_loop->updateRecvMemory(m_recvAccounted, 0);
+   m_recvAccounted = 0;
+   m_ioChannelPtr->remove();
+}
+
+bool TcpConnectionImpl::canSendInLoop()
+{
+   // Nothing is queued before the data, so it can be written right now.
+   auto *owner = m_ownerLoop.load(std::memory_order_acquire);
+   return owner && owner->isInLoopThread() &&
+          m_pending.load(std::memory_order_acquire) == 0;
+}
+
+void TcpConnectionImpl::enqueueOutbox(OutboxItem &&item)
+{
+   // Counted before it is visible, so that the fast path of the loop thread
+   // never overtakes it.
+   bool first = m_pending.fetch_add(1) == 0;
+   m_outbox.enqueue(std::move(item));
+   // Only the first call since the last drain wakes the loop up.
+   if (first) { scheduleDrain(); }
+}
+
+void TcpConnectionImpl::queueSend(Functor &&task)
+{
+   enqueueOutbox(OutboxItem{std::string(), std::move(task)});
+}
+
+void TcpConnectionImpl::queueData(std::string &&data)
+{
+   enqueueOutbox(OutboxItem{std::move(data), nullptr});
+}
+
+void TcpConnectionImpl::runInOwnLoop(Functor &&task)
+{
+   if (canSendInLoop()) { task(); }
+   else { queueSend(std::move(task)); }
+}
+
+void TcpConnectionImpl::scheduleDrain()
+{
+   auto *owner = m_ownerLoop.load();
+   // A moving connection drains the outbox when it joins the new loop.
+   if (!owner) { return; }
+   auto self = shared_from_this();
+   owner->queueInLoop([self]() { self->drainOutbox(); });
+}
+
+void TcpConnectionImpl::drainOutbox()
+{
+   auto *owner = m_ownerLoop.load();
+   if (!owner) { return; }
+   if (!owner->isInLoopThread())
+   {
+      // Queued in the loop the connection has left.
+      auto self = shared_from_this();
+      owner->queueInLoop([self]() { self->drainOutbox(); });
+      return;
+   }
+   OutboxItem item;
+   int64_t    done = 0;
+   for (;;)
+   {
+      // The tasks may queue more tasks, which run in this pass.
+      while (m_outbox.dequeue(item))
+      {
+         ++done;
+         if (!item.task)
+         {
+            m_drainBatch.push_back(std::move(item.data));
+            if (m_drainBatch.size() == kDrainBatch) { sendDrainBatch(); }
+            continue;
+         }
+         sendDrainBatch();
+         item.task();
+      }
+      sendDrainBatch();
+      if (done > 0 && m_pending.fetch_sub(done) == done) { return; }
+      done = 0;
+      if (m_outbox.empty())
+      {
+         // Counted by a sender which has not queued its task yet, try again
+         // in the next iteration rather than spinning. Queued from here the
+         // task would run again in this pass of the queued functions, queued
+         // at the end of the iteration it wakes the loop for the next one.
+         if (m_pending.load() > 0)
+         {
+            auto self = shared_from_this();
+            owner->runAtIterationEnd([self]() { self->scheduleDrain(); });
+         }
+         return;
+      }
+   }
+}
+
+void TcpConnectionImpl::sendDrainBatch()
+{
+   if (m_drainBatch.empty()) { return; }
+   if (m_status != ConnStatus::Connected)
+   {
+      ELG_WARN("Connection is not connected,give up sending");
+      m_drainBatch.clear();
+      return;
+   }
+   extendLife();
+   size_t sent = 0;
+#ifndef _WIN32
+   // The batch goes out in one system call, what is left of each string is
+   // moved to the write queue rather than copied.
+   for (auto &data : m_drainBatch) { m_drainFragments.emplace_back(data); }
+   bool written =
+      writeFragmentsInLoop(m_drainFragments.data(), m_drainFragments.size(),
+                           sent);
+   m_drainFragments.clear();
+   if (!written || m_status != ConnStatus::Connected)
+   {
+      m_drainBatch.clear();
+      return;
+   }
+   for (auto &data : m_drainBatch)
+   {
+      if (sent >= data.size())
+      {
+         sent -= data.size();
+         continue;
+      }
+      auto owner = std::make_shared<std::string>(std::move(data));
+      queueOwnedInLoop(owner, owner->data(), owner->size(), sent);
+      sent = 0;
+   }
+#else
+   for (auto &data : m_drainBatch)
+   {
+      if (writeOwnedInLoop(data.data(), data.size(), sent)) { continue; }
+      auto owner = std::make_shared<std::string>(std::move(data));
+      queueOwnedInLoop(owner, owner->data(), owner->size(), sent);
+      sent = 0;
+   }
+#endif
+   m_drainBatch.clear();
 }
 
-void TcpConnectionImpl::setTcpNoDelay(bool on)
+void TcpConnectionImpl::migrateTo(EventLoop *loop)
 {
-   m_socketPtr->setTcpNoDelay(on);
+   assert(loop);
+   auto self = shared_from_this();
+   runInOwnLoop([self, loop]() { self->startMigrationInLoop(loop); });
 }
 
-void TcpConnectionImpl::connectDestroyed()
+void TcpConnectionImpl::startMigrationInLoop(EventLoop *loop)
 {
    m_loop->assertInLoopThread();
-   if (m_status == ConnStatus::Connected)
+   if (loop == m_loop || m_status != ConnStatus::Connected || m_migrating ||
+       m_detached)
    {
-      m_status = ConnStatus::Disconnected;
-      m_ioChannelPtr->disableAll();
+      return;
+   }
+   if (m_migrationFilter && !m_migrationFilter(loop))
+   {
+      ELG_WARN("[{}] cannot migrate to a loop its owner does not serve",
+               m_name);
+      return;
+   }
+   m_migrating = true;
+   auto self   = shared_from_this();
+   m_loop->queueInLoop([self, loop]() { self->leaveLoop(loop); });
+}
 
-      m_connectionCallback(shared_from_this());
+void TcpConnectionImpl::leaveLoop(EventLoop *loop)
+{
+   m_loop->assertInLoopThread();
+   if (m_status != ConnStatus::Connected)
+   {
+      // Closed in the meantime, stay here.
+      m_migrating = false;
+      return;
+   }
+   ELG_TRACE("[{}] migrate from loop {} to loop {}", m_name,
+             m_loop->index(), loop->index());
+   // The rate limit timers are started again in the new loop.
+   bool writing = m_ioChannelPtr->isWriting() ||
+                  m_sendResumeTimer != InvalidTimerId || m_flushPending;
+   m_flushPending = false;
+   if (m_sendResumeTimer != InvalidTimerId)
+   {
+      m_loop->cancelTimer(m_sendResumeTimer);
+      m_sendResumeTimer = InvalidTimerId;
+   }
+   if (m_readResumeTimer != InvalidTimerId)
+   {
+      m_loop->cancelTimer(m_readResumeTimer);
+      m_readResumeTimer = InvalidTimerId;
+   }
+   if (m_recvLimitTimer != InvalidTimerId)
+   {
+      m_loop->cancelTimer(m_recvLimitTimer);
+      m_recvLimitTimer = InvalidTimerId;
    }
+   // The new loop checks the receive limits when the connection joins it.
+   m_readPauses &= ~(kReadPausedByRateLimit | kReadPausedByRecvLimit);
+   m_loop->updateRecvMemory(m_recvAccounted, 0);
+   m_recvAccounted = 0;
+   releaseDeadlines();
+   m_ioChannelPtr->disableAll();
    m_ioChannelPtr->remove();
+   m_ioChannelPtr->setLoop(loop);
+   // The entry in the timing wheel of this loop must not kick off the
+   // connection any more, the owner puts a new one in the new loop.
+   auto entry = m_kickoffEntry.lock();
+   if (entry) { entry->reset(); }
+   m_kickoffEntry.reset();
+   m_timingWheelWeakPtr.reset();
+
+   auto from = m_loop;
+   auto self = shared_from_this();
+   // Until the connection joins the new loop the tasks wait in the outbox.
+   m_ownerLoop.store(nullptr);
+   m_loop = loop;
+   // This loop is done with the connection, the new one may see it now.
+   m_currentLoop.store(loop, std::memory_order_release);
+   loop->queueInLoop(
+     [self, from, writing]() { self->joinLoop(from, writing); });
+}
+
+void TcpConnectionImpl::joinLoop(EventLoop *from, bool writing)
+{
+   m_loop->assertInLoopThread();
+   restoreDeadlines();
+   // The owner adopts the connection before anything can close it here.
+   if (m_migratedCallback) { m_migratedCallback(shared_from_this(), from); }
+   checkRecvLimits();
+   if (m_readPauses == 0) { m_ioChannelPtr->enableReading(); }
+   if (writing) { m_ioChannelPtr->enableWriting(); }
+   m_migrating = false;
+   m_ownerLoop.store(m_loop);
+   if (m_pending.load() > 0) { drainOutbox(); }
 }
 
 void TcpConnectionImpl::shutdown()
 {
    auto self = shared_from_this();
-   m_loop->runInLoop([self]() {
+   runInOwnLoop([self]() {
       if (self->m_status == ConnStatus::Connected)
       {
          self->m_status = ConnStatus::Disconnecting;
-         if (!self->m_ioChannelPtr->isWriting())
+         if (!self->m_ioChannelPtr->isWriting() &&
+             self->m_sendResumeTimer == InvalidTimerId &&
+             !self->m_flushPending && !self->m_detached)
          {
             self->m_socketPtr->closeWrite();
          }
@@ -337,7 +1266,7 @@ void TcpConnectionImpl::shutdown()
 void TcpConnectionImpl::forceClose()
 {
    auto self = shared_from_this();
-   m_loop->runInLoop([self]() {
+   runInOwnLoop([self]() {
       if (self->m_status == ConnStatus::Connected ||
           self->m_status == ConnStatus::Disconnecting)
       {
@@ -363,7 +1292,7 @@ void    TcpConnectionImpl::sendInLoop(const char *buffer, size_t length)
    size_t  remainLen = length;
    ssize_t sendLen   = 0;
    // Case 1
-   if (!m_ioChannelPtr->isWriting() && m_writeBufferList.empty())
+   if (canWriteDirectly())
    {
       // send directly
       sendLen = writeInLoop(buffer, length);
@@ -378,149 +1307,286 @@ void    TcpConnectionImpl::sendInLoop(const char *buffer, size_t length)
    // Case 2.If the write buffer is full
    if (remainLen > 0 && m_status == ConnStatus::Connected)
    {
-      // If the writable buffer is empty or only one file needs to be sent
-      if (m_writeBufferList.empty() || m_writeBufferList.back()->isFile())
-      {
-         BufferNodePtr node = std::make_shared<BufferNode>();
-         node->msgBuffer_   = std::make_shared<MessageBuffer>();
-         m_writeBufferList.push_back(std::move(node));
-      }
-      m_writeBufferList.back()->msgBuffer_->pushBack(
-        {static_cast<const char *>(buffer) + sendLen, remainLen});
-      // Start listening for writable status
-      if (!m_ioChannelPtr->isWriting()) m_ioChannelPtr->enableWriting();
-      // If there is too much data in the writable buffer
-      if (m_highWaterMarkCallback &&
-          m_writeBufferList.back()->msgBuffer_->readableBytes() >
-            m_highWaterMarkLen)
-      {
-         m_highWaterMarkCallback(
-           shared_from_this(),
-           m_writeBufferList.back()->msgBuffer_->readableBytes());
-      }
+      appendToQueue(static_cast<const char *>(buffer) + sendLen, remainLen);
+      queued();
    }
 }
 
-void TcpConnectionImpl::send(const StringView &msg)
+bool TcpConnectionImpl::canWriteDirectly() const
+{
+   return !m_detached && !m_ioChannelPtr->isWriting() &&
+          m_writeQueue.empty() && !m_autoCork;
+}
+
+void TcpConnectionImpl::appendToQueue(const char *data, size_t length)
 {
-   // SendNum ensures the order in which the task are executed
-   if (m_loop->isInLoopThread())
+   // If the writable buffer is empty or only one file needs to be sent
+   if (m_writeQueue.empty() ||
+       m_writeQueue.back().kind_ != BufferNode::Kind::Memory)
    {
-      if (getSendNumByGuard() == 0) { sendInLoop(msg.data(), msg.size()); }
-      else
-      {
-         plusSendNumByGuard();
-         auto buffer = makeCopyMove(std::string{msg.data(), msg.size()});
-         auto self   = shared_from_this();
-         m_loop->queueInLoop([buffer, self]() {
-            self->sendInLoop(buffer.value.data(), buffer.value.length());
-            self->minusSendNumByGuard();
-         });
-      }
+      BufferNode node;
+      node.msgBuffer_ = m_spareBuffer ? std::move(m_spareBuffer)
+                                      : std::make_unique<MessageBuffer>();
+      m_writeQueue.push_back(std::move(node));
    }
-   else
+   m_writeQueue.back().msgBuffer_->pushBack({data, length});
+   m_queuedBytes += length;
+}
+
+void TcpConnectionImpl::queued()
+{
+   // Start listening for writable status, unless the data is held until the
+   // end of the loop iteration.
+   if (m_autoCork && !m_ioChannelPtr->isWriting() &&
+       m_sendResumeTimer == InvalidTimerId)
+   {
+      scheduleFlush();
+   }
+   else { watchWritable(); }
+   // If there is too much data in the writable buffer
+   if (m_highWaterMarkCallback &&
+       m_writeQueue.back().bytesToWrite() > m_highWaterMarkLen)
    {
-      auto buffer = makeCopyMove(std::string{msg.data(), msg.size()});
-      auto self   = shared_from_this();
-      plusSendNumByGuard();
-      m_loop->queueInLoop([self, buffer]() {
-         self->sendInLoop(buffer.value.data(), buffer.value.length());
-         self->minusSendNumByGuard();
-      });
+      m_highWaterMarkCallback(shared_from_this(),
+                              m_writeQueue.back().bytesToWrite());
    }
+   checkWatermarks();
 }
 
-// The order of data sending should be same as the order of calls of send()
-void TcpConnectionImpl::send(const std::shared_ptr<MessageBuffer> &msgPtr)
+void TcpConnectionImpl::sendvInLoop(const StringView *fragments, size_t count)
 {
-   if (m_loop->isInLoopThread())
+   m_loop->assertInLoopThread();
+   if (m_status != ConnStatus::Connected)
    {
-      std::lock_guard<std::mutex> guard(m_sendNumMutex);
-      if (m_sendNum == 0)
-      {
-         sendInLoop(msgPtr->peek(), msgPtr->readableBytes());
-      }
-      else
+      ELG_WARN("Connection is not connected,give up sending");
+      return;
+   }
+#ifndef _WIN32
+   extendLife();
+   size_t sent = 0;
+   // Case 1, the fragments go out in one system call, no copy is made
+   if (!writeFragmentsInLoop(fragments, count, sent)) { return; }
+   // Case 2, the rest is copied to the write buffer
+   if (m_status != ConnStatus::Connected) { return; }
+   bool appended = false;
+   for (size_t i = 0; i < count; ++i)
+   {
+      auto size = fragments[i].size();
+      if (sent >= size)
       {
-         ++m_sendNum;
-         auto self = shared_from_this();
-         m_loop->queueInLoop([self, msgPtr]() {
-            self->sendInLoop(msgPtr->peek(), msgPtr->readableBytes());
-            std::lock_guard<std::mutex> guard1(self->m_sendNumMutex);
-            --self->m_sendNum;
-         });
+         sent -= size;
+         continue;
       }
+      appendToQueue(fragments[i].data() + sent, size - sent);
+      sent     = 0;
+      appended = true;
    }
-   else
+   if (appended) { queued(); }
+#else
+   for (size_t i = 0; i < count; ++i)
    {
-      auto                        self = shared_from_this();
-      std::lock_guard<std::mutex> guard(m_sendNumMutex);
-      ++m_sendNum;
-      m_loop->queueInLoop([self, msgPtr]() {
-         self->sendInLoop(msgPtr->peek(), msgPtr->readableBytes());
-         std::lock_guard<std::mutex> guard1(self->m_sendNumMutex);
-         --self->m_sendNum;
-      });
+      sendInLoop(fragments[i].data(), fragments[i].size());
    }
+#endif
 }
 
-void TcpConnectionImpl::send(const MessageBuffer &buffer)
+#ifndef _WIN32
+bool TcpConnectionImpl::writeFragmentsInLoop(const StringView *fragments,
+                                             size_t count, size_t &sent)
 {
-   if (m_loop->isInLoopThread())
+   sent = 0;
+   if (!canWriteDirectly()) { return true; }
+   iovec vec[kMaxGather];
+   int   vecCount = 0;
+   for (size_t i = 0; i < count && vecCount < kMaxGather; ++i)
    {
-      std::lock_guard<std::mutex> guard(m_sendNumMutex);
-      if (m_sendNum == 0) { sendInLoop(buffer.peek(), buffer.readableBytes()); }
-      else
-      {
-         ++m_sendNum;
-         auto self = shared_from_this();
-         m_loop->queueInLoop([self, buffer]() {
-            self->sendInLoop(buffer.peek(), buffer.readableBytes());
-            std::lock_guard<std::mutex> guard1(self->m_sendNumMutex);
-            --self->m_sendNum;
-         });
-      }
+      if (fragments[i].empty()) { continue; }
+      vec[vecCount].iov_base = const_cast<char *>(fragments[i].data());
+      vec[vecCount].iov_len  = fragments[i].size();
+      ++vecCount;
    }
-   else
+   auto n = writevInLoop(vec, vecCount);
+   if (n < 0)
    {
-      auto                        self = shared_from_this();
-      std::lock_guard<std::mutex> guard(m_sendNumMutex);
-      ++m_sendNum;
-      m_loop->queueInLoop([self, buffer]() {
-         self->sendInLoop(buffer.peek(), buffer.readableBytes());
-         std::lock_guard<std::mutex> guard1(self->m_sendNumMutex);
-         --self->m_sendNum;
-      });
+      if (util::WriteSocketError("sendvInLoop")) { return false; }
+      n = 0;
    }
+   sent = static_cast<size_t>(n);
+   return true;
 }
+#endif
 
-void TcpConnectionImpl::send(MessageBuffer &&buffer)
+bool TcpConnectionImpl::useZeroCopy(size_t length) const
+{
+#ifdef __linux__
+   return m_zeroCopyThreshold > 0 && length >= m_zeroCopyThreshold;
+#else
+   (void)length;
+   return false;
+#endif
+}
+
+bool TcpConnectionImpl::writeOwnedInLoop(const char *data, size_t length,
+                                         size_t &written)
+{
+   m_loop->assertInLoopThread();
+   if (m_status != ConnStatus::Connected)
+   {
+      ELG_WARN("Connection is not connected,give up sending");
+      return true;
+   }
+   if (length == 0) { return true; }
+   extendLife();
+   if (!canWriteDirectly() || useZeroCopy(length)) { return false; }
+   auto sent = writeInLoop(data, length);
+   if (sent < 0)
+   {
+      if (util::WriteSocketError("sendOwnedInLoop")) { return true; }
+      sent = 0;
+   }
+   written = static_cast<size_t>(sent);
+   return written == length;
+}
+
+void TcpConnectionImpl::queueOwnedInLoop(std::shared_ptr<const void> owner,
+                                         const char *data, size_t length,
+                                         size_t written)
 {
-   if (m_loop->isInLoopThread())
+   // Nothing is written yet when the zero copy is used.
+   bool zeroCopy = written == 0 && useZeroCopy(length);
+   bool direct   = canWriteDirectly();
+   BufferNode node;
+   node.kind_     = BufferNode::Kind::Owned;
+   node.owner_    = std::move(owner);
+   node.data_     = data;
+   node.length_   = length;
+   node.written_  = written;
+   node.zeroCopy_ = zeroCopy;
+   m_writeQueue.push_back(std::move(node));
+   m_queuedBytes += length - written;
+   if (direct && zeroCopy)
    {
-      if (getSendNumByGuard() == 0)
+      flushBuffers();
+      if (m_writeQueue.back().bytesToWrite() == 0)
       {
-         sendInLoop(buffer.peek(), buffer.readableBytes());
+         m_writeQueue.pop_back();
+         return;
       }
-      else
+   }
+   if (m_status == ConnStatus::Connected) { queued(); }
+}
+
+void TcpConnectionImpl::sendOwnedInLoop(std::shared_ptr<const void> owner,
+                                        const char *data, size_t length)
+{
+   // Case 1, send directly. Case 2, the rest waits in the write queue in the
+   // storage of the user.
+   size_t written = 0;
+   if (writeOwnedInLoop(data, length, written)) { return; }
+   queueOwnedInLoop(std::move(owner), data, length, written);
+}
+
+namespace {
+const char *dataOf(const MessageBuffer &buffer) { return buffer.peek(); }
+const char *dataOf(const std::string &buffer) { return buffer.data(); }
+const char *dataOf(const std::vector<char> &buffer) { return buffer.data(); }
+size_t      sizeOf(const MessageBuffer &buffer)
+{
+   return buffer.readableBytes();
+}
+size_t sizeOf(const std::string &buffer) { return buffer.size(); }
+size_t sizeOf(const std::vector<char> &buffer) { return buffer.size(); }
+}   // namespace
+
+template <typename Buffer>
+void TcpConnectionImpl::sendTaken(Buffer &&buffer)
+{
+   if (canSendInLoop())
+   {
+      size_t written = 0;
+      if (writeOwnedInLoop(dataOf(buffer), sizeOf(buffer), written))
       {
-         auto self = shared_from_this();
-         plusSendNumByGuard();
-         m_loop->queueInLoop([self, buffer = std::move(buffer)]() {
-            self->sendInLoop(buffer.peek(), buffer.readableBytes());
-            self->minusSendNumByGuard();
-         });
+         return;
       }
+      auto owner = std::make_shared<Buffer>(std::move(buffer));
+      queueOwnedInLoop(owner, dataOf(*owner), sizeOf(*owner), written);
+      return;
    }
-   else
+   auto owner = std::make_shared<Buffer>(std::move(buffer));
+   sendOwned(owner, dataOf(*owner), sizeOf(*owner));
+}
+
+void TcpConnectionImpl::sendOwned(std::shared_ptr<const void> owner,
+                                  const char *data, size_t length)
+{
+   if (canSendInLoop())
    {
-      auto self = shared_from_this();
-      plusSendNumByGuard();
-      m_loop->queueInLoop([self, buffer = std::move(buffer)]() {
-         self->sendInLoop(buffer.peek(), buffer.readableBytes());
-         self->minusSendNumByGuard();
-      });
+      sendOwnedInLoop(std::move(owner), data, length);
+      return;
+   }
+   auto self = shared_from_this();
+   queueSend([self, owner, data, length]() {
+      self->sendOwnedInLoop(owner, data, length);
+   });
+}
+
+void TcpConnectionImpl::sendv(const StringView *fragments, size_t count)
+{
+   if (canSendInLoop())
+   {
+      sendvInLoop(fragments, count);
+      return;
+   }
+   // The fragments may be gone when the data is sent, they are copied.
+   size_t length = 0;
+   for (size_t i = 0; i < count; ++i) { length += fragments[i].size(); }
+   std::string data;
+   data.reserve(length);
+   for (size_t i = 0; i < count; ++i)
+   {
+      data.append(fragments[i].data(), fragments[i].size());
+   }
+   queueData(std::move(data));
+}
+
+void TcpConnectionImpl::send(const StringView &msg)
+{
+   // The outbox keeps the order of the sends from the other threads.
+   if (canSendInLoop())
+   {
+      sendInLoop(msg.data(), msg.size());
+      return;
+   }
+   queueData(std::string{msg.data(), msg.size()});
+}
+
+// The order of data sending should be same as the order of calls of send()
+void TcpConnectionImpl::send(
+  const std::shared_ptr<const MessageBuffer> &msgPtr)
+{
+   sendOwned(msgPtr, msgPtr->peek(), msgPtr->readableBytes());
+}
+
+void TcpConnectionImpl::send(const MessageBuffer &buffer)
+{
+   if (canSendInLoop())
+   {
+      sendInLoop(buffer.peek(), buffer.readableBytes());
+      return;
    }
+   queueData(std::string{buffer.peek(), buffer.readableBytes()});
+}
+
+void TcpConnectionImpl::send(MessageBuffer &&buffer)
+{
+   sendTaken(std::move(buffer));
+}
+
+void TcpConnectionImpl::send(std::string &&msg) { sendTaken(std::move(msg)); }
+
+void TcpConnectionImpl::send(std::vector<char> &&msg)
+{
+   sendTaken(std::move(msg));
 }
 
 void TcpConnectionImpl::sendFile(StringView const &fileName, size_t offset,
@@ -596,119 +1662,130 @@ void TcpConnectionImpl::sendFile(int sfd, size_t offset, size_t length)
 #endif
 {
    assert(length > 0);
+   BufferNode node;
+   node.kind_ = BufferNode::Kind::File;
 #ifndef _WIN32
    assert(sfd >= 0);
-   BufferNodePtr node = std::make_shared<BufferNode>();
-   node->m_sendFd     = sfd;
+   node.m_sendFd = sfd;
 #else
    assert(fp);
-   BufferNodePtr node = std::make_shared<BufferNode>();
-   node->m_sendFp     = fp;
+   node.m_sendFp = fp;
 #endif
-   node->m_offset         = static_cast<off_t>(offset);
-   node->fileBytesToSend_ = length;
-   if (m_loop->isInLoopThread())
-   {
-      if (getSendNumByGuard() == 0)
-      {
-         m_writeBufferList.push_back(node);
-         if (m_writeBufferList.size() == 1)
-         {
-            sendFileInLoop(m_writeBufferList.front());
-            return;
-         }
-      }
-      else
-      {
-         auto self = shared_from_this();
-         plusSendNumByGuard();
-         m_loop->queueInLoop([self, node]() {
-            self->m_writeBufferList.push_back(node);
-            if (self->m_writeBufferList.size() == 1)
-            {
-               self->sendFileInLoop(self->m_writeBufferList.front());
-            }
-            self->minusSendNumByGuard();
-         });
-      }
-   }
-   else
+   node.m_offset         = static_cast<off_t>(offset);
+   node.fileBytesToSend_ = length;
+   if (canSendInLoop())
    {
-      auto self = shared_from_this();
-      plusSendNumByGuard();
-      m_loop->queueInLoop([self, node]() {
-         ELG_TRACE("Push sendfile to list");
-         self->m_writeBufferList.push_back(node);
-         if (self->m_writeBufferList.size() == 1)
-         {
-            self->sendFileInLoop(self->m_writeBufferList.front());
-         }
-         self->minusSendNumByGuard();
-      });
+      pushFileNode(std::move(node));
+      return;
    }
+   // Owned by the task until it runs, which closes the file if it never does.
+   auto self    = shared_from_this();
+   auto nodePtr = std::make_shared<BufferNode>(std::move(node));
+   queueSend([self, nodePtr]() {
+      ELG_TRACE("Push sendfile to list");
+      self->pushFileNode(std::move(*nodePtr));
+   });
 }
 
 void TcpConnectionImpl::sendStream(
   std::function<std::size_t(char *, std::size_t)> callback)
 {
-   BufferNodePtr node     = std::make_shared<BufferNode>();
+   BufferNode node;
+   node.kind_ = BufferNode::Kind::Stream;
    // not used, the offset should be handled by the callback
-   node->m_offset         = 0;
-   node->fileBytesToSend_ = 1;   // force to > 0 until stream sent
-   node->streamCallback_  = std::move(callback);
-   if (m_loop->isInLoopThread())
+   node.m_offset         = 0;
+   node.fileBytesToSend_ = 1;   // force to > 0 until stream sent
+   node.streamCallback_ =
+     std::make_unique<StreamCallback>(std::move(callback));
+   if (canSendInLoop())
    {
-      if (getSendNumByGuard() == 0)
-      {
-         m_writeBufferList.push_back(node);
-         if (m_writeBufferList.size() == 1)
-         {
-            sendFileInLoop(m_writeBufferList.front());
-            return;
-         }
-      }
-      else
-      {
-         auto self = shared_from_this();
-         plusSendNumByGuard();
-         m_loop->queueInLoop([self, node]() {
-            self->m_writeBufferList.push_back(node);
-            if (self->m_writeBufferList.size() == 1)
-            {
-               self->sendFileInLoop(self->m_writeBufferList.front());
-            }
-            self->minusSendNumByGuard();
-         });
-      }
+      pushFileNode(std::move(node));
+      return;
    }
-   else
+   auto self    = shared_from_this();
+   auto nodePtr = std::make_shared<BufferNode>(std::move(node));
+   queueSend([self, nodePtr]() {
+      ELG_TRACE("Push sendstream to list");
+      self->pushFileNode(std::move(*nodePtr));
+   });
+}
+
+void TcpConnectionImpl::pushFileNode(BufferNode &&node)
+{
+   m_writeQueue.push_back(std::move(node));
+   if (m_writeQueue.size() == 1 && !m_detached) { sendFileInLoop(); }
+}
+
+void TcpConnectionImpl::popFrontNode()
+{
+   auto &node = m_writeQueue.front();
+   if (node.msgBuffer_ && !m_spareBuffer)
    {
-      auto self = shared_from_this();
-      plusSendNumByGuard();
-      m_loop->queueInLoop([self, node]() {
-         ELG_TRACE("Push sendstream to list");
-         self->m_writeBufferList.push_back(node);
+      node.msgBuffer_->retrieveAll();
+      m_spareBuffer = std::move(node.msgBuffer_);
+   }
+   m_writeQueue.pop_front();
+}
 
-         if (self->m_writeBufferList.size() == 1)
-         {
-            self->sendFileInLoop(self->m_writeBufferList.front());
-         }
-         self->minusSendNumByGuard();
-      });
+TcpConnectionImpl::BufferNode &TcpConnectionImpl::BufferNode::operator=(
+  BufferNode &&other) noexcept
+{
+   if (this == &other) { return *this; }
+   reset();
+   kind_      = other.kind_;
+   zeroCopy_  = other.zeroCopy_;
+   msgBuffer_ = std::move(other.msgBuffer_);
+   owner_     = std::move(other.owner_);
+   data_      = other.data_;
+   length_    = other.length_;
+   written_   = other.written_;
+#ifndef _WIN32
+   m_sendFd       = other.m_sendFd;
+   other.m_sendFd = -1;
+#else
+   m_sendFp       = other.m_sendFp;
+   other.m_sendFp = nullptr;
+#endif
+   m_offset         = other.m_offset;
+   fileBytesToSend_ = other.fileBytesToSend_;
+   streamCallback_  = std::move(other.streamCallback_);
+#ifndef NDEBUG
+   nDataWritten_ = other.nDataWritten_;
+#endif
+   return *this;
+}
+
+void TcpConnectionImpl::BufferNode::reset()
+{
+#ifndef _WIN32
+   if (m_sendFd >= 0) ::close(m_sendFd);
+   m_sendFd = -1;
+#else
+   if (m_sendFp) ::fclose(m_sendFp);
+   m_sendFp = nullptr;
+#endif
+   if (streamCallback_)
+   {
+      (*streamCallback_)(nullptr, 0);   // cleanup callback internals
+      streamCallback_.reset();
    }
 }
 
-void TcpConnectionImpl::sendFileInLoop(const BufferNodePtr &filePtr)
+void TcpConnectionImpl::sendFileInLoop()
 {
    m_loop->assertInLoopThread();
+   auto *filePtr = &m_writeQueue.front();
    assert(filePtr->isFile());
 #ifdef __linux__
    // Case 1
    if (!filePtr->streamCallback_)
    {
       ELG_TRACE("send file in loop using linux kernel sendfile()");
+      auto toSend = sendAllowance(filePtr->fileBytesToSend_);
+      // Paced, the timer resumes the writing.
+      if (toSend == 0) { return; }
       auto bytesSent = sendfile(m_socketPtr->fd(), filePtr->m_sendFd,
-                                &filePtr->m_offset, filePtr->fileBytesToSend_);
+                                &filePtr->m_offset, toSend);
       if (bytesSent < 0)
       {
          if (errno != EAGAIN)
@@ -725,7 +1802,8 @@ void TcpConnectionImpl::sendFileInLoop(const BufferNodePtr &filePtr)
       }
       ELG_TRACE("sendfile() {} bytes sent", bytesSent);
       filePtr->fileBytesToSend_ -= bytesSent;
-      if (!m_ioChannelPtr->isWriting()) { m_ioChannelPtr->enableWriting(); }
+      if (m_sendBucket.enabled()) { m_sendBucket.consume(bytesSent); }
+      watchWritable();
       return;
    }
 #endif
@@ -746,8 +1824,10 @@ void TcpConnectionImpl::sendFileInLoop(const BufferNodePtr &filePtr)
             ELG_TRACE("send stream in loop: fetch data on buffer empty");
             m_fileBufferPtr->resize(16 * 1024);
             std::size_t nData;
-            nData = filePtr->streamCallback_(m_fileBufferPtr->data(),
-                                             m_fileBufferPtr->size());
+            nData = (*filePtr->streamCallback_)(m_fileBufferPtr->data(),
+                                                m_fileBufferPtr->size());
+            // The callback may have queued more data.
+            filePtr = &m_writeQueue.front();
             m_fileBufferPtr->resize(nData);
             if (nData == 0)   // no more data!
             {
@@ -775,8 +1855,7 @@ void TcpConnectionImpl::sendFileInLoop(const BufferNodePtr &filePtr)
                // Partial write - return and wait for next call to continue
                m_fileBufferPtr->erase(m_fileBufferPtr->begin(),
                                       m_fileBufferPtr->begin() + nWritten);
-               if (!m_ioChannelPtr->isWriting())
-                  m_ioChannelPtr->enableWriting();
+               watchWritable();
                ELG_TRACE("send stream in loop: return on partial write "
                          "(socket buffer full?)");
                return;
@@ -788,7 +1867,7 @@ void TcpConnectionImpl::sendFileInLoop(const BufferNodePtr &filePtr)
          if (util::WriteSocketError("send stream in loop")) { return; }
          break;
       }
-      if (!m_ioChannelPtr->isWriting()) m_ioChannelPtr->enableWriting();
+      watchWritable();
       ELG_TRACE("send stream in loop: return on loop exit");
       return;
    }
@@ -827,10 +1906,7 @@ void TcpConnectionImpl::sendFileInLoop(const BufferNodePtr &filePtr)
             filePtr->m_offset += static_cast<off_t>(nSend);
             if (static_cast<size_t>(nSend) < static_cast<size_t>(n))
             {
-               if (!m_ioChannelPtr->isWriting())
-               {
-                  m_ioChannelPtr->enableWriting();
-               }
+               watchWritable();
                ELG_TRACE("send file in loop: return on partial write (socket "
                          "buffer full?)");
                return;
@@ -856,7 +1932,7 @@ void TcpConnectionImpl::sendFileInLoop(const BufferNodePtr &filePtr)
       }
    }
    ELG_TRACE("send file in loop: return on loop exit");
-   if (!m_ioChannelPtr->isWriting()) { m_ioChannelPtr->enableWriting(); }
+   watchWritable();
 }
 #ifndef _WIN32
 ssize_t TcpConnectionImpl::writeInLoop(const void *buffer, size_t length)
@@ -864,6 +1940,16 @@ ssize_t TcpConnectionImpl::writeInLoop(const void *buffer, size_t length)
 ssize_t TcpConnectionImpl::writeInLoop(const char *buffer, size_t length)
 #endif
 {
+   if (m_sendBucket.enabled() && length > 0)
+   {
+      length = sendAllowance(length);
+      if (length == 0)
+      {
+         // Looks like a full socket buffer to the callers.
+         errno = EWOULDBLOCK;
+         return -1;
+      }
+   }
 #ifndef _WIN32
    ssize_t nWritten = write(m_socketPtr->fd(), buffer, length);
 #else
@@ -871,6 +1957,113 @@ ssize_t TcpConnectionImpl::writeInLoop(const char *buffer, size_t length)
      ::send(m_socketPtr->fd(), buffer, static_cast<int>(length), 0);
    errno = (nWritten < 0) ? ::WSAGetLastError() : 0;
 #endif
-   if (nWritten > 0) m_bytesSent += nWritten;
+   if (nWritten > 0)
+   {
+      m_bytesSent += nWritten;
+      if (m_sendBucket.enabled()) { m_sendBucket.consume(nWritten); }
+   }
+   return nWritten;
+}
+
+#ifndef _WIN32
+ssize_t TcpConnectionImpl::writevInLoop(iovec *vec, int count, int flags)
+{
+   if (count == 0) { return 0; }
+   if (count == 1 && flags == 0)
+   {
+      return writeInLoop(vec[0].iov_base, vec[0].iov_len);
+   }
+   if (m_sendBucket.enabled())
+   {
+      size_t length = 0;
+      for (int i = 0; i < count; ++i) { length += vec[i].iov_len; }
+      auto allowed = sendAllowance(length);
+      if (allowed == 0)
+      {
+         errno = EWOULDBLOCK;
+         return -1;
+      }
+      // Cut the vector at the allowance.
+      for (int i = 0; i < count; ++i)
+      {
+         if (vec[i].iov_len >= allowed)
+         {
+            vec[i].iov_len = allowed;
+            count          = i + 1;
+            break;
+         }
+         allowed -= vec[i].iov_len;
+      }
+   }
+   ssize_t nWritten;
+   if (flags == 0) { nWritten = ::writev(m_socketPtr->fd(), vec, count); }
+   else
+   {
+      msghdr msg{};
+      msg.msg_iov    = vec;
+      msg.msg_iovlen = count;
+      nWritten       = ::sendmsg(m_socketPtr->fd(), &msg, flags);
+   }
+   if (nWritten > 0)
+   {
+      m_bytesSent += nWritten;
+      if (m_sendBucket.enabled()) { m_sendBucket.consume(nWritten); }
+   }
+   return nWritten;
+}
+#endif
+
+#ifdef __linux__
+ssize_t TcpConnectionImpl::writeZeroCopy(BufferNode &node)
+{
+   auto bytes = node.bytesToWrite();
+   if (bytes == 0) { return 0; }
+   auto length = sendAllowance(bytes);
+   if (length == 0)
+   {
+      errno = EWOULDBLOCK;
+      return -1;
+   }
+   auto   *data     = node.peek();
+   ssize_t nWritten = m_socketPtr->sendZeroCopy(data, length);
+   if (nWritten < 0 && errno == ENOBUFS)
+   {
+      // The kernel is out of the memory it pins the pages with, copy.
+      return writeInLoop(data, length);
+   }
+   if (nWritten > 0)
+   {
+      m_bytesSent += nWritten;
+      if (m_sendBucket.enabled()) { m_sendBucket.consume(nWritten); }
+      // The kernel numbers the successful sends from 0.
+      if (m_zeroCopyPins.empty() ||
+          m_zeroCopyPins.back().second != node.owner_)
+      {
+         m_zeroCopyPins.emplace_back(m_zeroCopySeq, node.owner_);
+      }
+      else { m_zeroCopyPins.back().first = m_zeroCopySeq; }
+      ++m_zeroCopySeq;
+   }
    return nWritten;
 }
+
+void TcpConnectionImpl::readZeroCopyCompletions()
+{
+   bool     completed = false;
+   bool     copied    = false;
+   uint32_t last      = 0;
+   while (m_socketPtr->readErrorQueue(&completed, &last, &copied))
+   {
+      if (!completed) { continue; }
+      if (copied)
+      {
+         ELG_TRACE("[{}] zero copy sends up to {} were copied", m_name, last);
+      }
+      while (!m_zeroCopyPins.empty() &&
+             static_cast<int32_t>(m_zeroCopyPins.front().first - last) <= 0)
+      {
+         m_zeroCopyPins.pop_front();
+      }
+   }
+}
+#endif
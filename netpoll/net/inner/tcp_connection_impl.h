@@ -1,8 +1,17 @@
-#include <list>
+#include <netpoll/util/object_pool.h>
+#include <netpoll/util/ring_queue.h>
+#include <netpoll/util/token_bucket.h>
 
+#include <deque>
+#include <vector>
+
+#include "deadline_wheel.h"
 #include "timing_wheel.h"
 #ifndef _WIN32
+#include <sys/uio.h>
 #include <unistd.h>
+
+#include <climits>
 #endif
 #include "../tcp_connection.h"
 
@@ -11,7 +20,8 @@ class Channel;
 class Socket;
 class TcpConnectionImpl : public TcpConnection,
                           public noncopyable,
-                          public std::enable_shared_from_this<TcpConnectionImpl>
+                          public std::enable_shared_from_this<TcpConnectionImpl>,
+                          private DeadlineWheel::Owner
 {
 public:
    friend class TcpServer;
@@ -46,7 +56,12 @@ public:
    void send(StringView const &msg) override;
    void send(const MessageBuffer &buffer) override;
    void send(MessageBuffer &&buffer) override;
-   void send(const std::shared_ptr<MessageBuffer> &msgPtr) override;
+   void send(const std::shared_ptr<const MessageBuffer> &msgPtr) override;
+   void send(std::string &&msg) override;
+   void send(std::vector<char> &&msg) override;
+   using TcpConnection::send;
+   using TcpConnection::sendv;
+   void sendv(const StringView *fragments, size_t count) override;
    void sendFile(StringView const &fileName, size_t offset = 0,
                  size_t length = 0) override;
    void sendStream(
@@ -70,6 +85,8 @@ public:
       m_highWaterMarkCallback = cb;
       m_highWaterMarkLen      = markLen;
    }
+   void setWriteWatermarks(size_t highMark, size_t lowMark = 0,
+                           const TcpConnectionPtr &reader = nullptr) override;
    void keepAlive() override
    {
       m_idleTimeout = 0;
@@ -78,11 +95,28 @@ public:
    }
    bool       isKeepAlive() override { return m_idleTimeout == 0; }
    void       setTcpNoDelay(bool on) override;
+   void       setRecvRateLimit(size_t rate, size_t burst = 0) override;
+   void       setRecvBufferLimit(size_t limit,
+                                 bool   closeOnLimit = false) override;
+   void       setSendRateLimit(size_t rate, size_t burst = 0) override;
+   bool       setZeroCopyThreshold(size_t threshold) override;
+   void       setAutoCork(bool on) override;
+   void       flush() override;
+   void       setReadTimeout(double timeout) override;
+   void       setWriteTimeout(double timeout) override;
+   uint64_t   armDeadline(double           timeout,
+                          DeadlineCallback cb = nullptr) override;
+   void       cancelDeadline(uint64_t id) override;
    void       shutdown() override;
    void       forceClose() override;
-   EventLoop *getLoop() override { return m_loop; }
+   EventLoop *getLoop() override
+   {
+      return m_currentLoop.load(std::memory_order_acquire);
+   }
+   void       migrateTo(EventLoop *loop) override;
    size_t     bytesSent() const override { return m_bytesSent; }
    size_t     bytesReceived() const override { return m_bytesReceived; }
+   int        incomingCpu() const override;
 
 private:
    /// Internal use only.
@@ -98,6 +132,7 @@ private:
       assert(timeout > 0);
       assert(timingWheel->getLoop() == m_loop);
       auto entry           = std::make_shared<KickoffEntry>(shared_from_this());
+      m_idleTimeout        = timeout;
       m_timingWheelWeakPtr = timingWheel;
       m_kickoffEntry       = entry;
       timingWheel->insertEntry(timeout, entry);
@@ -133,6 +168,19 @@ private:
    {
       m_writeCompleteCallback = std::move(cb);
    }
+   // Called in the new loop after the connection moved from the `from` loop.
+   using MigratedCallback =
+     std::function<void(const TcpConnectionPtr &, EventLoop *from)>;
+   void setMigratedCallback(MigratedCallback &&cb)
+   {
+      m_migratedCallback = std::move(cb);
+   }
+   // Called in the old loop, a move to a loop it refuses is ignored.
+   using MigrationFilter = std::function<bool(EventLoop *to)>;
+   void setMigrationFilter(MigrationFilter &&cb)
+   {
+      m_migrationFilter = std::move(cb);
+   }
    void setCloseCallback(const CloseCallback &cb) { m_closeCallback = cb; }
    void setCloseCallback(CloseCallback &&cb)
    {
@@ -140,10 +188,48 @@ private:
    }
    void         connectDestroyed();
    virtual void connectEstablished();
+   // Read the socket without waiting for the poller, when data is known to be
+   // waiting on a connection which has just been established.
+   void readNow()
+   {
+      if (m_status == ConnStatus::Connected) { handleRead(); }
+   }
+   // Stop watching the socket and copy the unread input, so that the socket
+   // can be handed over to another process. It fails if anything is left to
+   // send. Until reattach() resumes the connection, the data sent waits in the
+   // write queue and the deadlines, timers and shutdown() leave the socket
+   // alone.
+   bool detach(std::string *unread);
+   void reattach();
+   int  socketFd() const;
+   // Pass input taken over from another process to the message callback as if
+   // it was just read.
+   void deliverInput(const StringView &data);
 
 protected:
+   using StreamCallback = std::function<std::size_t(char *, std::size_t)>;
+   // An entry of the write queue, kept by value in a ring: bytes copied into
+   // a buffer of the connection, a slice of data taken over from the user, a
+   // file range or a stream.
    struct BufferNode
    {
+      enum class Kind : uint8_t { Memory, Owned, File, Stream };
+
+      BufferNode() = default;
+      BufferNode(BufferNode &&other) noexcept { *this = std::move(other); }
+      BufferNode &operator=(BufferNode &&other) noexcept;
+      ~BufferNode() { reset(); }
+
+      Kind kind_{Kind::Memory};
+      // Sent with MSG_ZEROCOPY
+      bool zeroCopy_{false};
+      // Memory
+      std::unique_ptr<MessageBuffer> msgBuffer_;
+      // Owned, written in place from the storage held by owner_
+      std::shared_ptr<const void>    owner_;
+      const char                    *data_{nullptr};
+      size_t                         length_{0};
+      size_t                         written_{0};
       // sendFile() specific
 #ifndef _WIN32
       int   m_sendFd{-1};
@@ -152,47 +238,156 @@ protected:
       FILE     *m_sendFp{nullptr};
       long long m_offset{0};
 #endif
-      ssize_t                                         fileBytesToSend_{0};
-      // sendStream() specific
-      std::function<std::size_t(char *, std::size_t)> streamCallback_;
+      ssize_t                         fileBytesToSend_{0};
+      // sendStream() specific, on the heap so that it stays in place while it
+      // runs.
+      std::unique_ptr<StreamCallback> streamCallback_;
 #ifndef NDEBUG   // defined by CMake for release build
       std::size_t nDataWritten_{0};
 #endif
-      // generic
-      std::shared_ptr<MessageBuffer> msgBuffer_;
 
       bool isFile() const
       {
-         if (streamCallback_) return true;
-#ifndef _WIN32
-         if (m_sendFd >= 0) return true;
-#else
-         if (m_sendFp) return true;
-#endif
-         return false;
+         return kind_ == Kind::File || kind_ == Kind::Stream;
       }
-      ~BufferNode()
+      bool        isOwned() const { return kind_ == Kind::Owned; }
+      const char *peek() const
       {
-#ifndef _WIN32
-         if (m_sendFd >= 0) ::close(m_sendFd);
-#else
-         if (m_sendFp) ::fclose(m_sendFp);
-#endif
-         if (streamCallback_)
-            streamCallback_(nullptr, 0);   // cleanup callback internals
+         return isOwned() ? data_ + written_ : msgBuffer_->peek();
       }
+      size_t bytesToWrite() const
+      {
+         return isOwned() ? length_ - written_ : msgBuffer_->readableBytes();
+      }
+      void retrieve(size_t length)
+      {
+         if (isOwned()) { written_ += length; }
+         else { msgBuffer_->retrieve(length); }
+      }
+
+   private:
+      // Close the file and let the stream clean up.
+      void reset();
    };
-   using BufferNodePtr = std::shared_ptr<BufferNode>;
    enum class ConnStatus { Disconnected, Connecting, Connected, Disconnecting };
 
-   void sendFileInLoop(const BufferNodePtr &file);
+   // Send the file or stream at the front of the write queue.
+   void sendFileInLoop();
+   void pushFileNode(BufferNode &&node);
+   // Pop the front of the write queue, keeping its buffer for the next data.
+   void popFrontNode();
 #ifndef _WIN32
    void    sendInLoop(const void *buffer, size_t length);
    ssize_t writeInLoop(const void *buffer, size_t length);
+#ifdef IOV_MAX
+   static constexpr int kMaxGather = IOV_MAX;
+#else
+   static constexpr int kMaxGather = 16;
+#endif
+   static constexpr size_t kDrainBatch = kMaxGather;
+   // Write the buffers with one writev(), cutting the vector at the send rate
+   // limit. With flags they are written by sendmsg().
+   ssize_t writevInLoop(iovec *vec, int count, int flags = 0);
+   // Gather write the fragments when nothing waits before them, returns false
+   // if the connection failed.
+   bool writeFragmentsInLoop(const StringView *fragments, size_t count,
+                             size_t &sent);
 #else
    void    sendInLoop(const char *buffer, size_t length);
    ssize_t writeInLoop(const char *buffer, size_t length);
+   static constexpr size_t kDrainBatch = 64;
 #endif
+   void sendvInLoop(const StringView *fragments, size_t count);
+   // Send data taken over from the user, the rest is queued in place.
+   void sendOwnedInLoop(std::shared_ptr<const void> owner, const char *data,
+                        size_t length);
+   void sendOwned(std::shared_ptr<const void> owner, const char *data,
+                  size_t length);
+   // Write the data directly when nothing waits before it, return true if
+   // there is nothing left to queue.
+   bool writeOwnedInLoop(const char *data, size_t length, size_t &written);
+   void queueOwnedInLoop(std::shared_ptr<const void> owner, const char *data,
+                         size_t length, size_t written);
+   // Move the buffer to the heap only if the socket does not take it at once.
+   template <typename Buffer>
+   void sendTaken(Buffer &&buffer);
+   bool useZeroCopy(size_t length) const;
+#ifdef __linux__
+   ssize_t writeZeroCopy(BufferNode &node);
+   // Release the buffers of the completed zero copy sends.
+   void    readZeroCopyCompletions();
+#endif
+   // Write the buffers at the front of the write buffer list up to the next
+   // file.
+   void flushBuffers();
+   void appendToQueue(const char *data, size_t length);
+   // Called after data is appended to the write buffer list.
+   void queued();
+   // Write the data held by the auto cork at the end of the loop iteration.
+   void scheduleFlush();
+   void flushInLoop();
+   // The reasons the reading is paused, the socket is watched for input only
+   // while none is set.
+   enum ReadPause : uint8_t
+   {
+      kReadPausedByRateLimit = 1,
+      kReadPausedByWatermark = 2,
+      kReadPausedByRecvLimit = 4
+   };
+   void pauseReading(uint8_t reason);
+   void resumeReading(uint8_t reason);
+   // Add or remove a hold of a write queue above its high mark on the
+   // reading, it can be called in any thread.
+   void holdReading(bool hold);
+   // Take length bytes written from the entry of the write queue, the reader
+   // is released once the queue drains to the low mark.
+   void retrieveNode(BufferNode &node, size_t length);
+   void checkWatermarks();
+   void releaseReader();
+   // Account the receive buffer to the loop, then pause the reading while it
+   // is full or holds its share of the receive budget of the loop while that
+   // is exceeded, a timer checks again.
+   void checkRecvLimits();
+   void throttleReading();
+   // Return how many of length bytes the send rate limit lets through now,
+   // the writing waits for a timer when it is 0.
+   size_t sendAllowance(size_t length);
+   void throttleWriting();
+   // Watch the socket for writability unless the writing waits for the send
+   // rate limit.
+   void watchWritable();
+   // Nothing waits before new data, so it can be written to the socket now.
+   bool canWriteDirectly() const;
+   // The deadlines of the user wait for reattach() while detached.
+   void armDeadlineInLoop(uint64_t id, double timeout, DeadlineCallback &&cb);
+   void cancelDeadlineInLoop(uint64_t id);
+   void onDeadline(DeadlineWheel::Id wheelId, DeadlineCallback &&cb) override;
+   // Add the deadline to the wheel and store its ID in target. It waits for
+   // reattach() while detached.
+   void addDeadline(DeadlineWheel::Id *target, double timeout, Functor &&cb);
+   void armReadDeadline();
+   // Restart the read timeout if the message callback consumed some of the
+   // unconsumed bytes, stop it once the buffer is empty.
+   void updateReadDeadline(size_t unconsumed);
+   void armWriteDeadline();
+   void clearDeadline(DeadlineWheel::Id &id);
+   void clearDeadlines();
+   // Take the deadlines out of the wheel of the old loop and add them to the
+   // wheel of the new one with the time they had left.
+   void releaseDeadlines();
+   void restoreDeadlines();
+   bool canSendInLoop();
+   void queueSend(Functor &&task);
+   void queueData(std::string &&data);
+   void runInOwnLoop(Functor &&task);
+   void scheduleDrain();
+   void drainOutbox();
+   // Send the data of the drained sends with one writev(), the rest of each
+   // string is queued by move.
+   void sendDrainBatch();
+   void startMigrationInLoop(EventLoop *loop);
+   void leaveLoop(EventLoop *loop);
+   void joinLoop(EventLoop *from, bool writing);
    void handleRead();
    void handleWrite();
    void sendNext();
@@ -203,7 +398,9 @@ protected:
    std::unique_ptr<Channel> m_ioChannelPtr;
    std::unique_ptr<Socket>  m_socketPtr;
    MessageBuffer            m_readBuffer;
-   std::list<BufferNodePtr> m_writeBufferList;
+   RingQueue<BufferNode>    m_writeQueue;
+   // The buffer of the last drained memory entry, reused by the next one
+   std::unique_ptr<MessageBuffer> m_spareBuffer;
 
    InetAddress           m_localAddr, m_peerAddr;
    ConnStatus            m_status{ConnStatus::Connecting};
@@ -213,31 +410,94 @@ protected:
    CloseCallback         m_closeCallback;
    WriteCompleteCallback m_writeCompleteCallback;
    HighWaterMarkCallback m_highWaterMarkCallback;
+   MigratedCallback      m_migratedCallback;
+   MigrationFilter       m_migrationFilter;
 
    size_t      m_highWaterMarkLen{};
    std::string m_name;
 
-   uint64_t   m_sendNum{0};
-   std::mutex m_sendNumMutex;
-   uint64_t   getSendNumByGuard()
+   // The calls issued outside the loop thread, or behind other pending ones,
+   // run in order when the loop drains the outbox. A send only carries its
+   // data, so that the data of consecutive sends is written together.
+   struct OutboxItem
    {
-      std::lock_guard<std::mutex> lockGuard(m_sendNumMutex);
-      return m_sendNum;
-   }
-   uint64_t plusSendNumByGuard()
-   {
-      std::lock_guard<std::mutex> lockGuard(m_sendNumMutex);
-      return ++m_sendNum;
-   }
-   uint64_t minusSendNumByGuard()
-   {
-      std::lock_guard<std::mutex> lockGuard(m_sendNumMutex);
-      return --m_sendNum;
-   }
+      std::string data;
+      Functor     task;
+   };
+   void enqueueOutbox(OutboxItem &&item);
+
+   MpscQueue<OutboxItem>    m_outbox;
+   std::vector<std::string> m_drainBatch;
+   std::vector<StringView>  m_drainFragments;
+   std::atomic<int64_t>     m_pending{0};
+   // The loop owning the connection, nullptr while it moves between loops
+   std::atomic<EventLoop *> m_ownerLoop;
+   // m_loop for the other threads, it is switched to the new loop once the
+   // connection has left the old one.
+   std::atomic<EventLoop *> m_currentLoop;
+   bool                     m_migrating{false};
+   // Set by detach() while the socket is being handed over
+   bool                     m_detached{false};
+
+   bool m_autoCork{false};
+   // Held data waits in the write buffer list for flushInLoop().
+   bool m_flushPending{false};
 
    size_t m_bytesSent{0};
    size_t m_bytesReceived{0};
 
+   uint8_t     m_readPauses{0};
+   TokenBucket m_recvBucket;
+   TimerId     m_readResumeTimer{InvalidTimerId};
+   TokenBucket m_sendBucket;
+   TimerId     m_sendResumeTimer{InvalidTimerId};
+
+   // The bytes of memory waiting in the write queue, files are not counted.
+   size_t                           m_queuedBytes{0};
+   size_t                           m_highWatermark{0};
+   size_t                           m_lowWatermark{0};
+   std::weak_ptr<TcpConnectionImpl> m_watermarkReader;
+   // The reader held while the write queue is above the high mark
+   std::weak_ptr<TcpConnectionImpl> m_heldReader;
+   bool                             m_holdingReader{false};
+   // The number of write queues holding the reading of this connection
+   uint32_t                         m_readHolds{0};
+
+   size_t  m_recvBufferLimit{0};
+   bool    m_closeOnRecvLimit{false};
+   // The bytes of the receive buffer accounted to the loop
+   size_t  m_recvAccounted{0};
+   TimerId m_recvLimitTimer{InvalidTimerId};
+
+   double            m_readTimeout{0};
+   double            m_writeTimeout{0};
+   DeadlineWheel::Id m_readDeadline{0};
+   DeadlineWheel::Id m_writeDeadline{0};
+   // The deadlines armed by the user and their IDs in the wheel
+   std::vector<std::pair<uint64_t, DeadlineWheel::Id>> m_deadlines;
+   std::atomic<uint64_t>                               m_deadlineIdSeq{0};
+   struct MovingDeadline
+   {
+      uint64_t           id;
+      // The member holding the ID of a read or write deadline, nullptr for a
+      // deadline of the user.
+      DeadlineWheel::Id *target;
+      double             remaining;
+      Functor            cb;
+      // The callback of a deadline of the user
+      DeadlineCallback   userCb;
+   };
+   std::vector<MovingDeadline> m_movingDeadlines;
+
+   size_t m_zeroCopyThreshold{0};
+#ifdef __linux__
+   // The buffers sent with MSG_ZEROCOPY and the last send reading each of
+   // them, TCP completes the sends in order.
+   std::deque<std::pair<uint32_t, std::shared_ptr<const void>>>
+            m_zeroCopyPins;
+   uint32_t m_zeroCopySeq{0};
+#endif
+
    std::unique_ptr<std::vector<char>> m_fileBufferPtr;
 };
 using TcpConnectionImplPtr = std::shared_ptr<TcpConnectionImpl>;
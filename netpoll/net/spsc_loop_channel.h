@@ -0,0 +1,238 @@
+#pragma once
+#include <netpoll/util/noncopyable.h>
+#include <netpoll/util/spsc_queue.h>
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+
+#include "eventloop.h"
+
+namespace netpoll {
+/**
+ * @brief This class template represents a point-to-point pipe from a producer
+ * event loop to a consumer event loop, it is not related to Channel which
+ * watches a fd.
+ *
+ * Items sent during one iteration of the producer loop are published together
+ * at the end of that iteration, and the consumer loop is woken up at most once
+ * for them. This holds for the items sent from the handler of another channel
+ * too, so channels can be chained into a pipeline. The consumer loop drains the pipe at the end of every iteration
+ * and calls the handler for each item in sending order.
+ *
+ * @code
+   auto ch = SpscLoopChannel<Request>::New(decodeLoop, workLoop,
+                                           [](Request &req) { handle(req); });
+   // in decodeLoop
+   ch->send(std::move(req));
+   @endcode
+ * @note The channel keeps itself alive while it is bound to the loops, call
+ * close() to unbind it.
+ */
+template <typename T>
+class SpscLoopChannel : noncopyable,
+                        public std::enable_shared_from_this<SpscLoopChannel<T>>
+{
+public:
+   using Ptr     = std::shared_ptr<SpscLoopChannel>;
+   using Handler = std::function<void(T &)>;
+
+   /**
+    * @brief Create a channel and bind it to the loops.
+    *
+    * @param producer The only event loop allowed to send items.
+    * @param consumer The event loop in which the handler is called.
+    * @param handler The function called with every received item.
+    * @param capacity The capacity of the ring, items sent while it is full are
+    * kept in the producer loop until the consumer catches up.
+    * @return Ptr
+    */
+   static Ptr New(EventLoop *producer, EventLoop *consumer, Handler handler,
+                  size_t capacity = 1024)
+   {
+      auto ptr = std::make_shared<SpscLoopChannel>(
+        producer, consumer, std::move(handler), capacity);
+      ptr->bind();
+      return ptr;
+   }
+
+   SpscLoopChannel(EventLoop *producer, EventLoop *consumer, Handler &&handler,
+                   size_t capacity)
+     : m_producer(producer),
+       m_consumer(consumer),
+       m_handler(std::move(handler)),
+       m_queue(capacity)
+   {
+      assert(m_producer && m_consumer && m_handler);
+   }
+
+   /**
+    * @brief Send a item to the consumer loop, it is published at the end of
+    * the current iteration of the producer loop or by flush().
+    *
+    * @param item
+    * @note This method must be called in the thread of the producer loop.
+    */
+   void send(T &&item)
+   {
+      m_producer->assertInLoopThread();
+      if (!m_overflow.empty() || !m_queue.push(std::move(item)))
+      {
+         m_overflow.push_back(std::move(item));
+      }
+      scheduleFlush();
+   }
+   void send(const T &item)
+   {
+      m_producer->assertInLoopThread();
+      if (!m_overflow.empty() || !m_queue.push(item))
+      {
+         m_overflow.push_back(item);
+      }
+      scheduleFlush();
+   }
+
+   /**
+    * @brief Send a item only if the ring has room for it.
+    *
+    * @param item
+    * @return false if the ring is full, the item is left untouched.
+    * @note This method must be called in the thread of the producer loop.
+    */
+   bool trySend(T &&item)
+   {
+      m_producer->assertInLoopThread();
+      if (!m_overflow.empty() || !m_queue.push(std::move(item)))
+      {
+         return false;
+      }
+      scheduleFlush();
+      return true;
+   }
+
+   /**
+    * @brief Publish the items sent so far without waiting for the end of the
+    * iteration.
+    *
+    * @note This method must be called in the thread of the producer loop.
+    */
+   void flush()
+   {
+      m_producer->assertInLoopThread();
+      moveOverflow();
+      if (!m_overflow.empty())
+      {
+         // Ask the consumer to wake us up once it has made room, then look
+         // again in case it did so before seeing the flag.
+         m_producerBlocked.store(true, std::memory_order_relaxed);
+         std::atomic_thread_fence(std::memory_order_seq_cst);
+         moveOverflow();
+      }
+      if (!m_queue.publish()) { return; }
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (m_consumerIdle.load(std::memory_order_relaxed) &&
+          m_consumerIdle.exchange(false, std::memory_order_acq_rel))
+      {
+         m_consumer->wakeup();
+      }
+   }
+
+   /**
+    * @brief Unbind the channel from the loops. Items not published yet are
+    * dropped.
+    *
+    */
+   void close()
+   {
+      auto self = this->shared_from_this();
+      m_producer->runInLoop([self]() {
+         self->m_producer->removeIterationHook(self->m_producerHook);
+      });
+      m_consumer->runInLoop([self]() {
+         self->m_consumer->removeIterationHook(self->m_consumerHook);
+      });
+   }
+
+   EventLoop *producerLoop() const { return m_producer; }
+   EventLoop *consumerLoop() const { return m_consumer; }
+
+private:
+   void bind()
+   {
+      auto self = this->shared_from_this();
+      m_producer->runInLoop([self]() {
+         // The sends flush at the end of their iteration, the hook retries
+         // the items left over once the consumer has made room.
+         self->m_producerHook = self->m_producer->addIterationHook([self]() {
+            if (!self->m_overflow.empty()) { self->flush(); }
+         });
+      });
+      m_consumer->runInLoop([self]() {
+         self->m_consumerHook =
+           self->m_consumer->addIterationHook([self]() { self->drain(); });
+      });
+   }
+
+   // The hook of the producer may have run already in this iteration, such as
+   // when the item comes from the handler of another channel drained by a
+   // later hook. The functions run at the end of the iteration come after
+   // every hook, so flush there once.
+   void scheduleFlush()
+   {
+      if (m_flushScheduled) { return; }
+      m_flushScheduled = true;
+      auto self        = this->shared_from_this();
+      m_producer->runAtIterationEnd([self]() {
+         self->m_flushScheduled = false;
+         self->flush();
+      });
+   }
+
+   void moveOverflow()
+   {
+      while (!m_overflow.empty() && m_queue.push(std::move(m_overflow.front())))
+      {
+         m_overflow.pop_front();
+      }
+   }
+
+   void drain()
+   {
+      m_consumerIdle.store(false, std::memory_order_relaxed);
+      T item;
+      for (;;)
+      {
+         while (m_queue.pop(item)) { m_handler(item); }
+         m_queue.release();
+         // Pairs with the fences in flush(): either the producer sees us idle
+         // and wakes us up, or we see its items here. The same goes for the
+         // room we have just released.
+         m_consumerIdle.store(true, std::memory_order_relaxed);
+         std::atomic_thread_fence(std::memory_order_seq_cst);
+         if (m_producerBlocked.load(std::memory_order_relaxed) &&
+             m_producerBlocked.exchange(false, std::memory_order_acq_rel))
+         {
+            m_producer->wakeup();
+         }
+         if (m_queue.empty()) { break; }
+         m_consumerIdle.store(false, std::memory_order_relaxed);
+      }
+   }
+
+   EventLoop   *m_producer;
+   EventLoop   *m_consumer;
+   Handler      m_handler;
+   SpscQueue<T> m_queue;
+   // Producer loop only
+   std::deque<T> m_overflow;
+   uint64_t      m_producerHook{0};
+   bool          m_flushScheduled{false};
+   // Consumer loop only
+   uint64_t      m_consumerHook{0};
+
+   std::atomic<bool> m_consumerIdle{true};
+   std::atomic<bool> m_producerBlocked{false};
+};
+
+}   // namespace netpoll
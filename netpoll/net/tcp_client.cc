@@ -154,8 +154,8 @@ void TcpClient::newConnection(int sockfd)
    InetAddress                        peerAddr(Socket::getPeerAddr(sockfd));
    InetAddress                        localAddr(Socket::getLocalAddr(sockfd));
    std::shared_ptr<TcpConnectionImpl> conn;
-   conn =
-     std::make_shared<TcpConnectionImpl>(m_loop, sockfd, localAddr, peerAddr);
+   conn = std::allocate_shared<TcpConnectionImpl>(
+     PoolAllocator<TcpConnectionImpl>(), m_loop, sockfd, localAddr, peerAddr);
    conn->setConnectionCallback(m_connectionCallback);
    conn->setRecvMsgCallback(m_messageCallback);
    conn->setWriteCompleteCallback(m_writeCompleteCallback);
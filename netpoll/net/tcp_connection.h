@@ -5,8 +5,10 @@
 #include <netpoll/util/string_view.h>
 
 #include <functional>
+#include <initializer_list>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include "callbacks.h"
 #include "eventloop.h"
@@ -31,10 +33,39 @@ public:
     * @param msg
     * @param len
     */
-   virtual void send(StringView const &msg)                        = 0;
-   virtual void send(const MessageBuffer &buffer)                  = 0;
-   virtual void send(MessageBuffer &&buffer)                       = 0;
-   virtual void send(const std::shared_ptr<MessageBuffer> &msgPtr) = 0;
+   virtual void send(StringView const &msg)       = 0;
+   virtual void send(const MessageBuffer &buffer) = 0;
+   void         send(const char *msg) { send(StringView(msg)); }
+
+   /**
+    * @brief Send data the connection takes over, what the socket does not
+    * take at once waits in the write queue in the storage of the caller, so
+    * that the data is never copied in user space. The storage is moved to
+    * the heap only if some of the data has to wait.
+    *
+    * @param buffer
+    * @note The buffer passed by shared_ptr is shared, not copied, it must not
+    * be changed after the call as it may still be sent from.
+    */
+   virtual void send(MessageBuffer &&buffer)                             = 0;
+   virtual void send(const std::shared_ptr<const MessageBuffer> &msgPtr) = 0;
+   virtual void send(std::string &&msg)                                  = 0;
+   virtual void send(std::vector<char> &&msg)                            = 0;
+
+   /**
+    * @brief Send several fragments as one message, such as a header and a
+    * body, without joining them first. When nothing is queued before them
+    * the fragments are written with one writev() in the loop thread, only
+    * the part the socket does not take is copied.
+    *
+    * @param fragments
+    * @param count
+    */
+   virtual void sendv(const StringView *fragments, size_t count) = 0;
+   void         sendv(std::initializer_list<StringView> fragments)
+   {
+      sendv(fragments.begin(), fragments.size());
+   }
 
    /**
     * @brief Send a file to the peer.
@@ -107,6 +138,24 @@ public:
    virtual void setHighWaterMarkCallback(const HighWaterMarkCallback &cb,
                                          size_t markLen) = 0;
 
+   /**
+    * @brief Pause the reading when more than highMark bytes wait in the write
+    * queue, and resume it once they drain to lowMark, so that a handler does
+    * not read faster than the peer takes the data. The socket is set
+    * TCP_NOTSENT_LOWAT to lowMark, the kernel then holds little unsent data
+    * and the rest waits in the write queue where it is counted.
+    *
+    * @param highMark Bytes, 0 turns the flow control off.
+    * @param lowMark Bytes, 0 is half the high mark.
+    * @param reader The connection whose reading is paused, this one if it is
+    * empty. A proxy passes the connection it reads the data from, it is not
+    * kept alive by this one.
+    * @note It can be called in any thread. Several connections may pause one
+    * reader, it reads again once all of them have drained.
+    */
+   virtual void setWriteWatermarks(size_t highMark, size_t lowMark = 0,
+                                   const TcpConnectionPtr &reader = nullptr) = 0;
+
    /**
     * @brief Set the TCP_NODELAY option to the socket.
     *
@@ -114,6 +163,125 @@ public:
     */
    virtual void setTcpNoDelay(bool on) = 0;
 
+   /**
+    * @brief Limit the bytes read from the peer with a token bucket. The socket
+    * is not read while the bucket is empty, a timer resumes the reading once
+    * it fills again.
+    *
+    * @param rate Bytes per second, 0 removes the limit.
+    * @param burst The bytes which may be read at once, 0 is a tenth of the
+    * rate.
+    * @note It can be called in any thread, a new limit starts with a full
+    * bucket.
+    */
+   virtual void setRecvRateLimit(size_t rate, size_t burst = 0) = 0;
+
+   /**
+    * @brief Cap the receive buffer, the data the message callback leaves
+    * unconsumed. The socket is not read beyond the cap, the reading resumes
+    * once the buffer drops below it, or the connection is closed instead.
+    *
+    * @param limit Bytes, 0 removes the cap.
+    * @param closeOnLimit Close the connection when the buffer is full, which
+    * sheds the peers sending messages larger than the cap.
+    * @note It can be called in any thread. EventLoop::setRecvMemoryBudget()
+    * caps the buffers of all the connections of a loop together.
+    */
+   virtual void setRecvBufferLimit(size_t limit, bool closeOnLimit = false) = 0;
+
+   /**
+    * @brief Pace the bytes sent to the peer. The kernel paces the socket with
+    * SO_MAX_PACING_RATE where it is supported, otherwise the writes of the
+    * connection are shaped by a token bucket.
+    *
+    * @param rate Bytes per second, 0 removes the limit.
+    * @param burst The bytes which may be written at once by the token bucket,
+    * 0 is a tenth of the rate.
+    * @note It can be called in any thread.
+    */
+   virtual void setSendRateLimit(size_t rate, size_t burst = 0) = 0;
+
+   /**
+    * @brief Send the buffers of at least threshold bytes with MSG_ZEROCOPY,
+    * the kernel then reads them from their memory instead of copying them. It
+    * applies to the data the connection takes over, passed by the send()
+    * overloads taking an rvalue or a shared_ptr, which is held until the
+    * kernel reports the transmit complete.
+    *
+    * @param threshold Bytes, 0 turns the zero copy off. Below about 10KB the
+    * completion notifications cost more than the copy saves.
+    * @return false if the socket does not support SO_ZEROCOPY.
+    * @note It can be called in any thread. A buffer passed by shared_ptr must
+    * not be changed after the call. The kernel copies the data sent over
+    * loopback anyway, so the zero copy only pays off on a real device.
+    */
+   virtual bool setZeroCopyThreshold(size_t threshold) = 0;
+
+   /**
+    * @brief Hold the data sent in the thread of the loop until the end of the
+    * current loop iteration and write it then with one writev(), so that the
+    * several send() calls of a response take one system call and usually one
+    * TCP segment.
+    *
+    * @param on
+    * @note It can be called in any thread, turning it off writes the held
+    * data.
+    */
+   virtual void setAutoCork(bool on) = 0;
+
+   /**
+    * @brief Write the data held by the auto cork now, for the callers which
+    * care about the latency more than the number of segments.
+    *
+    * @note It can be called in any thread.
+    */
+   virtual void flush() = 0;
+
+   /**
+    * @brief Close the connection when received data waits in the receive
+    * buffer for longer than timeout seconds, that is when the peer starts a
+    * message and does not complete it in time. The time starts again whenever
+    * the message callback consumes some of the buffer.
+    *
+    * @param timeout Seconds, 0 removes the timeout.
+    * @note It can be called in any thread. Idle connections with an empty
+    * buffer are left to the kickoff of TcpServer.
+    */
+   virtual void setReadTimeout(double timeout) = 0;
+
+   /**
+    * @brief Close the connection when the data queued for sending is not
+    * drained within timeout seconds, which sheds peers that read too slowly.
+    *
+    * @param timeout Seconds, 0 removes the timeout.
+    * @note It can be called in any thread.
+    */
+   virtual void setWriteTimeout(double timeout) = 0;
+
+   /**
+    * @brief Run cb in the loop of the connection after timeout seconds unless
+    * the deadline is cancelled first. The deadlines are kept in a timing wheel
+    * of the loop with a resolution of 10ms, so that one can be armed for every
+    * request.
+    *
+    * @param timeout Seconds.
+    * @param cb Called while the connection is connected, the connection is
+    * closed if it is empty.
+    * @return uint64_t The ID used to cancel the deadline.
+    * @note It can be called in any thread. The deadlines move with the
+    * connection and are dropped when it closes.
+    */
+   virtual uint64_t armDeadline(double           timeout,
+                                DeadlineCallback cb = nullptr) = 0;
+
+   /**
+    * @brief Cancel a deadline armed by armDeadline().
+    *
+    * @param id
+    * @note It can be called in any thread.
+    */
+   virtual void cancelDeadline(uint64_t id) = 0;
+
    /**
     * @brief Shutdown the connection.
     * @note This method only closes the writing direction.
@@ -130,9 +298,28 @@ public:
     * @brief New the event loop in which the connection I/O is handled.
     *
     * @return EventLoop*
+    * @note It can be called in any thread, see migrateTo() for the value
+    * while the connection moves.
     */
    virtual EventLoop *getLoop() = 0;
 
+   /**
+    * @brief Move the connection to another event loop. The socket is watched
+    * by the new loop, the buffered data and the idle kickoff entry move with
+    * it, and the data is sent in the order of the send() calls across the
+    * move. Tasks the user queued in the old loop, such as timers, are not
+    * moved.
+    *
+    * @param loop The loop of a TcpServer connection must be one of the loops
+    * of that server, the main loop or one of getIoLoops().
+    * @note It can be called in any thread, it is ignored if the connection is
+    * not connected, already moving or the loop is not allowed. getLoop()
+    * returns the new loop once the connection has left the old one, the
+    * functions queued in the old loop meanwhile run there after the
+    * connection has left it.
+    */
+   virtual void migrateTo(EventLoop *loop) = 0;
+
    /**
     * @brief Set the custom data on the connection.
     *
@@ -212,6 +399,14 @@ public:
     */
    virtual size_t bytesReceived() const = 0;
 
+   /**
+    * @brief Return the CPU which handled the packets of the connection
+    * (SO_INCOMING_CPU), it is a diagnostic of the CPU steering.
+    *
+    * @return int -1 if it is unknown or not supported.
+    */
+   virtual int incomingCpu() const = 0;
+
 private:
    Any m_context;
 };
@@ -4,9 +4,12 @@
 #define ENABLE_ELG_LOG
 #include <elog/logger.h>
 
+#include <future>
+#include <map>
 #include <vector>
 
 #include "inner/acceptor.h"
+#include "inner/socket_handoff.h"
 #include "inner/tcp_connection_impl.h"
 using namespace netpoll;
 using namespace elog;
@@ -26,13 +29,17 @@ TcpServer::TcpServer(EventLoop *loop, const InetAddress &address,
                              const MessageBuffer *buffer) {
        ELG_ERROR("unhandled recv message [{} bytes]", buffer->readableBytes());
        buffer->retrieveAll();
-    })
+    }),
+    m_reUseAddr(reUseAddr),
+    m_reUsePort(reUsePort)
 {
 #ifndef _WIN32
    IgnoreSigPipe::Register();
 #endif
-   m_acceptorPtr->setNewConnectionCallback(
-     [&](int fd, InetAddress const &addr) { newConnection(fd, addr); });
+   m_acceptorPtr->setNewConnectionBatchCallback(
+     [this, acceptor = m_acceptorPtr.get()](const AcceptedList &batch) {
+        newConnections(acceptor, batch);
+     });
 }
 
 TcpServer::~TcpServer()
@@ -41,23 +48,216 @@ TcpServer::~TcpServer()
    stop();
 }
 
-void TcpServer::newConnection(int sockfd, const InetAddress &peer)
+void TcpServer::newConnection(Acceptor *acceptor, int sockfd,
+                              const InetAddress &peer)
 {
    ELG_TRACE("new connection:fd={} address={}", sockfd, peer.toIpPort());
    m_loop->assertInLoopThread();
    EventLoop *ioLoop{};
    if (m_loopPoolPtr && m_loopPoolPtr->size() > 0)
    {
-      ioLoop = m_loopPoolPtr->getNextLoop();
+      ioLoop = loopForPeer(peer);
+      if (!admit(acceptor, ioLoop, sockfd, peer)) { return; }
+      m_loopPoolPtr->onConnectionOpened(ioLoop);
    }
-   else { ioLoop = m_loop; }
-   auto connPtr = std::make_shared<TcpConnectionImpl>(
-     ioLoop, sockfd, InetAddress(Socket::getLocalAddr(sockfd)), peer);
+   else
+   {
+      ioLoop = m_loop;
+      if (!admit(acceptor, ioLoop, sockfd, peer)) { return; }
+   }
+   ioLoop->runInLoop([this, ioLoop, sockfd, peer]() {
+      connectionEstablished(createConnection(ioLoop, sockfd, peer));
+   });
+}
+
+void TcpServer::newConnections(Acceptor *acceptor, const AcceptedList &batch)
+{
+   m_loop->assertInLoopThread();
+   if (!m_loopPoolPtr || m_loopPoolPtr->size() == 0)
+   {
+      for (auto &item : batch)
+      {
+         newConnection(acceptor, item.first, item.second);
+      }
+      return;
+   }
+   // Hand the sockets over with one task per target loop rather than one per
+   // connection, the connections are built in the loops which use them.
+   std::map<EventLoop *, AcceptedList> loopSockets;
+   for (auto &item : batch)
+   {
+      ELG_TRACE("new connection:fd={} address={}", item.first,
+                item.second.toIpPort());
+      auto *ioLoop = loopForPeer(item.second);
+      if (!admit(acceptor, ioLoop, item.first, item.second)) { continue; }
+      m_loopPoolPtr->onConnectionOpened(ioLoop);
+      loopSockets[ioLoop].push_back(item);
+   }
+   for (auto &iter : loopSockets)
+   {
+      auto *ioLoop = iter.first;
+      ioLoop->queueInLoop([this, ioLoop, sockets = std::move(iter.second)]() {
+         for (auto &item : sockets)
+         {
+            connectionEstablished(
+              createConnection(ioLoop, item.first, item.second));
+         }
+      });
+   }
+}
+
+void TcpServer::newConnectionInLoop(Acceptor *acceptor, int sockfd,
+                                    const InetAddress &peer)
+{
+   ELG_TRACE("new connection in loop:fd={} address={}", sockfd,
+             peer.toIpPort());
+   auto *ioLoop = acceptor->getLoop();
+   ioLoop->assertInLoopThread();
+   if (!admit(acceptor, ioLoop, sockfd, peer)) { return; }
+   m_loopPoolPtr->onConnectionOpened(ioLoop);
+   connectionEstablished(createConnection(ioLoop, sockfd, peer));
+}
+
+namespace {
+// The bytes of the IP without the port.
+std::string peerKey(const InetAddress &peer)
+{
+   if (peer.isIpV6())
+   {
+      return std::string(reinterpret_cast<const char *>(peer.ip6NetEndian()),
+                         16);
+   }
+   auto ip = peer.ipNetEndian();
+   return std::string(reinterpret_cast<const char *>(&ip), sizeof(ip));
+}
+
+void closeFd(int fd)
+{
+#ifndef _WIN32
+   ::close(fd);
+#else
+   closesocket(fd);
+#endif
+}
+}   // namespace
+
+EventLoop *TcpServer::loopForPeer(const InetAddress &peer)
+{
+   if (!m_placementSet) { return m_loopPoolPtr->getLoopForPeer(peer); }
+   return m_loopPoolPtr->getLoopForPeer(peer, m_placement, m_selector);
+}
+
+TcpServer::Admission TcpServer::checkLoad(EventLoop *ioLoop)
+{
+   if (m_admission.maxConnections > 0 &&
+       m_connNum.load(std::memory_order_relaxed) >= m_admission.maxConnections)
+   {
+      return Admission::ServerFull;
+   }
+   if (m_admission.maxConnectionsPerLoop > 0)
+   {
+      auto loopConnNum = m_loopPoolPtr && m_loopPoolPtr->size() > 0
+                         ? m_loopPoolPtr->connectionNum(ioLoop->index())
+                         : m_connNum.load(std::memory_order_relaxed);
+      if (loopConnNum >= m_admission.maxConnectionsPerLoop)
+      {
+         return Admission::LoopFull;
+      }
+   }
+   if (m_admission.maxLoopBusyUs > 0 &&
+       ioLoop->busyTimeUs() > m_admission.maxLoopBusyUs)
+   {
+      // The busy time is only updated when the loop iterates, an idle loop
+      // is woken up to run one more iteration and catch up.
+      ioLoop->wakeup();
+      return Admission::Overloaded;
+   }
+   return Admission::Admitted;
+}
+
+bool TcpServer::admit(Acceptor *acceptor, EventLoop *ioLoop, int fd,
+                      const InetAddress &peer)
+{
+   auto result   = checkLoad(ioLoop);
+   bool reserved = result == Admission::Admitted;
+   if (reserved)
+   {
+      // The acceptors of the ReusePort loops admit at the same time, the
+      // connection is counted before the check so that they cannot overshoot
+      // together.
+      auto connNum = m_connNum.fetch_add(1, std::memory_order_relaxed);
+      if (m_admission.maxConnections > 0 &&
+          connNum >= m_admission.maxConnections)
+      {
+         result = Admission::ServerFull;
+      }
+   }
+   if (result == Admission::Admitted && m_admission.maxConnectionsPerIp > 0)
+   {
+      std::lock_guard<std::mutex> lock(m_peerMutex);
+      auto                       &num = m_peerConnNum[peerKey(peer)];
+      if (num < m_admission.maxConnectionsPerIp) { ++num; }
+      else { result = Admission::IpFull; }
+   }
+   m_admissionCounters[static_cast<size_t>(result)].fetch_add(
+     1, std::memory_order_relaxed);
+   if (result == Admission::Admitted) { return true; }
+   if (reserved) { m_connNum.fetch_sub(1, std::memory_order_relaxed); }
+   ELG_TRACE("connection from {} is not admitted, reason={}", peer.toIpPort(),
+             static_cast<int>(result));
+   closeFd(fd);
+   if (result != Admission::IpFull &&
+       m_admission.shedMode == ShedMode::PauseAccepting && !acceptor->paused())
+   {
+      m_acceptPauses.fetch_add(1, std::memory_order_relaxed);
+      acceptor->pauseUntil(
+        [this, ioLoop]() { return checkLoad(ioLoop) == Admission::Admitted; },
+        m_admission.resumeCheckInterval);
+   }
+   return false;
+}
+
+void TcpServer::releaseAdmission(const TcpConnectionPtr &connectionPtr)
+{
+   m_connNum.fetch_sub(1, std::memory_order_relaxed);
+   if (m_admission.maxConnectionsPerIp == 0) { return; }
+   std::lock_guard<std::mutex> lock(m_peerMutex);
+   auto iter = m_peerConnNum.find(peerKey(connectionPtr->peerAddr()));
+   if (iter != m_peerConnNum.end() && --iter->second == 0)
+   {
+      m_peerConnNum.erase(iter);
+   }
+}
+
+AdmissionStats TcpServer::admissionStats() const
+{
+   auto count = [this](Admission result) {
+      return m_admissionCounters[static_cast<size_t>(result)].load(
+        std::memory_order_relaxed);
+   };
+   AdmissionStats stats;
+   stats.admitted           = count(Admission::Admitted);
+   stats.rejectedServerFull = count(Admission::ServerFull);
+   stats.rejectedLoopFull   = count(Admission::LoopFull);
+   stats.rejectedIpFull     = count(Admission::IpFull);
+   stats.rejectedOverloaded = count(Admission::Overloaded);
+   stats.acceptPauses       = m_acceptPauses.load(std::memory_order_relaxed);
+   return stats;
+}
+
+std::shared_ptr<TcpConnectionImpl> TcpServer::createConnection(
+  EventLoop *ioLoop, int sockfd, const InetAddress &peer)
+{
+   auto connPtr = std::allocate_shared<TcpConnectionImpl>(
+     PoolAllocator<TcpConnectionImpl>(), ioLoop, sockfd,
+     InetAddress(Socket::getLocalAddr(sockfd)), peer);
 
    if (m_idleTimeout > 0)
    {
-      assert(m_timingWheelMap[ioLoop]);
-      connPtr->enableKickingOff(m_idleTimeout, m_timingWheelMap[ioLoop]);
+      // The map is not modified after start(), it may be read in any loop.
+      auto &timingWheel = m_timingWheelMap.at(ioLoop);
+      assert(timingWheel);
+      connPtr->enableKickingOff(m_idleTimeout, timingWheel);
    }
    connPtr->setRecvMsgCallback(m_recvMessageCallback);
    if (m_connectionCallback)
@@ -72,8 +272,273 @@ void TcpServer::newConnection(int sockfd, const InetAddress &peer)
         });
    connPtr->setCloseCallback(
      [this](TcpConnectionPtr const &conn) { connectionClosed(conn); });
-   m_connSet.insert(connPtr);
-   connPtr->connectEstablished();
+   connPtr->setMigratedCallback(
+     [this](TcpConnectionPtr const &conn, EventLoop *from) {
+        connectionMigrated(conn, from);
+     });
+   // Only the loops with a shard can take the connection.
+   connPtr->setMigrationFilter(
+     [this](EventLoop *to) { return m_connShards.count(to) == 1; });
+   return connPtr;
+}
+
+void TcpServer::startAcceptors()
+{
+   auto mode = m_acceptMode;
+   if (!m_loopPoolPtr || m_loopPoolPtr->size() == 0)
+   {
+      mode = AcceptMode::Single;
+   }
+#ifndef __linux__
+   if (mode == AcceptMode::SharedExclusive) { mode = AcceptMode::Single; }
+#endif
+   if (mode == AcceptMode::ReusePort && !m_reUsePort)
+   {
+      ELG_ERROR("TcpServer [{}] AcceptMode::ReusePort requires SO_REUSEPORT, "
+                "fall back to AcceptMode::Single",
+                m_serverName);
+      mode = AcceptMode::Single;
+   }
+#ifndef _WIN32
+   if (!m_adoptedListenFds.empty())
+   {
+      // It takes the place of the socket bound by the constructor, which
+      // never listened.
+      m_acceptorPtr.reset(new Acceptor(m_loop, m_adoptedListenFds.front()));
+      m_acceptorPtr->setNewConnectionBatchCallback(
+        [this, acceptor = m_acceptorPtr.get()](const AcceptedList &batch) {
+           newConnections(acceptor, batch);
+        });
+      m_adoptedListenFds.erase(m_adoptedListenFds.begin());
+   }
+#endif
+   // A socket handed over by another process already listens.
+   bool adopted = m_acceptorPtr->listening();
+   m_acceptorPtr->setBatchSize(m_acceptBatchSize);
+   if (m_deferAccept > 0) { m_acceptorPtr->deferAccept(m_deferAccept); }
+   if (mode == AcceptMode::Single)
+   {
+      m_acceptorPtr->listen();
+      watchAdoptedListeners();
+      return;
+   }
+
+   // The socket of the server stays bound so that the port is kept, but with
+   // ReusePort it never listens and gets no connections.
+   if (mode == AcceptMode::SharedExclusive) { m_acceptorPtr->listenSocket(); }
+   for (auto *ioLoop : m_loopPoolPtr->getLoops())
+   {
+      std::unique_ptr<Acceptor> acceptor;
+#ifndef _WIN32
+      if (mode == AcceptMode::SharedExclusive ||
+          (adopted && m_loopAcceptors.empty()))
+      {
+         acceptor.reset(new Acceptor(ioLoop, *m_acceptorPtr));
+      }
+      else if (!m_adoptedListenFds.empty())
+      {
+         acceptor.reset(new Acceptor(ioLoop, m_adoptedListenFds.front()));
+         m_adoptedListenFds.erase(m_adoptedListenFds.begin());
+      }
+      else
+#endif
+      {
+         acceptor.reset(
+           new Acceptor(ioLoop, m_acceptorPtr->addr(), m_reUseAddr, true));
+         // The sockets join the SO_REUSEPORT group in the order of the loops.
+         acceptor->listenSocket();
+      }
+      acceptor->setNewConnectionCallback(
+        [this, ptr = acceptor.get()](int fd, InetAddress const &addr) {
+           newConnectionInLoop(ptr, fd, addr);
+        });
+      acceptor->setBatchSize(m_acceptBatchSize);
+      if (m_deferAccept > 0 && mode == AcceptMode::ReusePort)
+      {
+         acceptor->deferAccept(m_deferAccept);
+      }
+      auto *ptr = acceptor.get();
+      ioLoop->runInLoop([ptr]() { ptr->listen(); });
+      m_loopAcceptors.push_back(std::move(acceptor));
+   }
+   if (m_cpuSteering && mode == AcceptMode::ReusePort)
+   {
+      std::vector<int> cpus;
+      m_loopPoolPtr->pinToCpus(&cpus);
+      m_loopAcceptors.front()->steerByCpu(cpus);
+   }
+   watchAdoptedListeners();
+}
+
+#ifndef _WIN32
+void TcpServer::listenBeforeFork()
+{
+   assert(!m_started);
+   m_acceptorPtr->listenSocket();
+}
+
+void TcpServer::reopenSocket()
+{
+   assert(!m_started && m_reUsePort);
+   // The inherited socket never listened, it only kept the port.
+   m_acceptorPtr.reset(
+     new Acceptor(m_loop, m_acceptorPtr->addr(), m_reUseAddr, true));
+   m_acceptorPtr->setNewConnectionBatchCallback(
+     [this, acceptor = m_acceptorPtr.get()](const AcceptedList &batch) {
+        newConnections(acceptor, batch);
+     });
+}
+#endif
+
+void TcpServer::watchAdoptedListeners()
+{
+#ifndef _WIN32
+   // The handed over sockets which are left are watched by the loop of the
+   // server, so that the connections queued on them are not lost.
+   for (auto fd : m_adoptedListenFds)
+   {
+      std::unique_ptr<Acceptor> acceptor(new Acceptor(m_loop, fd));
+      acceptor->setNewConnectionBatchCallback(
+        [this, ptr = acceptor.get()](const AcceptedList &batch) {
+           newConnections(ptr, batch);
+        });
+      acceptor->setBatchSize(m_acceptBatchSize);
+      acceptor->listen();
+      m_loopAcceptors.push_back(std::move(acceptor));
+   }
+   m_adoptedListenFds.clear();
+#endif
+}
+
+void TcpServer::adoptConnections()
+{
+#ifndef _WIN32
+   for (auto &item : m_adoptedConnections)
+   {
+      auto       fd = item.first;
+      InetAddress peer(Socket::getPeerAddr(fd));
+      EventLoop  *ioLoop{};
+      if (m_loopPoolPtr && m_loopPoolPtr->size() > 0)
+      {
+         ioLoop = loopForPeer(peer);
+         m_loopPoolPtr->onConnectionOpened(ioLoop);
+      }
+      else { ioLoop = m_loop; }
+      // Taken over whatever the limits, but counted like the others.
+      m_connNum.fetch_add(1, std::memory_order_relaxed);
+      if (m_admission.maxConnectionsPerIp > 0)
+      {
+         std::lock_guard<std::mutex> lock(m_peerMutex);
+         ++m_peerConnNum[peerKey(peer)];
+      }
+      ioLoop->queueInLoop(
+        [this, ioLoop, fd, peer, unread = std::move(item.second)]() {
+           auto connPtr = createConnection(ioLoop, fd, peer);
+           connectionEstablished(connPtr);
+           connPtr->deliverInput(unread);
+        });
+   }
+   m_adoptedConnections.clear();
+#endif
+}
+
+#ifndef _WIN32
+bool TcpServer::handOff(const std::string &path, bool withIdleConnections)
+{
+   assert(m_started);
+   assert(!m_loop->isInLoopThread());
+   HandoffState       state;
+   std::promise<void> listed;
+   m_loop->runInLoop([this, &state, &listed]() {
+      // The sockets shared by the loops are handed over once.
+      if (m_acceptorPtr && m_acceptorPtr->listening())
+      {
+         state.listenFds.push_back(m_acceptorPtr->fd());
+      }
+      for (auto &acceptor : m_loopAcceptors)
+      {
+         if (!acceptor->shared()) { state.listenFds.push_back(acceptor->fd()); }
+      }
+      listed.set_value();
+   });
+   listed.get_future().get();
+
+   std::vector<std::shared_ptr<TcpConnectionImpl>> detached;
+   if (withIdleConnections)
+   {
+      for (auto &iter : m_connShards)
+      {
+         auto              *loop = iter.first;
+         std::promise<void> collected;
+         loop->runInLoop([this, loop, &state, &detached, &collected]() {
+            std::string unread;
+            for (auto &conn : m_connShards.at(loop).conns)
+            {
+               auto connPtr = std::static_pointer_cast<TcpConnectionImpl>(conn);
+               // Skip the connections which moved but are not dropped yet.
+               if (conn->getLoop() != loop || !connPtr->detach(&unread))
+               {
+                  continue;
+               }
+               state.connections.emplace_back(connPtr->socketFd(),
+                                              std::move(unread));
+               detached.push_back(std::move(connPtr));
+            }
+            collected.set_value();
+         });
+         collected.get_future().get();
+      }
+   }
+
+   bool ok = handoff::send(path, state);
+   for (auto &conn : detached)
+   {
+      conn->getLoop()->runInLoop([conn, ok]() {
+         // The other process holds the socket, closing it here sends no FIN.
+         if (ok) { conn->forceClose(); }
+         else { conn->reattach(); }
+      });
+   }
+   if (ok)
+   {
+      std::promise<void> stopped;
+      m_loop->runInLoop([this, &stopped]() {
+         stopAcceptors();
+         stopped.set_value();
+      });
+      stopped.get_future().get();
+   }
+   return ok;
+}
+
+bool TcpServer::adoptFrom(const std::string &path, double timeout)
+{
+   assert(!m_started);
+   HandoffState state;
+   if (!handoff::receive(path, timeout, &state)) { return false; }
+   ELG_INFO("TcpServer [{}] adopted {} listening sockets and {} connections",
+            m_serverName, state.listenFds.size(), state.connections.size());
+   m_adoptedListenFds   = std::move(state.listenFds);
+   m_adoptedConnections = std::move(state.connections);
+   return true;
+}
+#endif
+
+void TcpServer::stopAcceptors()
+{
+   // Each acceptor must be destroyed in its own loop.
+   for (auto &acceptor : m_loopAcceptors)
+   {
+      std::promise<void> pro;
+      auto               f = pro.get_future();
+      acceptor->getLoop()->runInLoop([&acceptor, &pro]() {
+         acceptor.reset();
+         pro.set_value();
+      });
+      f.get();
+   }
+   m_loopAcceptors.clear();
+   m_acceptorPtr.reset();
 }
 
 void TcpServer::start()
@@ -101,55 +566,143 @@ void TcpServer::start()
          }
       }
       ELG_TRACE("map size={}", m_timingWheelMap.size());
-      m_acceptorPtr->listen();
+      m_connShards[m_loop];
+      if (m_loopPoolPtr)
+      {
+         for (auto *ioLoop : m_loopPoolPtr->getLoops())
+         {
+            m_connShards[ioLoop];
+         }
+      }
+      startAcceptors();
+      adoptConnections();
+      if (m_rebalanceInterval > 0 && m_loopPoolPtr)
+      {
+         m_rebalanceTimer = m_loop->runEvery(
+           m_rebalanceInterval, [this](TimerId) { rebalance(); });
+      }
    });
 }
 
-void TcpServer::stop()
+void TcpServer::stop(double drainTimeout)
 {
+   if (m_stopped.exchange(true)) { return; }
    if (m_loop->isInLoopThread())
    {
-      m_acceptorPtr.reset();
-      // copy the connSet_ to a vector, use the vector to close the
-      // connections to avoid the iterator invalidation.
-      std::vector<TcpConnectionPtr> connPtrs;
-      connPtrs.reserve(m_connSet.size());
-      for (auto &conn : m_connSet) { connPtrs.push_back(conn); }
-      for (const auto &connection : connPtrs) { connection->forceClose(); }
+      m_loop->cancelTimer(m_rebalanceTimer);
+      stopAcceptors();
    }
    else
    {
       std::promise<void> pro;
       auto               f = pro.get_future();
       m_loop->queueInLoop([this, &pro]() {
-         m_acceptorPtr.reset();
-         std::vector<TcpConnectionPtr> connPtrs;
-         connPtrs.reserve(m_connSet.size());
-         for (auto &conn : m_connSet) { connPtrs.push_back(conn); }
-         for (const auto &connection : connPtrs) { connection->forceClose(); }
+         m_loop->cancelTimer(m_rebalanceTimer);
+         stopAcceptors();
          pro.set_value();
       });
       f.get();
    }
-   m_loopPoolPtr.reset();
-   for (auto &iter : m_timingWheelMap)
+   // Close the connections of every shard in its own loop at the same time,
+   // and wait for all of them once.
+   if (!m_connShards.empty())
    {
       std::promise<void> pro;
-      auto               f = pro.get_future();
-      iter.second->getLoop()->runInLoop([&iter, &pro]() mutable {
-         iter.second.reset();
-         pro.set_value();
-      });
+      auto               f         = pro.get_future();
+      auto               remaining = std::make_shared<std::atomic<size_t>>(
+        m_connShards.size());
+      for (auto &iter : m_connShards)
+      {
+         auto *loop = iter.first;
+         loop->runInLoop([this, loop, drainTimeout, remaining, &pro]() {
+            closeShard(loop, drainTimeout, [remaining, &pro]() {
+               if (remaining->fetch_sub(1) == 1) { pro.set_value(); }
+            });
+         });
+      }
       f.get();
    }
+   m_loopPoolPtr.reset();
+}
+
+void TcpServer::closeShard(EventLoop *loop, double drainTimeout,
+                           std::function<void()> &&done)
+{
+   // It is the last thing which touches the server, the server may be gone
+   // once done() returns.
+   auto drained = [this, loop, done = std::move(done)]() {
+      // The wheel must be destroyed while its loop is still running.
+      auto iter = m_timingWheelMap.find(loop);
+      if (iter != m_timingWheelMap.end()) { iter->second.reset(); }
+      done();
+   };
+   auto &shard = m_connShards.at(loop);
+   // copy the shard to a vector, use the vector to close the connections to
+   // avoid the iterator invalidation.
+   std::vector<TcpConnectionPtr> connPtrs(shard.conns.begin(),
+                                          shard.conns.end());
+   if (drainTimeout > 0 && !connPtrs.empty())
+   {
+      shard.drained = std::move(drained);
+      for (const auto &connection : connPtrs) { connection->shutdown(); }
+      shard.drainTimer = loop->runAfter(drainTimeout, [this, loop](TimerId) {
+         auto &shard      = m_connShards.at(loop);
+         auto  drained    = std::move(shard.drained);
+         shard.drained    = nullptr;
+         shard.drainTimer = InvalidTimerId;
+         std::vector<TcpConnectionPtr> connPtrs(shard.conns.begin(),
+                                                shard.conns.end());
+         for (const auto &connection : connPtrs) { connection->forceClose(); }
+         drained();
+      });
+      return;
+   }
+   for (const auto &connection : connPtrs) { connection->forceClose(); }
+   // The connections which moved to another loop in the meantime are closed
+   // there, don't wait for them.
+   drained();
+}
+
+void TcpServer::finishDrain(EventLoop *loop)
+{
+   auto &shard = m_connShards.at(loop);
+   if (!shard.drained) { return; }
+   loop->cancelTimer(shard.drainTimer);
+   shard.drainTimer = InvalidTimerId;
+   auto drained     = std::move(shard.drained);
+   shard.drained    = nullptr;
+   drained();
 }
 
-void TcpServer::handleCloseInLoop(const TcpConnectionPtr &connectionPtr)
+void TcpServer::connectionEstablished(
+  const std::shared_ptr<TcpConnectionImpl> &connectionPtr)
+{
+   auto *loop = connectionPtr->getLoop();
+   loop->assertInLoopThread();
+   m_connShards.at(loop).conns.insert(connectionPtr);
+   connectionPtr->connectEstablished();
+   // The first data is already there, skip a round trip through the poller.
+   if (m_deferAccept > 0) { connectionPtr->readNow(); }
+}
+
+void TcpServer::removeConnection(EventLoop              *loop,
+                                 const TcpConnectionPtr &connectionPtr)
+{
+   auto &shard = m_connShards.at(loop);
+   shard.conns.erase(connectionPtr);
+   if (shard.conns.empty()) { finishDrain(loop); }
+}
+
+void TcpServer::connectionClosed(const TcpConnectionPtr &connectionPtr)
 {
-   size_t n = m_connSet.erase(connectionPtr);
-   (void)n;
-   assert(n == 1);
+   ELG_TRACE("connectionClosed");
+   // The close callback is called in the loop of the connection, which owns
+   // the shard of the connection.
    auto connLoop = connectionPtr->getLoop();
+   connLoop->assertInLoopThread();
+   assert(m_connShards.at(connLoop).conns.count(connectionPtr) == 1);
+   if (m_loopPoolPtr) { m_loopPoolPtr->onConnectionClosed(connLoop); }
+   releaseAdmission(connectionPtr);
 
    // NOTE: always queue this operation in connLoop, because this connection
    // may be in loop_'s current active channels, waiting to be processed.
@@ -159,17 +712,83 @@ void TcpServer::handleCloseInLoop(const TcpConnectionPtr &connectionPtr)
       dynamic_cast<TcpConnectionImpl *>(connectionPtr.get())
         ->connectDestroyed();
    });
+   removeConnection(connLoop, connectionPtr);
 }
 
-void TcpServer::connectionClosed(const TcpConnectionPtr &connectionPtr)
+void TcpServer::connectionMigrated(const TcpConnectionPtr &connectionPtr,
+                                   EventLoop              *from)
 {
-   ELG_TRACE("connectionClosed");
-   if (m_loop->isInLoopThread()) { handleCloseInLoop(connectionPtr); }
-   else
+   auto *loop = connectionPtr->getLoop();
+   loop->assertInLoopThread();
+   // The connection is in both shards until the old loop drops it, a close
+   // meanwhile only erases it twice.
+   auto &shard = m_connShards.at(loop);
+   shard.conns.insert(connectionPtr);
+   // It moved into a draining loop.
+   if (shard.drained) { connectionPtr->shutdown(); }
+   from->queueInLoop([this, from, connectionPtr]() {
+      removeConnection(from, connectionPtr);
+   });
+   if (m_loopPoolPtr)
+   {
+      m_loopPoolPtr->onConnectionClosed(from);
+      m_loopPoolPtr->onConnectionOpened(loop);
+   }
+   if (m_idleTimeout > 0 && !connectionPtr->isKeepAlive())
+   {
+      // The map is not modified after start(), it may be read in any loop.
+      auto iter = m_timingWheelMap.find(loop);
+      if (iter != m_timingWheelMap.end())
+      {
+         std::static_pointer_cast<TcpConnectionImpl>(connectionPtr)
+           ->enableKickingOff(m_idleTimeout, iter->second);
+      }
+   }
+}
+
+void TcpServer::migrateConnections(EventLoop *from, EventLoop *to,
+                                   size_t num)
+{
+   from->runInLoop([this, from, to, num]() {
+      size_t moved = 0;
+      for (auto &conn : m_connShards.at(from).conns)
+      {
+         if (moved == num) { break; }
+         // Skip the connections which already moved but are not dropped yet.
+         if (conn->getLoop() != from || !conn->connected()) { continue; }
+         conn->migrateTo(to);
+         ++moved;
+      }
+   });
+}
+
+void TcpServer::rebalance()
+{
+   if (m_rebalanceHook)
+   {
+      m_rebalanceHook(*this);
+      return;
+   }
+   auto   loopNum = m_loopPoolPtr->size();
+   size_t busiest = 0, idlest = 0;
+   for (size_t i = 1; i < loopNum; ++i)
+   {
+      if (m_loopPoolPtr->loadOf(i) > m_loopPoolPtr->loadOf(busiest))
+      {
+         busiest = i;
+      }
+      if (m_loopPoolPtr->loadOf(i) < m_loopPoolPtr->loadOf(idlest))
+      {
+         idlest = i;
+      }
+   }
+   if (busiest == idlest || m_loopPoolPtr->connectionNum(busiest) < 2 ||
+       m_loopPoolPtr->loadOf(busiest) <= 2 * m_loopPoolPtr->loadOf(idlest))
    {
-      m_loop->queueInLoop(
-        [this, connectionPtr]() { handleCloseInLoop(connectionPtr); });
+      return;
    }
+   migrateConnections(m_loopPoolPtr->getLoop(busiest),
+                      m_loopPoolPtr->getLoop(idlest), 1);
 }
 
 std::string TcpServer::ipPort() const
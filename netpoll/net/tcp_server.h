@@ -1,9 +1,15 @@
 #pragma once
 #include <netpoll/util/noncopyable.h>
 
+#include <atomic>
+#include <functional>
 #include <memory>
-#include <set>
+#include <mutex>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
 
 #include "callbacks.h"
 #include "eventloop_threadpool.h"
@@ -13,6 +19,90 @@
 
 namespace netpoll {
 class Acceptor;
+class TcpConnectionImpl;
+
+/**
+ * @brief How a TcpServer with I/O event loops accepts new connections.
+ *
+ * - Single: one acceptor in the loop of the server hands every new connection
+ * over to an I/O loop chosen by the LoopPlacement.
+ * - ReusePort: every I/O loop owns a socket bound to the same address with
+ * SO_REUSEPORT, the kernel spreads new connections over the sockets and each
+ * loop accepts connections into itself.
+ * - SharedExclusive: every I/O loop watches the listening socket of the server
+ * with EPOLLEXCLUSIVE and accepts connections into itself.
+ *
+ * @note The LoopPlacement is not used by ReusePort and SharedExclusive. Both
+ * modes fall back to Single without I/O loops, SharedExclusive also does so
+ * on platforms other than Linux.
+ */
+enum class AcceptMode
+{
+   Single,
+   ReusePort,
+   SharedExclusive
+};
+
+/**
+ * @brief What TcpServer does with new connections while it is full or
+ * overloaded, see AdmissionPolicy.
+ *
+ * - Close: close every new connection right after it is accepted.
+ * - PauseAccepting: close the connection and stop accepting on its listening
+ * socket until the condition clears, the next connections wait in the
+ * backlog.
+ *
+ * @note A peer IP at its limit always gets its new connections closed.
+ */
+enum class ShedMode
+{
+   Close,
+   PauseAccepting
+};
+
+/**
+ * @brief The limits checked when TcpServer accepts a connection, 0 disables a
+ * limit.
+ */
+struct AdmissionPolicy
+{
+   // The connections open on the server.
+   size_t   maxConnections{0};
+   // The connections open on one I/O loop.
+   size_t   maxConnectionsPerLoop{0};
+   // The connections open from one peer IP.
+   size_t   maxConnectionsPerIp{0};
+   // Shed while the average busy time of an iteration of the target loop is
+   // over this many microseconds, see EventLoop::busyTimeUs().
+   uint32_t maxLoopBusyUs{0};
+   ShedMode shedMode{ShedMode::Close};
+   // How often a paused listening socket checks whether to resume, in
+   // seconds.
+   double   resumeCheckInterval{0.05};
+};
+
+/**
+ * @brief The admission counters of a TcpServer.
+ */
+struct AdmissionStats
+{
+   uint64_t admitted{0};
+   uint64_t rejectedServerFull{0};
+   uint64_t rejectedLoopFull{0};
+   uint64_t rejectedIpFull{0};
+   uint64_t rejectedOverloaded{0};
+   // The times a listening socket was paused.
+   uint64_t acceptPauses{0};
+};
+
+class TcpServer;
+
+/**
+ * Called periodically in the loop of the server to move connections between
+ * the I/O event loops, see TcpServer::enableRebalance().
+ */
+using RebalanceHook = std::function<void(TcpServer &)>;
+
 namespace tcp {
 class Listener;
 }
@@ -49,10 +139,52 @@ public:
    void start();
 
    /**
-    * @brief Stop the server.
+    * @brief Stop the server, the connections are closed in their own loops
+    * at the same time.
     *
+    * @param drainTimeout If it is positive, the server stops accepting and
+    * shuts down the connections gracefully, see TcpConnection::shutdown(),
+    * so the queued data is still sent. The connections which are not closed
+    * by the peers after drainTimeout seconds are closed forcibly.
+    * @note Only the first call takes effect. It blocks until every connection
+    * is closed, so with a drainTimeout it must not be called in the loop of
+    * the server if the server has no I/O loops.
     */
-   void stop();
+   void stop(double drainTimeout = 0);
+
+#ifndef _WIN32
+   /**
+    * @brief Hand the listening sockets of the server over to a new process
+    * waiting in adoptFrom(), through the Unix socket at path with
+    * SCM_RIGHTS. The backlog of the sockets is kept and the server stops
+    * accepting once they are handed over, the connections which are not
+    * handed over keep working until stop(), which can drain them.
+    *
+    * @param path
+    * @param withIdleConnections Also hand over the connections with nothing
+    * left to send, with the input they read but which is not consumed yet.
+    * They are closed in this process without closing the TCP connections.
+    * @return false if the handoff failed, the server then goes on as before.
+    * @note It blocks, it must not be called in the loops of the server.
+    */
+   bool handOff(const std::string &path, bool withIdleConnections = false);
+
+   /**
+    * @brief Wait for an old process calling handOff() on the Unix socket at
+    * path, and take over its sockets. The received listening sockets replace
+    * the socket bound by the constructor when the server starts, so the
+    * server must be constructed with reUsePort to bind next to the old one.
+    * The received connections are spread over the I/O loops on start(), and
+    * their unread input is passed to the message callback first.
+    *
+    * @param path
+    * @param timeout The maximum seconds to wait for the old process.
+    * @return false if nothing was received, the server then listens on its
+    * own socket.
+    * @note It must be called before start().
+    */
+   bool adoptFrom(const std::string &path, double timeout);
+#endif
 
    /**
     * @brief Set the number of event loops in which the I/O of connections to
@@ -81,6 +213,161 @@ public:
       m_loopPoolPtr->start();
    }
 
+   /**
+    * @brief Set how new connections are placed on the I/O event loops, the
+    * default is the policy of the loop pool, LoopPlacement::RoundRobin unless
+    * it is set on the pool.
+    *
+    * @param placement
+    * @note It applies to this server only, the other servers sharing the pool
+    * keep their own.
+    */
+   void setLoopPlacement(LoopPlacement placement)
+   {
+      assert(!m_started);
+      m_placement    = placement;
+      m_selector     = nullptr;
+      m_placementSet = true;
+   }
+   void setLoopPlacement(LoopSelector selector)
+   {
+      assert(!m_started);
+      m_selector     = std::move(selector);
+      m_placementSet = true;
+   }
+
+   /**
+    * @brief Set how new connections are accepted, the default mode is
+    * AcceptMode::Single.
+    *
+    * @param mode
+    * @note AcceptMode::ReusePort requires the server to be constructed with
+    * reUsePort.
+    */
+   void setAcceptMode(AcceptMode mode)
+   {
+      assert(!m_started);
+      m_acceptMode = mode;
+   }
+
+   /**
+    * @brief Steer every new connection to the I/O loop pinned to the CPU
+    * which received it, with a SO_ATTACH_REUSEPORT_CBPF program on the
+    * sockets of AcceptMode::ReusePort. The I/O loops are pinned round-robin to
+    * the CPUs the process may run on, see EventLoopThreadPool::pinToCpus(). A
+    * connection received on a CPU with a loop goes to the first loop pinned
+    * to it, so it stays on its CPU when there is one I/O loop per CPU. A
+    * connection received on another CPU c goes to the loop at index
+    * (c % the number of I/O loops).
+    *
+    * @param on
+    * @note It is Linux only and ignored by the other accept modes. The loops
+    * stay pinned after the server stops.
+    */
+   void setCpuSteering(bool on)
+   {
+      assert(!m_started);
+      m_cpuSteering = on;
+   }
+
+   /**
+    * @brief Set the maximum number of connections accepted in one readiness
+    * event of a listening socket, the default is 32.
+    *
+    * @param size
+    */
+   void setAcceptBatchSize(size_t size)
+   {
+      assert(size > 0);
+      assert(!m_started);
+      m_acceptBatchSize = size;
+   }
+
+   /**
+    * @brief Accept a connection only once its first data arrives, or after
+    * about timeout seconds, with TCP_DEFER_ACCEPT. The first read of the
+    * connection is then done right after the connection callback, without
+    * waiting for the poller.
+    *
+    * @param timeout
+    * @note It is Linux only. Do not use it for protocols in which the server
+    * speaks first.
+    */
+   void setDeferAccept(int timeout)
+   {
+      assert(!m_started);
+      m_deferAccept = timeout;
+   }
+
+   /**
+    * @brief Set the limits checked on every accepted connection, a connection
+    * over a limit is closed right away and counted, see admissionStats().
+    *
+    * @param policy
+    */
+   void setAdmissionPolicy(const AdmissionPolicy &policy)
+   {
+      assert(!m_started);
+      m_admission = policy;
+   }
+
+   /**
+    * @brief Return the admission counters.
+    *
+    * @return AdmissionStats
+    * @note It can be called in any thread.
+    */
+   AdmissionStats admissionStats() const;
+
+   /**
+    * @brief Return the number of connections open on the server.
+    *
+    * @return size_t
+    */
+   size_t connectionNum() const
+   {
+      return m_connNum.load(std::memory_order_relaxed);
+   }
+
+   /**
+    * @brief Rebalance the connections among the I/O loops every interval
+    * seconds. The default hook moves one connection from the most loaded loop
+    * to the least loaded one when the load of the former is over twice the
+    * load of the latter, see EventLoopThreadPool::loadOf().
+    *
+    * @param interval
+    * @param hook A custom policy, it usually calls migrateConnections().
+    */
+   void enableRebalance(double interval, RebalanceHook hook = nullptr)
+   {
+      assert(!m_started);
+      assert(interval > 0);
+      m_rebalanceInterval = interval;
+      m_rebalanceHook     = std::move(hook);
+   }
+
+   /**
+    * @brief Move at most num connections from an I/O loop to another one, see
+    * TcpConnection::migrateTo().
+    *
+    * @param from
+    * @param to
+    * @param num
+    * @note The connections are picked in the loop from, this method may be
+    * called in any thread after start().
+    */
+   void migrateConnections(EventLoop *from, EventLoop *to, size_t num);
+
+   /**
+    * @brief New the I/O event loops pool of the server.
+    *
+    * @return const std::shared_ptr<EventLoopThreadPool>&
+    */
+   const std::shared_ptr<EventLoopThreadPool> &getIoLoopThreadPool() const
+   {
+      return m_loopPoolPtr;
+   }
+
    /**
     * @brief Set the message callback.
     *
@@ -181,14 +468,69 @@ public:
 private:
    friend class netpoll::tcp::Listener;
    friend class EventLoopWrap;
-   void handleCloseInLoop(const TcpConnectionPtr &connectionPtr);
-   void newConnection(int fd, const InetAddress &peer);
+   using ConnectionSet = std::unordered_set<TcpConnectionPtr>;
+   struct ConnectionShard
+   {
+      ConnectionSet         conns;
+      // Set while the shard drains, called once every connection is closed.
+      std::function<void()> drained;
+      TimerId               drainTimer{InvalidTimerId};
+   };
+
+   enum class Admission
+   {
+      Admitted,
+      ServerFull,
+      LoopFull,
+      IpFull,
+      Overloaded,
+      Num
+   };
+
+   void newConnection(Acceptor *acceptor, int fd, const InetAddress &peer);
+   void newConnections(Acceptor *acceptor,
+                       const std::vector<std::pair<int, InetAddress>> &batch);
+   // Count the connection in, or close it and count it out.
+   bool admit(Acceptor *acceptor, EventLoop *ioLoop, int fd,
+              const InetAddress &peer);
+   Admission checkLoad(EventLoop *ioLoop);
+   // The loop of the pool for a new connection, by the placement of this
+   // server if it has one, otherwise by the one of the pool.
+   EventLoop *loopForPeer(const InetAddress &peer);
+   void      releaseAdmission(const TcpConnectionPtr &connectionPtr);
+   void connectionEstablished(
+     const std::shared_ptr<TcpConnectionImpl> &connectionPtr);
    void connectionClosed(const TcpConnectionPtr &connectionPtr);
+   void removeConnection(EventLoop              *loop,
+                         const TcpConnectionPtr &connectionPtr);
+   void closeShard(EventLoop *loop, double drainTimeout,
+                   std::function<void()> &&done);
+   void finishDrain(EventLoop *loop);
+   void connectionMigrated(const TcpConnectionPtr &connectionPtr,
+                           EventLoop              *from);
+   void rebalance();
 
-   EventLoop                 *m_loop;
-   std::unique_ptr<Acceptor>  m_acceptorPtr;
-   std::string                m_serverName;
-   std::set<TcpConnectionPtr> m_connSet;
+   void startAcceptors();
+   void stopAcceptors();
+   void watchAdoptedListeners();
+   void adoptConnections();
+#ifndef _WIN32
+   // Listen before forking the workers, they accept from one queue.
+   void listenBeforeFork();
+   // Bind a socket of its own in a forked worker, it joins the SO_REUSEPORT
+   // group of the other workers.
+   void reopenSocket();
+#endif
+   void newConnectionInLoop(Acceptor *acceptor, int fd, const InetAddress &peer);
+   std::shared_ptr<TcpConnectionImpl> createConnection(
+     EventLoop *ioLoop, int fd, const InetAddress &peer);
+
+   EventLoop                *m_loop;
+   std::unique_ptr<Acceptor> m_acceptorPtr;
+   std::string               m_serverName;
+   // One set per loop, only accessed in that loop. The map is not modified
+   // after start().
+   std::map<EventLoop *, ConnectionShard> m_connShards;
 
    RecvMessageCallback   m_recvMessageCallback;
    ConnectionCallback    m_connectionCallback;
@@ -198,6 +540,36 @@ private:
    std::map<EventLoop *, std::shared_ptr<TimingWheel>> m_timingWheelMap;
    std::shared_ptr<EventLoopThreadPool>                m_loopPoolPtr;
    bool                                                m_started{false};
+
+   LoopPlacement m_placement{LoopPlacement::RoundRobin};
+   LoopSelector  m_selector;
+   bool          m_placementSet{false};
+
+   bool                                   m_reUseAddr;
+   bool                                   m_reUsePort;
+   AcceptMode                             m_acceptMode{AcceptMode::Single};
+   std::vector<std::unique_ptr<Acceptor>> m_loopAcceptors;
+   size_t                                 m_acceptBatchSize{32};
+   bool                                   m_cpuSteering{false};
+   int                                    m_deferAccept{0};
+
+   double        m_rebalanceInterval{0};
+   RebalanceHook m_rebalanceHook;
+   TimerId       m_rebalanceTimer{InvalidTimerId};
+
+   std::atomic<bool> m_stopped{false};
+
+   AdmissionPolicy       m_admission;
+   std::atomic<size_t>   m_connNum{0};
+   std::atomic<uint64_t> m_admissionCounters[static_cast<size_t>(
+     Admission::Num)]{};
+   std::atomic<uint64_t> m_acceptPauses{0};
+   // The connections per peer IP, kept with maxConnectionsPerIp only.
+   std::mutex                              m_peerMutex;
+   std::unordered_map<std::string, size_t> m_peerConnNum;
+
+   std::vector<int>                         m_adoptedListenFds;
+   std::vector<std::pair<int, std::string>> m_adoptedConnections;
 };
 
 }   // namespace netpoll
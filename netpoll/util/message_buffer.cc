@@ -15,9 +15,6 @@
 #include <cerrno>
 
 using namespace netpoll;
-namespace netpoll {
-static constexpr size_t kBufferOffset{8};
-}
 
 MessageBuffer::MessageBuffer(size_t len)
   : m_head(kBufferOffset),
@@ -147,16 +144,17 @@ void MessageBuffer::retrieveAll() const
    m_tail = m_head = kBufferOffset;
 }
 
-ssize_t MessageBuffer::readFd(int fd, int *retErrno)
+ssize_t MessageBuffer::readFd(int fd, int *retErrno, size_t maxLength)
 {
    char         extBuffer[8192];
    struct iovec vec[2];
-   size_t       writable = writableBytes();
+   size_t       writable = std::min(writableBytes(), maxLength);
    vec[0].iov_base       = begin() + m_tail;
    vec[0].iov_len        = static_cast<int>(writable);
    vec[1].iov_base       = extBuffer;
-   vec[1].iov_len        = sizeof(extBuffer);
-   const int iovcnt      = (writable < sizeof extBuffer) ? 2 : 1;
+   vec[1].iov_len        = std::min(sizeof(extBuffer), maxLength - writable);
+   const int iovcnt =
+     (writable < sizeof extBuffer && writable < maxLength) ? 2 : 1;
    ssize_t   n           = ::readv(fd, vec, iovcnt);
    if (n < 0) { *retErrno = errno; }
    else if (static_cast<size_t>(n) <= writable) { m_tail += n; }
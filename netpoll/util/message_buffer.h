@@ -8,6 +8,7 @@
 
 #include <cstdint>
 #include "noncopyable.h"
+#include "object_pool.h"
 #include "string_view.h"
 #ifdef _WIN32
 using ssize_t = intptr_t;
@@ -15,6 +16,7 @@ using ssize_t = intptr_t;
 
 namespace netpoll {
     static constexpr size_t kBufferDefaultLength{2048};
+    static constexpr size_t kBufferOffset{8};
     static constexpr char CRLF[]{"\r\n"};
 
     /**
@@ -266,10 +268,11 @@ namespace netpoll {
          *
          * @param fd The file descriptor. It is usually a socket.
          * @param retErrno The error code when reading.
+         * @param maxLength The most bytes to read.
          * @return ssize_t The number of bytes read from the file descriptor. -1 is
          * returned when an error occurs.
          */
-        ssize_t readFd(int fd, int* retErrno);
+        ssize_t readFd(int fd, int* retErrno, size_t maxLength = SIZE_MAX);
 
         /**
          * @brief Remove the data before a certain position from the buffer.
@@ -346,6 +349,9 @@ namespace netpoll {
         // Used to keep the length of the buffer stable over a suitable range, rather
         // than growing indefinitely
         size_t m_initCap{};
-        mutable std::vector<char> m_buffer;
+        // The storage of default sized buffers is recycled through a pool.
+        using Storage = std::vector<
+          char, PoolAllocator<char, kBufferDefaultLength + kBufferOffset>>;
+        mutable Storage m_buffer;
     };
 } // namespace netpoll
@@ -0,0 +1,250 @@
+#pragma once
+#include <netpoll/util/noncopyable.h>
+
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <vector>
+
+namespace netpoll {
+// The alignment operator new guarantees, the macro only exists since C++17.
+#ifdef __STDCPP_DEFAULT_NEW_ALIGNMENT__
+constexpr size_t kPoolBlockAlignment = __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+#else
+constexpr size_t kPoolBlockAlignment = alignof(std::max_align_t);
+#endif
+
+/**
+ * @brief This class template represents a pool of memory blocks of one size.
+ *
+ * Every thread keeps its own free list, so allocating and freeing a block
+ * takes no lock. A thread freeing more blocks than it allocates, such as an
+ * I/O loop destroying the connections accepted by another loop, hands them
+ * over to a shared list in batches of kBatch blocks, from which the allocating
+ * thread refills its own list. The shared list keeps at most kMaxBatches
+ * batches, any block beyond that goes back to the system allocator.
+ *
+ * @tparam kSize The size of the blocks.
+ * @note Define NETPOLL_NO_OBJECT_POOL to forward everything to operator new.
+ */
+template <size_t kSize>
+class BlockPool : noncopyable
+{
+public:
+   static constexpr size_t kBatch      = 64;
+   static constexpr size_t kMaxBatches = 64;
+
+   static void *allocate()
+   {
+#ifndef NETPOLL_NO_OBJECT_POOL
+      auto &local = localList();
+      if (!local.head && !local.dead) { refill(local); }
+      if (local.head)
+      {
+         auto *block = local.head;
+         local.head  = block->next;
+         --local.count;
+         return block;
+      }
+#endif
+      return ::operator new(kBlockSize);
+   }
+
+   static void deallocate(void *ptr)
+   {
+#ifndef NETPOLL_NO_OBJECT_POOL
+      auto &local = localList();
+      if (!local.dead)
+      {
+         registerDrainer();
+         auto *block = static_cast<Block *>(ptr);
+         block->next = local.head;
+         local.head  = block;
+         if (++local.count >= 2 * kBatch) { spill(local); }
+         return;
+      }
+#endif
+      ::operator delete(ptr);
+   }
+
+private:
+   struct Block
+   {
+      Block *next;
+   };
+   static constexpr size_t kBlockSize =
+     kSize < sizeof(Block) ? sizeof(Block) : kSize;
+
+   // Trivially destructible, so it is still usable while the thread-local
+   // objects of an exiting thread are destroyed.
+   struct LocalList
+   {
+      Block *head;
+      size_t count;
+      bool   dead;
+   };
+
+   struct Drainer
+   {
+      ~Drainer()
+      {
+         auto &local = localList();
+         local.dead  = true;
+         while (local.head)
+         {
+            auto *block = local.head;
+            local.head  = block->next;
+            ::operator delete(block);
+         }
+         local.count = 0;
+      }
+   };
+
+   struct SharedList
+   {
+      std::mutex           mutex;
+      std::vector<Block *> batches;
+   };
+
+   static SharedList &shared()
+   {
+      // Never destroyed, threads may still free blocks at exit.
+      static auto *list = new SharedList;
+      return *list;
+   }
+
+   static void refill(LocalList &local)
+   {
+      registerDrainer();
+      auto                       &list = shared();
+      std::lock_guard<std::mutex> guard(list.mutex);
+      if (list.batches.empty()) { return; }
+      local.head = list.batches.back();
+      list.batches.pop_back();
+      local.count = kBatch;
+   }
+
+   static void spill(LocalList &local)
+   {
+      // Cut a batch off the front of the list.
+      auto *batch = local.head;
+      auto *last  = batch;
+      for (size_t i = 1; i < kBatch; ++i) { last = last->next; }
+      local.head = last->next;
+      last->next = nullptr;
+      local.count -= kBatch;
+      {
+         auto                       &list = shared();
+         std::lock_guard<std::mutex> guard(list.mutex);
+         if (list.batches.size() < kMaxBatches)
+         {
+            list.batches.push_back(batch);
+            return;
+         }
+      }
+      while (batch)
+      {
+         auto *next = batch->next;
+         ::operator delete(batch);
+         batch = next;
+      }
+   }
+
+   static LocalList &localList()
+   {
+      static thread_local LocalList list{};
+      return list;
+   }
+
+   // Make sure the blocks are released when the thread exits.
+   static void registerDrainer()
+   {
+      static thread_local Drainer drainer;
+      (void)drainer;
+   }
+};
+
+/**
+ * @brief An allocator taking the allocations of exactly kCount objects from a
+ * BlockPool, it can be used with std::allocate_shared() and the containers.
+ *
+ * @tparam T
+ * @tparam kCount
+ */
+template <typename T, size_t kCount = 1>
+class PoolAllocator
+{
+public:
+   using value_type = T;
+   template <typename U>
+   struct rebind
+   {
+      using other = PoolAllocator<U, kCount>;
+   };
+
+   PoolAllocator() noexcept = default;
+   template <typename U>
+   PoolAllocator(const PoolAllocator<U, kCount> &) noexcept
+   {
+   }
+
+   T *allocate(size_t n)
+   {
+      static_assert(alignof(T) <= kPoolBlockAlignment,
+                    "over-aligned types are not supported");
+      if (n == kCount)
+      {
+         return static_cast<T *>(BlockPool<sizeof(T) * kCount>::allocate());
+      }
+      return static_cast<T *>(::operator new(n * sizeof(T)));
+   }
+
+   void deallocate(T *ptr, size_t n)
+   {
+      if (n == kCount)
+      {
+         BlockPool<sizeof(T) * kCount>::deallocate(ptr);
+         return;
+      }
+      ::operator delete(ptr);
+   }
+
+   template <typename U>
+   bool operator==(const PoolAllocator<U, kCount> &) const noexcept
+   {
+      return true;
+   }
+   template <typename U>
+   bool operator!=(const PoolAllocator<U, kCount> &) const noexcept
+   {
+      return false;
+   }
+};
+
+/**
+ * @brief Inherit from it to allocate the objects of T created with new from
+ * a BlockPool.
+ *
+ * @tparam T
+ */
+template <typename T>
+class PoolAllocated
+{
+public:
+   static void *operator new(size_t size)
+   {
+      if (size != sizeof(T)) { return ::operator new(size); }
+      return BlockPool<sizeof(T)>::allocate();
+   }
+   static void operator delete(void *ptr, size_t size)
+   {
+      if (size != sizeof(T))
+      {
+         ::operator delete(ptr);
+         return;
+      }
+      BlockPool<sizeof(T)>::deallocate(ptr);
+   }
+};
+
+}   // namespace netpoll
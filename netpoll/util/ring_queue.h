@@ -0,0 +1,115 @@
+#pragma once
+#include <assert.h>
+#include <netpoll/util/noncopyable.h>
+
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+namespace netpoll {
+/**
+ * @brief This class template represents a growable ring queue used by a single
+ * thread. The items are kept by value in one array which doubles when it is
+ * full, so that pushing and popping allocate nothing once the ring has grown
+ * to the working size.
+ *
+ * @tparam T The type of the items in the queue, it must be default
+ * constructible and move assignable. A popped slot is assigned a default
+ * constructed item, which releases what the old item held.
+ * @note Growing moves the items, references to them are invalidated by
+ * push_back().
+ */
+template <typename T>
+class RingQueue : public noncopyable
+{
+public:
+   /**
+    * @brief Construct a new queue.
+    *
+    * @param capacity The initial number of slots, rounded up to a power of
+    * two.
+    */
+   explicit RingQueue(size_t capacity = 4)
+   {
+      size_t cap = 2;
+      while (cap < capacity) { cap <<= 1; }
+      m_mask  = cap - 1;
+      m_slots = std::unique_ptr<T[]>(new T[cap]);
+   }
+
+   /**
+    * @brief Put a item at the back of the queue.
+    *
+    * @param input
+    * @return T& The item in the queue.
+    */
+   T &push_back(T &&input)
+   {
+      if (m_size > m_mask) { grow(); }
+      auto &slot = m_slots[(m_head + m_size) & m_mask];
+      slot       = std::move(input);
+      ++m_size;
+      return slot;
+   }
+
+   void pop_front()
+   {
+      assert(m_size > 0);
+      m_slots[m_head & m_mask] = T();
+      ++m_head;
+      --m_size;
+   }
+
+   void pop_back()
+   {
+      assert(m_size > 0);
+      --m_size;
+      m_slots[(m_head + m_size) & m_mask] = T();
+   }
+
+   T &front()
+   {
+      assert(m_size > 0);
+      return m_slots[m_head & m_mask];
+   }
+
+   T &back()
+   {
+      assert(m_size > 0);
+      return m_slots[(m_head + m_size - 1) & m_mask];
+   }
+
+   /**
+    * @brief Return the item at index, counted from the front.
+    */
+   T &operator[](size_t index)
+   {
+      assert(index < m_size);
+      return m_slots[(m_head + index) & m_mask];
+   }
+
+   size_t size() const { return m_size; }
+   bool   empty() const { return m_size == 0; }
+   size_t capacity() const { return m_mask + 1; }
+
+private:
+   void grow()
+   {
+      size_t cap   = (m_mask + 1) << 1;
+      auto   slots = std::unique_ptr<T[]>(new T[cap]);
+      for (size_t i = 0; i < m_size; ++i)
+      {
+         slots[i] = std::move(m_slots[(m_head + i) & m_mask]);
+      }
+      m_slots = std::move(slots);
+      m_mask  = cap - 1;
+      m_head  = 0;
+   }
+
+   std::unique_ptr<T[]> m_slots;
+   size_t               m_mask{0};
+   size_t               m_head{0};
+   size_t               m_size{0};
+};
+
+}   // namespace netpoll
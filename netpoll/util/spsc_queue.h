@@ -0,0 +1,150 @@
+#pragma once
+#include <assert.h>
+#include <netpoll/util/noncopyable.h>
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+namespace netpoll {
+/**
+ * @brief This class template represents a bounded lock-free single producer
+ * single consumer ring queue.
+ *
+ * Both sides keep a private copy of the other side's index and only reload
+ * the shared atomic when the cached value says the ring is full (producer) or
+ * empty (consumer), so the shared cache lines are touched once per batch
+ * instead of once per item. Pushed items are not visible to the consumer until
+ * publish() is called, and popped slots are not reusable by the producer until
+ * release() is called.
+ *
+ * @tparam T The type of the items in the queue, it must be default
+ * constructible.
+ */
+template <typename T>
+class SpscQueue : public noncopyable
+{
+public:
+   /**
+    * @brief Construct a new queue.
+    *
+    * @param capacity The maximum number of items, rounded up to a power of two.
+    */
+   explicit SpscQueue(size_t capacity)
+   {
+      size_t cap = 2;
+      while (cap < capacity) { cap <<= 1; }
+      m_mask  = cap - 1;
+      m_slots = std::unique_ptr<T[]>(new T[cap]);
+   }
+
+   /**
+    * @brief Put a item into the queue without publishing it.
+    *
+    * @param input
+    * @return false if the queue is full.
+    * @note This method must be called in the producer thread.
+    */
+   bool push(T &&input)
+   {
+      if (!reserve()) { return false; }
+      m_slots[m_writeIndex & m_mask] = std::move(input);
+      ++m_writeIndex;
+      return true;
+   }
+   bool push(const T &input)
+   {
+      if (!reserve()) { return false; }
+      m_slots[m_writeIndex & m_mask] = input;
+      ++m_writeIndex;
+      return true;
+   }
+
+   /**
+    * @brief Make all pushed items visible to the consumer.
+    *
+    * @return true if there were unpublished items.
+    * @note This method must be called in the producer thread.
+    */
+   bool publish()
+   {
+      if (m_writeIndex == m_publishedIndex) { return false; }
+      m_publishedIndex = m_writeIndex;
+      m_tail.store(m_writeIndex, std::memory_order_release);
+      return true;
+   }
+
+   /**
+    * @brief Return the number of items pushed but not published yet.
+    *
+    * @note This method must be called in the producer thread.
+    */
+   size_t unpublished() const { return m_writeIndex - m_publishedIndex; }
+
+   /**
+    * @brief Take a published item from the queue.
+    *
+    * @param output
+    * @return false if the queue is empty.
+    * @note This method must be called in the consumer thread.
+    */
+   bool pop(T &output)
+   {
+      if (m_readIndex == m_cachedTail)
+      {
+         m_cachedTail = m_tail.load(std::memory_order_acquire);
+         if (m_readIndex == m_cachedTail) { return false; }
+      }
+      output = std::move(m_slots[m_readIndex & m_mask]);
+      ++m_readIndex;
+      return true;
+   }
+
+   /**
+    * @brief Hand the slots of all popped items back to the producer.
+    *
+    * @note This method must be called in the consumer thread.
+    */
+   void release() { m_head.store(m_readIndex, std::memory_order_release); }
+
+   /**
+    * @brief Return true if no published item is waiting.
+    *
+    * @note This method must be called in the consumer thread.
+    */
+   bool empty()
+   {
+      if (m_readIndex != m_cachedTail) { return false; }
+      m_cachedTail = m_tail.load(std::memory_order_acquire);
+      return m_readIndex == m_cachedTail;
+   }
+
+   size_t capacity() const { return m_mask + 1; }
+
+private:
+   bool reserve()
+   {
+      if (m_writeIndex - m_cachedHead > m_mask)
+      {
+         m_cachedHead = m_head.load(std::memory_order_acquire);
+         if (m_writeIndex - m_cachedHead > m_mask) { return false; }
+      }
+      return true;
+   }
+
+   // Read by both sides, never written after the construction.
+   alignas(64) size_t   m_mask{0};
+   std::unique_ptr<T[]> m_slots;
+   // Shared indexes, each one written by a single side.
+   alignas(64) std::atomic<size_t> m_head{0};
+   alignas(64) std::atomic<size_t> m_tail{0};
+   // Producer private state.
+   alignas(64) size_t m_writeIndex{0};
+   size_t m_publishedIndex{0};
+   size_t m_cachedHead{0};
+   // Consumer private state, the class is padded to the end of its line.
+   alignas(64) size_t m_readIndex{0};
+   size_t m_cachedTail{0};
+};
+
+}   // namespace netpoll
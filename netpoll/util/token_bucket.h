@@ -0,0 +1,71 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+
+namespace netpoll {
+/**
+ * @brief A token bucket counting bytes. It fills at rate bytes per second up
+ * to burst bytes. A transfer may take more than the bucket holds, the bucket
+ * then goes into debt so that the average rate is kept.
+ *
+ * @note Not thread safe.
+ */
+class TokenBucket
+{
+public:
+   using Clock = std::chrono::steady_clock;
+
+   /**
+    * @brief Set the rate and start with a full bucket.
+    *
+    * @param rate Bytes per second, 0 disables the bucket.
+    * @param burst The size of the bucket, 0 holds a tenth of a second of the
+    * rate.
+    */
+   void reset(size_t rate, size_t burst = 0)
+   {
+      m_rate   = static_cast<double>(rate);
+      m_burst  = burst > 0 ? static_cast<double>(burst)
+                           : std::max(m_rate / 10, 1.0);
+      m_tokens = m_burst;
+      m_last   = Clock::now();
+   }
+
+   bool enabled() const { return m_rate > 0; }
+
+   /**
+    * @brief Add the tokens earned since the last call and return the bytes
+    * which may be transferred now, 0 while the bucket is empty or in debt.
+    *
+    * @return size_t
+    */
+   size_t refill()
+   {
+      auto now = Clock::now();
+      m_tokens = std::min(
+        m_burst,
+        m_tokens + std::chrono::duration<double>(now - m_last).count() * m_rate);
+      m_last = now;
+      return m_tokens >= 1 ? static_cast<size_t>(m_tokens) : 0;
+   }
+
+   void consume(size_t bytes) { m_tokens -= static_cast<double>(bytes); }
+
+   /**
+    * @brief Return the seconds until at least one byte may be transferred.
+    *
+    * @return double
+    */
+   double secondsToRefill() const
+   {
+      return m_tokens >= 1 ? 0 : (1 - m_tokens) / m_rate;
+   }
+
+private:
+   double            m_rate{0};
+   double            m_burst{0};
+   double            m_tokens{0};
+   Clock::time_point m_last;
+};
+}   // namespace netpoll
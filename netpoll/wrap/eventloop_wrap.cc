@@ -1,11 +1,50 @@
 #include "eventloop_wrap.h"
 
 #include <netpoll/util/task_per_thread_queue.h>
+#define ENABLE_ELG_LOG
+#include <elog/logger.h>
 
 #include "tcp_dialer.h"
 #include "tcp_listener.h"
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <map>
+#endif
+
 using namespace netpoll;
+using namespace elog;
+
+#ifndef _WIN32
+namespace {
+// The supervisor of the prefork workers sleeps on a self-pipe, the signal
+// handlers and QuitAllEventLoop() write to it.
+int                   s_supervisorPipe[2]{-1, -1};
+volatile sig_atomic_t s_stopWorkers{0};
+
+void wakeupSupervisor()
+{
+   if (s_supervisorPipe[1] < 0) { return; }
+   int  savedErrno = errno;
+   auto n          = ::write(s_supervisorPipe[1], "", 1);
+   (void)n;
+   errno = savedErrno;
+}
+
+void onSupervisorSignal(int sig)
+{
+   if (sig != SIGCHLD) { s_stopWorkers = 1; }
+   wakeupSupervisor();
+}
+}   // namespace
+#endif
 
 EventLoop* EventLoopWrap::getEventLoop()
 {
@@ -22,49 +61,217 @@ std::vector<EventLoop*>& EventLoopWrap::allEventLoop()
 void netpoll::QuitAllEventLoop()
 {
    for (auto&& loop : EventLoopWrap::allEventLoop()) { loop->quit(); }
+#ifndef _WIN32
+   s_stopWorkers = 1;
+   wakeupSupervisor();
+#endif
+}
+
+const std::shared_ptr<EventLoopThreadPool>& EventLoopWrap::pool()
+{
+   std::call_once(m_pool->created, [this]() {
+      m_pool->pool = std::make_shared<EventLoopThreadPool>(m_pool->threadNum,
+                                                           m_pool->name);
+   });
+   return m_pool->pool;
 }
 
 void EventLoopWrap::serve(tcp::Listener& listener)
 {
+#ifndef _WIN32
+   if (listener.m_workers > 0)
+   {
+      superviseWorkers(listener);
+      return;
+   }
+#endif
+   serveInProcess(listener);
+}
+
+void EventLoopWrap::serveInProcess(tcp::Listener& listener)
+{
+   auto& pool = this->pool();
    if (m_quit)
    {
       allEventLoop().push_back(getEventLoop());
-      for (size_t i = 0; i < m_pool->size(); ++i)
-         allEventLoop().push_back(m_pool->getLoop(i));
+      for (size_t i = 0; i < pool->size(); ++i)
+         allEventLoop().push_back(pool->getLoop(i));
    }
-   listener.m_server->setIoLoopThreadPool(m_pool);
+   listener.m_server->setIoLoopThreadPool(pool);
    listener.m_server->setLoop(getEventLoop());
    listener.m_server->start();
    listener.m_server->getLoop()->loop();
 }
 
+#ifndef _WIN32
+void EventLoopWrap::superviseWorkers(tcp::Listener& listener)
+{
+   using clock = std::chrono::steady_clock;
+   auto& server             = *listener.m_server;
+   bool  reusePortPerWorker = listener.m_reusePortPerWorker;
+   if (reusePortPerWorker && !server.m_reUsePort)
+   {
+      ELG_ERROR("Listener prefork with a socket per worker requires "
+                "SO_REUSEPORT, fall back to the shared socket");
+      reusePortPerWorker = false;
+   }
+   // The workers accept from one queue, otherwise the socket only keeps the
+   // port.
+   if (!reusePortPerWorker) { server.listenBeforeFork(); }
+   if (::pipe2(s_supervisorPipe, O_CLOEXEC | O_NONBLOCK) < 0)
+   {
+      ELG_FATAL("Listener prefork pipe failed, errno={}", errno);
+   }
+   s_stopWorkers = 0;
+   // No SA_RESTART, the signals interrupt poll().
+   struct sigaction action
+   {
+   };
+   action.sa_handler = &onSupervisorSignal;
+   sigemptyset(&action.sa_mask);
+   struct sigaction oldInt, oldTerm, oldChld;
+   ::sigaction(SIGINT, &action, &oldInt);
+   ::sigaction(SIGTERM, &action, &oldTerm);
+   ::sigaction(SIGCHLD, &action, &oldChld);
+
+   auto spawn = [&]() -> pid_t {
+      auto pid = ::fork();
+      if (pid != 0) { return pid; }
+      // The worker. Only this thread survives the fork, the threads of the
+      // event loops are created from here on.
+      ::sigaction(SIGINT, &oldInt, nullptr);
+      ::sigaction(SIGTERM, &oldTerm, nullptr);
+      ::sigaction(SIGCHLD, &oldChld, nullptr);
+      ::close(s_supervisorPipe[0]);
+      ::close(s_supervisorPipe[1]);
+      s_supervisorPipe[0] = s_supervisorPipe[1] = -1;
+      s_stopWorkers                             = 0;
+      if (auto* loop = EventLoop::getEventLoopOfCurrentThread())
+      {
+         loop->resetAfterFork();
+#ifdef __linux__
+         loop->resetTimerQueue();
+#endif
+      }
+      if (reusePortPerWorker)
+      {
+         server.setLoop(getEventLoop());
+         server.reopenSocket();
+      }
+      serveInProcess(listener);
+      elog::WaitForDone();
+      ::_exit(0);
+   };
+
+   std::map<pid_t, clock::time_point> workers;
+   size_t                             missing = listener.m_workers;
+   auto                               respawnAt = clock::now();
+   bool                               stopping  = false;
+   while (!workers.empty() || (missing > 0 && !stopping))
+   {
+      auto now = clock::now();
+      if (!stopping && missing > 0 && now >= respawnAt)
+      {
+         for (; missing > 0; --missing)
+         {
+            auto pid = spawn();
+            if (pid < 0)
+            {
+               ELG_ERROR("Listener prefork fork failed, errno={}", errno);
+               respawnAt = now + std::chrono::seconds(1);
+               break;
+            }
+            workers[pid] = now;
+         }
+      }
+      int timeout = -1;
+      if (!stopping && missing > 0)
+      {
+         timeout = static_cast<int>(
+           std::chrono::duration_cast<std::chrono::milliseconds>(respawnAt -
+                                                                 now)
+             .count());
+      }
+      pollfd pfd{s_supervisorPipe[0], POLLIN, 0};
+      ::poll(&pfd, 1, timeout);
+      char buffer[64];
+      while (::read(s_supervisorPipe[0], buffer, sizeof(buffer)) > 0) {}
+
+      if (s_stopWorkers && !stopping)
+      {
+         stopping = true;
+         for (auto& worker : workers) { ::kill(worker.first, SIGTERM); }
+      }
+      now = clock::now();
+      for (auto iter = workers.begin(); iter != workers.end();)
+      {
+         int status = 0;
+         if (::waitpid(iter->first, &status, WNOHANG) != iter->first)
+         {
+            ++iter;
+            continue;
+         }
+         auto pid     = iter->first;
+         auto started = iter->second;
+         iter         = workers.erase(iter);
+         if (stopping) { continue; }
+         // A worker which quits by itself is not replaced.
+         if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+         {
+            ELG_INFO("Listener worker {} exited", pid);
+            continue;
+         }
+         ELG_ERROR("Listener worker {} died, status={}", pid, status);
+         ++missing;
+         // A worker which dies right away is not forked again at once.
+         if (now - started < std::chrono::seconds(1))
+         {
+            respawnAt = now + std::chrono::seconds(1);
+         }
+      }
+   }
+
+   ::sigaction(SIGINT, &oldInt, nullptr);
+   ::sigaction(SIGTERM, &oldTerm, nullptr);
+   ::sigaction(SIGCHLD, &oldChld, nullptr);
+   ::close(s_supervisorPipe[0]);
+   ::close(s_supervisorPipe[1]);
+   s_supervisorPipe[0] = s_supervisorPipe[1] = -1;
+   s_stopWorkers                             = 0;
+   // The server never ran here, it still needs a loop to be destroyed in.
+   server.setLoop(getEventLoop());
+}
+#endif
+
 void EventLoopWrap::serve(tcp::Dialer& dialer)
 {
+   auto& pool = this->pool();
    if (m_quit)
    {
-      for (size_t i = 0; i < m_pool->size(); ++i)
-         allEventLoop().push_back(m_pool->getLoop(i));
+      for (size_t i = 0; i < pool->size(); ++i)
+         allEventLoop().push_back(pool->getLoop(i));
    }
-   dialer.setLoop(m_pool->getNextLoop());
+   dialer.setLoop(pool->getNextLoop());
    dialer.connect();
-   m_pool->start();
-   m_pool->wait();
+   pool->start();
+   pool->wait();
 }
 
 void EventLoopWrap::serve(const std::vector<tcp::Dialer>& dialers)
 {
+   auto& pool = this->pool();
    if (m_quit)
    {
-      for (size_t i = 0; i < m_pool->size(); ++i)
-         allEventLoop().push_back(m_pool->getLoop(i));
+      for (size_t i = 0; i < pool->size(); ++i)
+         allEventLoop().push_back(pool->getLoop(i));
    }
    for (auto&& dialer : dialers)
    {
-      dialer.setLoop(m_pool->getNextLoop());
+      dialer.setLoop(pool->getNextLoop());
       dialer.connect();
    }
-   m_pool->start();
-   m_pool->wait();
+   pool->start();
+   pool->wait();
 }
 
 std::future<void> EventLoopWrap::runAsDaemon(const std::function<void()>& func)
@@ -2,6 +2,8 @@
 #include <netpoll/net/eventloop_threadpool.h>
 
 #include <future>
+#include <mutex>
+#include <string>
 #include <thread>
 #include <vector>
 
@@ -22,8 +24,10 @@ class EventLoopWrap
 private:
    explicit EventLoopWrap(size_t            threadNum,
                           StringView const &name = "EventLoop")
-     : m_pool(std::make_shared<EventLoopThreadPool>(threadNum, name))
+     : m_pool(std::make_shared<LazyPool>())
    {
+      m_pool->threadNum = threadNum;
+      m_pool->name.assign(name.data(), name.size());
    }
 
 public:
@@ -53,6 +57,23 @@ public:
    friend void netpoll::QuitAllEventLoop();
 
 private:
+   // The threads of the pool are started on first use, so that a prefork
+   // Listener forks its workers before any thread exists.
+   struct LazyPool
+   {
+      size_t                               threadNum{};
+      std::string                          name;
+      std::once_flag                       created;
+      std::shared_ptr<EventLoopThreadPool> pool;
+   };
+
+   const std::shared_ptr<EventLoopThreadPool> &pool();
+
+   void serveInProcess(tcp::Listener &listener);
+#ifndef _WIN32
+   void superviseWorkers(tcp::Listener &listener);
+#endif
+
    friend class netpoll::TcpClient;
    static EventLoop                *getEventLoop();
    static std::vector<EventLoop *> &allEventLoop();
@@ -60,7 +81,7 @@ private:
    static std::future<void> runAsDaemon(std::function<void()> &&func);
 
    bool                                 m_quit{};
-   std::shared_ptr<EventLoopThreadPool> m_pool;
+   std::shared_ptr<LazyPool>            m_pool;
 };
 
 inline EventLoopWrap NewEventLoop(size_t                     threadNum = 2,
@@ -47,6 +47,103 @@ public:
       return *this;
    }
 
+   /**
+    * @brief Set how new connections are placed on the I/O event loops.
+    *
+    * @param placement
+    */
+   Listener &setLoopPlacement(LoopPlacement placement)
+   {
+      m_server->setLoopPlacement(placement);
+      return *this;
+   }
+   Listener &setLoopPlacement(LoopSelector selector)
+   {
+      m_server->setLoopPlacement(std::move(selector));
+      return *this;
+   }
+
+   /**
+    * @brief Set how new connections are accepted, see AcceptMode.
+    *
+    * @param mode
+    */
+   Listener &setAcceptMode(AcceptMode mode)
+   {
+      m_server->setAcceptMode(mode);
+      return *this;
+   }
+
+   /**
+    * @brief Steer new connections to the I/O loops by the receiving CPU, see
+    * TcpServer::setCpuSteering().
+    *
+    * @param on
+    */
+   Listener &setCpuSteering(bool on)
+   {
+      m_server->setCpuSteering(on);
+      return *this;
+   }
+
+   /**
+    * @brief Set the maximum number of connections accepted in one readiness
+    * event.
+    *
+    * @param size
+    */
+   Listener &setAcceptBatchSize(size_t size)
+   {
+      m_server->setAcceptBatchSize(size);
+      return *this;
+   }
+
+   /**
+    * @brief Accept connections once their first data arrives, see
+    * TcpServer::setDeferAccept().
+    *
+    * @param timeout
+    */
+   Listener &setDeferAccept(int timeout)
+   {
+      m_server->setDeferAccept(timeout);
+      return *this;
+   }
+
+   /**
+    * @brief Set the limits checked on every accepted connection, see
+    * TcpServer::setAdmissionPolicy().
+    *
+    * @param policy
+    */
+   Listener &setAdmissionPolicy(const AdmissionPolicy &policy)
+   {
+      m_server->setAdmissionPolicy(policy);
+      return *this;
+   }
+
+   /**
+    * @brief Serve in worker processes forked after the socket is bound, each
+    * runs its own event loops. A worker which dies is forked again, the
+    * serving process only supervises them until SIGINT, SIGTERM or
+    * QuitAllEventLoop().
+    *
+    * @param workers The number of worker processes, 0 serves in this process.
+    * @param reusePortPerWorker Each worker binds a socket of its own to the
+    * SO_REUSEPORT group instead of accepting on the shared socket, requires
+    * reUsePort.
+    * @note It must be served before any event loop runs in the thread, the
+    * threads of the event loops are created by the workers.
+    */
+   Listener &enablePrefork(size_t workers, bool reusePortPerWorker = false)
+   {
+#ifndef _WIN32
+      m_workers            = workers;
+      m_reusePortPerWorker = reusePortPerWorker;
+#endif
+      return *this;
+   }
+
    template <
      typename T, typename... Args,
      typename std::enable_if<trait::has_msg<T>() && trait::has_conn<T>() &&
@@ -177,6 +274,8 @@ private:
 
    std::unique_ptr<TcpServer> m_server;
    std::shared_ptr<void>      m_bind;
+   size_t                     m_workers{};
+   bool                       m_reusePortPerWorker{};
 };
 
 }   // namespace tcp
@@ -0,0 +1,268 @@
+#include <doctest/doctest.h>
+#include <netpoll/net/eventloop_thread.h>
+#include <netpoll/net/tcp_server.h>
+
+#ifndef _WIN32
+#include <sched.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "inner/tcp_helper.h"
+
+using namespace netpoll;
+
+namespace {
+const int s_client_num = 8;
+const int s_conn_num   = 500;
+
+// Connect, send one byte, wait for the echo and close. Return the latency in
+// microseconds or -1 on failure.
+long long echoOnce(uint16_t port)
+{
+   auto begin = std::chrono::steady_clock::now();
+   int  fd    = ::socket(AF_INET, SOCK_STREAM, 0);
+   if (fd < 0) { return -1; }
+   auto addr = loopbackAddress(port);
+   char c    = 'x';
+   bool ok = ::connect(fd, (sockaddr *)&addr, sizeof(addr)) == 0 &&
+             ::write(fd, &c, 1) == 1 && ::read(fd, &c, 1) == 1;
+   ::close(fd);
+   if (!ok) { return -1; }
+   return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - begin)
+     .count();
+}
+
+void runMode(AcceptMode mode, const char *name, int deferAccept = 0)
+{
+   EventLoopThread mainThread("accept_main");
+   mainThread.run();
+   std::atomic<int> served{0};
+   TcpServer        server(mainThread.getLoop(), InetAddress(0, true), name);
+   server.setIoLoopNum(4);
+   server.setAcceptMode(mode);
+   server.setDeferAccept(deferAccept);
+   server.setRecvMessageCallback(
+     [&](const TcpConnectionPtr &conn, const MessageBuffer *buffer) {
+        // Count before the echo, the client may finish as soon as it arrives.
+        ++served;
+        conn->send(StringView{buffer->peek(), buffer->readableBytes()});
+        buffer->retrieveAll();
+     });
+   startServer(mainThread, server);
+   auto port = server.address().toPort();
+
+   std::vector<std::vector<long long>> latencies(s_client_num);
+   std::vector<std::thread>            clients;
+   auto begin = std::chrono::steady_clock::now();
+   for (int i = 0; i < s_client_num; ++i)
+   {
+      clients.emplace_back([&, i]() {
+         for (int j = 0; j < s_conn_num; ++j)
+         {
+            latencies[i].push_back(echoOnce(port));
+         }
+      });
+   }
+   for (auto &t : clients) { t.join(); }
+   auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - begin)
+                    .count();
+
+   std::vector<long long> all;
+   for (auto &v : latencies) { all.insert(all.end(), v.begin(), v.end()); }
+   std::sort(all.begin(), all.end());
+   CHECK_GE(all.front(), 0);
+   printf("%-16s %8.0f conn/s p50 %5lld us p99 %5lld us\n", name,
+          all.size() * 1e6 / elapsed, all[all.size() / 2],
+          all[all.size() * 99 / 100]);
+   fflush(stdout);
+   CHECK_EQ(served.load(), s_client_num * s_conn_num);
+}
+}   // namespace
+
+TEST_CASE("test batched accept")
+{
+   const int       kBurst = 256;
+   EventLoopThread mainThread("accept_main");
+   mainThread.run();
+   std::mutex            mutex;
+   std::set<EventLoop *> loops;
+   std::atomic<int>      established{0};
+   TcpServer server(mainThread.getLoop(), InetAddress(0, true), "batch");
+   server.setIoLoopNum(4);
+   server.setAcceptBatchSize(64);
+   server.setConnectionCallback([&](const TcpConnectionPtr &conn) {
+      if (!conn->connected()) { return; }
+      std::lock_guard<std::mutex> lock(mutex);
+      loops.insert(conn->getLoop());
+      ++established;
+   });
+   server.start();
+   auto port = server.address().toPort();
+
+   // Hold the io loops until the whole burst is admitted, then take the
+   // number of queued functions they run in that iteration. The holding task
+   // is queued from the end of an iteration so that it opens the next one,
+   // the tasks queued by start() must not be counted with it.
+   std::vector<std::future<uint32_t>> depths;
+   std::vector<std::future<void>>     holding;
+   for (auto *ioLoop : server.getIoLoops())
+   {
+      auto depth = std::make_shared<std::promise<uint32_t>>();
+      auto held  = std::make_shared<std::promise<void>>();
+      depths.push_back(depth->get_future());
+      holding.push_back(held->get_future());
+      auto hold = [&server, ioLoop, depth, held, kBurst]() {
+         held->set_value();
+         for (int i = 0; i < 500 && server.connectionNum() < kBurst; ++i)
+         {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+         }
+         ioLoop->runAtIterationEnd(
+           [ioLoop, depth]() { depth->set_value(ioLoop->queueDepth()); });
+      };
+      ioLoop->runInLoop([ioLoop, hold]() {
+         ioLoop->runAtIterationEnd(
+           [ioLoop, hold]() { ioLoop->queueInLoop(hold); });
+      });
+   }
+   for (auto &held : holding) { held.get(); }
+   // Block the server loop so that the connections pile up in the backlog.
+   std::promise<void> blocked;
+   std::promise<void> connected;
+   mainThread.getLoop()->queueInLoop([&blocked, &connected]() {
+      blocked.set_value();
+      connected.get_future().wait();
+   });
+   blocked.get_future().get();
+   auto fds = connectAll(port, kBurst);
+   connected.set_value();
+   waitFor(established, kBurst);
+   CHECK_EQ(established.load(), kBurst);
+   CHECK_EQ(loops.size(), 4);
+   // Each batch reaches each loop as one task, after the holding one.
+   for (auto &depth : depths) { CHECK_LE(depth.get(), 1 + kBurst / 64); }
+   for (auto fd : fds) { ::close(fd); }
+}
+
+#ifdef __linux__
+TEST_CASE("test cpu steering")
+{
+   const int       kConnNum = 64;
+   EventLoopThread mainThread("accept_main");
+   mainThread.run();
+   std::mutex                               mutex;
+   std::set<EventLoop *>                    loops;
+   std::vector<std::pair<int, EventLoop *>> received;
+   std::atomic<int>                         established{0};
+   std::atomic<int>                         unknownCpu{0};
+   TcpServer server(mainThread.getLoop(), InetAddress(0, true), "steering");
+   server.setIoLoopNum(2);
+   server.setAcceptMode(AcceptMode::ReusePort);
+   server.setCpuSteering(true);
+   server.setConnectionCallback([&](const TcpConnectionPtr &conn) {
+      if (!conn->connected()) { return; }
+      if (conn->incomingCpu() < 0) { ++unknownCpu; }
+      std::lock_guard<std::mutex> lock(mutex);
+      loops.insert(conn->getLoop());
+      received.emplace_back(conn->incomingCpu(), conn->getLoop());
+      ++established;
+   });
+   startServer(mainThread, server);
+   auto port = server.address().toPort();
+
+   // The first loop pinned to each CPU, which gets the connections received
+   // on it.
+   std::map<int, EventLoop *> loopOfCpu;
+   for (auto *ioLoop : server.getIoLoops())
+   {
+      std::promise<int> pinned;
+      ioLoop->runInLoop([&pinned]() {
+         cpu_set_t cpus;
+         CPU_ZERO(&cpus);
+         ::sched_getaffinity(0, sizeof(cpus), &cpus);
+         int cpu = -1;
+         for (int i = 0; i < CPU_SETSIZE && CPU_COUNT(&cpus) == 1; ++i)
+         {
+            if (CPU_ISSET(i, &cpus)) { cpu = i; }
+         }
+         pinned.set_value(cpu);
+      });
+      auto cpu = pinned.get_future().get();
+      REQUIRE_GE(cpu, 0);
+      loopOfCpu.emplace(cpu, ioLoop);
+   }
+
+   auto fds = connectAll(port, kConnNum);
+   waitFor(established, kConnNum);
+   CHECK_EQ(established.load(), kConnNum);
+   CHECK_EQ(unknownCpu.load(), 0);
+   {
+      std::lock_guard<std::mutex> lock(mutex);
+      for (auto &conn : received)
+      {
+         auto it = loopOfCpu.find(conn.first);
+         if (it != loopOfCpu.end()) { CHECK_EQ(conn.second, it->second); }
+      }
+   }
+   // Without steering the kernel hashes the connections over both loops.
+   if (std::thread::hardware_concurrency() == 1) { CHECK_EQ(loops.size(), 1); }
+   for (auto fd : fds) { ::close(fd); }
+}
+#endif
+
+#ifdef __linux__
+TEST_CASE("test deferred accept")
+{
+   EventLoopThread mainThread("accept_main");
+   mainThread.run();
+   std::atomic<int>  established{0};
+   std::atomic<bool> readInLoop{false};
+   TcpServer server(mainThread.getLoop(), InetAddress(0, true), "defer");
+   server.setIoLoopNum(2);
+   server.setDeferAccept(5);
+   server.setConnectionCallback([&](const TcpConnectionPtr &conn) {
+      if (conn->connected()) { ++established; }
+   });
+   server.setRecvMessageCallback(
+     [&](const TcpConnectionPtr &conn, const MessageBuffer *buffer) {
+        readInLoop = conn->getLoop()->isInLoopThread();
+        conn->send(StringView{buffer->peek(), buffer->readableBytes()});
+        buffer->retrieveAll();
+     });
+   startServer(mainThread, server);
+   auto port = server.address().toPort();
+
+   int fd = connectTo(port);
+   // Nothing is accepted before the first data.
+   std::this_thread::sleep_for(std::chrono::milliseconds(200));
+   CHECK_EQ(established.load(), 0);
+   char c = 'x';
+   REQUIRE_EQ(::write(fd, &c, 1), 1);
+   REQUIRE_EQ(::read(fd, &c, 1), 1);
+   CHECK_EQ(c, 'x');
+   CHECK_EQ(established.load(), 1);
+   CHECK(readInLoop.load());
+   ::close(fd);
+}
+#endif
+
+TEST_CASE("benchmark accept modes")
+{
+   runMode(AcceptMode::Single, "Single");
+   runMode(AcceptMode::Single, "Single+Defer", 1);
+   runMode(AcceptMode::ReusePort, "ReusePort");
+   runMode(AcceptMode::SharedExclusive, "SharedExclusive");
+}
+#endif
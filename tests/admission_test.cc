@@ -0,0 +1,185 @@
+#include <doctest/doctest.h>
+#include <netpoll/net/eventloop_thread.h>
+#include <netpoll/net/tcp_server.h>
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <thread>
+#include <vector>
+
+#include "inner/tcp_helper.h"
+
+using namespace netpoll;
+
+namespace {
+int connectFrom(const char *source, uint16_t port)
+{
+   int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+   if (source)
+   {
+      sockaddr_in local{};
+      local.sin_family = AF_INET;
+      ::inet_pton(AF_INET, source, &local.sin_addr);
+      REQUIRE_EQ(::bind(fd, (sockaddr *)&local, sizeof(local)), 0);
+   }
+   auto addr = loopbackAddress(port);
+   REQUIRE_EQ(::connect(fd, (sockaddr *)&addr, sizeof(addr)), 0);
+   return fd;
+}
+
+// Return true if the server echoes a byte, false if it closed the connection.
+bool echoes(int fd, int timeoutMs = 2000)
+{
+   char c = 'x';
+   if (::write(fd, &c, 1) != 1) { return false; }
+   pollfd pfd{fd, POLLIN, 0};
+   return ::poll(&pfd, 1, timeoutMs) == 1 && ::read(fd, &c, 1) == 1;
+}
+
+void serveEcho(EventLoopThread  &mainThread,
+               TcpServer        &server,
+               std::atomic<int> &established)
+{
+   server.setConnectionCallback([&established](const TcpConnectionPtr &conn) {
+      if (conn->connected()) { ++established; }
+      else { --established; }
+   });
+   server.setRecvMessageCallback(
+     [](const TcpConnectionPtr &conn, const MessageBuffer *buffer) {
+        conn->send(StringView{buffer->peek(), buffer->readableBytes()});
+        buffer->retrieveAll();
+     });
+   startServer(mainThread, server);
+}
+}   // namespace
+
+TEST_CASE("connections over the limits are closed")
+{
+   EventLoopThread mainThread("admission_main");
+   mainThread.run();
+   std::atomic<int> established{0};
+   TcpServer server(mainThread.getLoop(), InetAddress(0, true), "admission");
+   server.setIoLoopNum(2);
+   AdmissionPolicy policy;
+   policy.maxConnections      = 6;
+   policy.maxConnectionsPerIp = 4;
+   server.setAdmissionPolicy(policy);
+   serveEcho(mainThread, server, established);
+   auto port = server.address().toPort();
+
+   std::vector<int> fds;
+   for (int i = 0; i < 5; ++i) { fds.push_back(connectFrom(nullptr, port)); }
+   int served = 0;
+   for (auto fd : fds) { served += echoes(fd); }
+   CHECK_EQ(served, 4);
+   // Another peer IP is still admitted until the server is full.
+   for (int i = 0; i < 3; ++i)
+   {
+      fds.push_back(connectFrom("127.0.0.2", port));
+   }
+   served = 0;
+   for (size_t i = 5; i < fds.size(); ++i) { served += echoes(fds[i]); }
+   CHECK_EQ(served, 2);
+   CHECK_EQ(server.connectionNum(), 6);
+
+   auto stats = server.admissionStats();
+   CHECK_EQ(stats.admitted, 6);
+   CHECK_EQ(stats.rejectedIpFull, 1);
+   CHECK_EQ(stats.rejectedServerFull, 1);
+
+   // A closed connection makes room for a new one.
+   ::close(fds.front());
+   for (int i = 0; i < 100 && server.connectionNum() > 5; ++i)
+   {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+   }
+   int fd = connectFrom(nullptr, port);
+   CHECK(echoes(fd));
+   ::close(fd);
+   for (size_t i = 1; i < fds.size(); ++i) { ::close(fds[i]); }
+}
+
+TEST_CASE("an overloaded loop pauses the accepting")
+{
+   EventLoopThread mainThread("admission_main");
+   mainThread.run();
+   std::atomic<int> established{0};
+   TcpServer server(mainThread.getLoop(), InetAddress(0, true), "overload");
+   server.setIoLoopNum(1);
+   AdmissionPolicy policy;
+   policy.maxLoopBusyUs       = 1000;
+   policy.shedMode            = ShedMode::PauseAccepting;
+   policy.resumeCheckInterval = 0.01;
+   server.setAdmissionPolicy(policy);
+   serveEcho(mainThread, server, established);
+   auto port = server.address().toPort();
+
+   // One long iteration raises the average busy time of the I/O loop.
+   auto              *ioLoop = server.getIoLoops().front();
+   std::promise<void> blocked;
+   ioLoop->queueInLoop([&blocked]() {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      blocked.set_value();
+   });
+   blocked.get_future().get();
+   std::this_thread::sleep_for(std::chrono::milliseconds(10));
+   REQUIRE_GT(ioLoop->busyTimeUs(), policy.maxLoopBusyUs);
+
+   int shed = connectFrom(nullptr, port);
+   CHECK_FALSE(echoes(shed));
+   // The next connection waits in the backlog until the loop recovers.
+   int waiting = connectFrom(nullptr, port);
+   CHECK(echoes(waiting, 5000));
+   CHECK_LE(ioLoop->busyTimeUs(), policy.maxLoopBusyUs);
+
+   auto stats = server.admissionStats();
+   CHECK_EQ(stats.rejectedOverloaded, 1);
+   CHECK_EQ(stats.acceptPauses, 1);
+   CHECK_EQ(stats.admitted, 1);
+   ::close(shed);
+   ::close(waiting);
+}
+// The acceptors of the ReusePort loops admit at the same time.
+TEST_CASE("the connection limit holds across the acceptors")
+{
+   const int       kClients = 64;
+   EventLoopThread mainThread("admission_main");
+   mainThread.run();
+   std::atomic<int> established{0};
+   TcpServer server(mainThread.getLoop(), InetAddress(0, true), "reuseport");
+   server.setIoLoopNum(4);
+   server.setAcceptMode(AcceptMode::ReusePort);
+   AdmissionPolicy policy;
+   policy.maxConnections = 8;
+   server.setAdmissionPolicy(policy);
+   serveEcho(mainThread, server, established);
+   auto port = server.address().toPort();
+
+   std::vector<int>         fds(kClients);
+   std::vector<std::thread> clients;
+   for (int t = 0; t < 4; ++t)
+   {
+      clients.emplace_back([&fds, port, t]() {
+         for (int i = t; i < kClients; i += 4)
+         {
+            fds[i] = connectFrom(nullptr, port);
+         }
+      });
+   }
+   for (auto &client : clients) { client.join(); }
+   int served = 0;
+   for (auto fd : fds) { served += echoes(fd, 500); }
+   CHECK_EQ(served, policy.maxConnections);
+   CHECK_EQ(server.connectionNum(), policy.maxConnections);
+   CHECK_EQ(server.admissionStats().admitted, policy.maxConnections);
+   for (auto fd : fds) { ::close(fd); }
+}
+#endif
@@ -0,0 +1,94 @@
+#include <doctest/doctest.h>
+#include <netpoll/net/eventloop_thread.h>
+#include <netpoll/net/tcp_server.h>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <future>
+#include <string>
+
+#include "inner/tcp_helper.h"
+
+using namespace netpoll;
+
+TEST_CASE("test auto cork")
+{
+   const std::string path = "/tmp/netpoll_auto_cork_test.txt";
+   const std::string fileData(100000, 'f');
+   {
+      auto *fp = ::fopen(path.c_str(), "wb");
+      REQUIRE(fp);
+      ::fwrite(fileData.data(), 1, fileData.size(), fp);
+      ::fclose(fp);
+   }
+   EventLoopThread mainThread("cork_main");
+   mainThread.run();
+   TcpServer server(mainThread.getLoop(), InetAddress(0, true), "cork");
+   server.setIoLoopNum(1);
+   // bytesSent() after the sends of the handler, after a function queued by
+   // it and after an explicit flush.
+   std::promise<size_t> afterSends, afterQueued, afterFlush;
+   server.setConnectionCallback([](const TcpConnectionPtr &conn) {
+      if (conn->connected()) { conn->setAutoCork(true); }
+   });
+   server.setRecvMessageCallback(
+     [&](const TcpConnectionPtr &conn, const MessageBuffer *buffer) {
+        auto request = buffer->readAll();
+        if (request == "split")
+        {
+           conn->send("HTTP/1.1 200 OK\r\n");
+           conn->send("Content-Length: 4\r\n\r\n");
+           conn->sendv({"bo", "dy"});
+           afterSends.set_value(conn->bytesSent());
+           conn->getLoop()->queueInLoop([conn, &afterQueued]() {
+              afterQueued.set_value(conn->bytesSent());
+           });
+        }
+        else if (request == "flush")
+        {
+           conn->send("now");
+           conn->flush();
+           afterFlush.set_value(conn->bytesSent());
+        }
+        else if (request == "file")
+        {
+           // The held header goes out ahead of the file, then the shutdown.
+           conn->send("header|");
+           conn->sendFile(path.c_str());
+           conn->send("|trailer");
+           conn->shutdown();
+        }
+     });
+   startServer(mainThread, server);
+
+   int fd = connectTo(server.address().toPort());
+   REQUIRE_EQ(::write(fd, "split", 5), 5);
+   const std::string reply = "HTTP/1.1 200 OK\r\nContent-Length: 4\r\n\r\nbody";
+   std::string       data(reply.size(), '\0');
+   size_t            got = 0;
+   while (got < reply.size())
+   {
+      auto n = ::read(fd, &data[got], reply.size() - got);
+      REQUIRE_GT(n, 0);
+      got += n;
+   }
+   CHECK_EQ(data, reply);
+   // Nothing is written until the end of the loop iteration.
+   CHECK_EQ(afterSends.get_future().get(), 0);
+   CHECK_EQ(afterQueued.get_future().get(), 0);
+
+   REQUIRE_EQ(::write(fd, "flush", 5), 5);
+   CHECK_EQ(afterFlush.get_future().get(), reply.size() + 3);
+   data.assign(3, '\0');
+   REQUIRE_EQ(::read(fd, &data[0], 3), 3);
+   CHECK_EQ(data, "now");
+
+   REQUIRE_EQ(::write(fd, "file", 4), 4);
+   CHECK_EQ(readAll(fd), "header|" + fileData + "|trailer");
+   ::close(fd);
+   ::remove(path.c_str());
+}
+#endif
@@ -0,0 +1,92 @@
+#include <doctest/doctest.h>
+#include <netpoll/net/connection_group.h>
+#include <netpoll/net/eventloop_thread.h>
+#include <netpoll/net/tcp_server.h>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "inner/tcp_helper.h"
+
+using namespace netpoll;
+
+TEST_CASE("test connection group")
+{
+   const int       kMembers = 6;
+   EventLoopThread mainThread("group_main");
+   mainThread.run();
+   TcpServer server(mainThread.getLoop(), InetAddress(0, true), "group");
+   server.setIoLoopNum(2);
+   ConnectionGroup                             group;
+   std::vector<std::promise<TcpConnectionPtr>> joined(kMembers);
+   std::atomic<int>                            joinedNum{0};
+   server.setConnectionCallback([&](const TcpConnectionPtr &conn) {
+      if (conn->connected())
+      {
+         group.join(conn);
+         joined[joinedNum++].set_value(conn);
+      }
+      else { group.leave(conn); }
+   });
+   startServer(mainThread, server);
+
+   std::vector<int>              fds;
+   std::vector<TcpConnectionPtr> conns;
+   for (int i = 0; i < kMembers; ++i)
+   {
+      fds.push_back(connectTo(server.address().toPort()));
+      conns.push_back(joined[i].get_future().get());
+   }
+   CHECK_EQ(group.size(), kMembers);
+   // The last member leaves before anything is published.
+   CHECK(group.leave(conns.back()));
+   CHECK_FALSE(group.leave(conns.back()));
+   CHECK_FALSE(group.join(conns.front()));
+
+   auto big = std::make_shared<MessageBuffer>();
+   big->pushBack(std::string(1 << 20, 'b'));
+   group.publish("hello|");
+   group.publish(big);
+   group.publish(MessageBuffer());
+   group.publish(std::string("|bye"));
+   const std::string expected = "hello|" + std::string(1 << 20, 'b') + "|bye";
+
+   // One buffer is shared by the members until they have sent it.
+   for (int i = 0; i < kMembers - 1; ++i)
+   {
+      std::string data(expected.size(), '\0');
+      size_t      got = 0;
+      while (got < expected.size())
+      {
+         auto n = ::read(fds[i], &data[got], expected.size() - got);
+         REQUIRE_GT(n, 0);
+         got += n;
+      }
+      CHECK(data == expected);
+   }
+   for (int i = 0; i < 100 && big.use_count() > 1; ++i)
+   {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+   }
+   CHECK_EQ(big.use_count(), 1);
+
+   for (auto &conn : conns) { conn->shutdown(); }
+   CHECK_EQ(readAll(fds.back()), "");
+   for (int i = 0; i < kMembers - 1; ++i) { CHECK_EQ(readAll(fds[i]), ""); }
+   for (auto fd : fds) { ::close(fd); }
+   conns.clear();
+   for (int i = 0; i < 100 && group.size() > 0; ++i)
+   {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+   }
+   CHECK_EQ(group.size(), 0);
+}
+#endif
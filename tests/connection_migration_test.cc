@@ -0,0 +1,203 @@
+#include <doctest/doctest.h>
+#include <netpoll/net/eventloop_thread.h>
+#include <netpoll/net/tcp_server.h>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <thread>
+
+#include "inner/tcp_helper.h"
+
+using namespace netpoll;
+
+TEST_CASE("test TcpConnection migrateTo")
+{
+   const uint32_t  kNumCount = 200000;
+   EventLoopThread mainThread("migration_main");
+   mainThread.run();
+   TcpServer server(mainThread.getLoop(), InetAddress(0, true), "migration");
+   server.setIoLoopNum(2);
+   server.kickoffIdleConnections(60);
+   std::promise<TcpConnectionPtr> connected;
+   server.setConnectionCallback([&](const TcpConnectionPtr &conn) {
+      if (conn->connected()) { connected.set_value(conn); }
+   });
+   // Echo everything back from the loop which owns the connection.
+   server.setRecvMessageCallback(
+     [](const TcpConnectionPtr &conn, const MessageBuffer *buffer) {
+        conn->send(StringView{buffer->peek(), buffer->readableBytes()});
+        buffer->retrieveAll();
+     });
+   startServer(mainThread, server);
+
+   int  fd    = connectTo(server.address().toPort());
+   auto conn  = connected.get_future().get();
+   auto loops = server.getIoLoops();
+
+   // Send numbers from a foreign thread while the connection keeps moving.
+   std::atomic<bool> sending{true};
+   std::thread       sender([&]() {
+      for (uint32_t i = 0; i < kNumCount; ++i)
+      {
+         conn->send(StringView{reinterpret_cast<const char *>(&i), sizeof(i)});
+      }
+      sending = false;
+   });
+   int migrations = 0;
+   while (sending)
+   {
+      conn->migrateTo(loops[migrations % 2]);
+      ++migrations;
+      std::this_thread::sleep_for(std::chrono::microseconds(200));
+   }
+   sender.join();
+
+   // The client receives the numbers in order, and the echo works after the
+   // moves.
+   bool     ordered = true;
+   uint32_t next    = 0;
+   uint32_t value   = 0;
+   size_t   got     = 0;
+   while (next < kNumCount)
+   {
+      auto n = ::read(fd, reinterpret_cast<char *>(&value) + got,
+                      sizeof(value) - got);
+      REQUIRE_GT(n, 0);
+      got += n;
+      if (got < sizeof(value)) { continue; }
+      got = 0;
+      if (value != next) { ordered = false; }
+      ++next;
+   }
+   CHECK(ordered);
+   CHECK_GT(migrations, 1);
+   char c = 'x';
+   REQUIRE_EQ(::write(fd, &c, 1), 1);
+   REQUIRE_EQ(::read(fd, &c, 1), 1);
+   CHECK_EQ(c, 'x');
+
+   // The connection counters follow the connection.
+   auto pool = server.getIoLoopThreadPool();
+   for (int i = 0; i < 100 && pool->connectionNum(conn->getLoop()->index()) != 1;
+        ++i)
+   {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+   }
+   CHECK_EQ(pool->connectionNum(0) + pool->connectionNum(1), 1);
+   CHECK_EQ(pool->connectionNum(conn->getLoop()->index()), 1);
+   ::close(fd);
+}
+
+// getLoop() and send() are called by another thread while the connection
+// moves, run it under TSan as well.
+TEST_CASE("test TcpConnection getLoop while migrating")
+{
+   const uint32_t  kNumCount = 20000;
+   EventLoopThread mainThread("migration_loop_main");
+   mainThread.run();
+   TcpServer server(mainThread.getLoop(), InetAddress(0, true), "migration");
+   server.setIoLoopNum(2);
+   std::promise<TcpConnectionPtr> connected;
+   server.setConnectionCallback([&](const TcpConnectionPtr &conn) {
+      if (conn->connected()) { connected.set_value(conn); }
+   });
+   startServer(mainThread, server);
+
+   int  fd    = connectTo(server.address().toPort());
+   auto conn  = connected.get_future().get();
+   auto loops = server.getIoLoops();
+
+   std::atomic<bool>     sending{true};
+   std::atomic<uint32_t> ran{0};
+   bool                  known = true;
+   std::thread           sender([&]() {
+      for (uint32_t i = 0; i < kNumCount; ++i)
+      {
+         auto *loop = conn->getLoop();
+         known      = known && (loop == loops[0] || loop == loops[1]);
+         loop->queueInLoop([&ran]() { ++ran; });
+         conn->send(StringView{reinterpret_cast<const char *>(&i), sizeof(i)});
+      }
+      sending = false;
+   });
+   int migrations = 0;
+   while (sending)
+   {
+      conn->migrateTo(loops[migrations % 2]);
+      ++migrations;
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+   }
+   sender.join();
+   CHECK(known);
+   conn->shutdown();
+
+   bool     ordered = true;
+   uint32_t next    = 0;
+   uint32_t value   = 0;
+   size_t   got     = 0;
+   ssize_t  n       = 0;
+   while ((n = ::read(fd, reinterpret_cast<char *>(&value) + got,
+                      sizeof(value) - got)) > 0)
+   {
+      got += n;
+      if (got < sizeof(value)) { continue; }
+      got = 0;
+      if (value != next) { ordered = false; }
+      ++next;
+   }
+   CHECK(ordered);
+   CHECK_EQ(next, kNumCount);
+   for (int i = 0; i < 100 && ran.load() < kNumCount; ++i)
+   {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+   }
+   CHECK_EQ(ran.load(), kNumCount);
+   ::close(fd);
+}
+
+// A loop outside the server has no shard for the connection, the move is
+// refused and the connection keeps working in its loop.
+TEST_CASE("test TcpConnection migrateTo a foreign loop")
+{
+   EventLoopThread mainThread("migration_foreign_main");
+   EventLoopThread foreignThread("migration_foreign");
+   mainThread.run();
+   foreignThread.run();
+   TcpServer server(mainThread.getLoop(), InetAddress(0, true), "migration");
+   server.setIoLoopNum(1);
+   std::promise<TcpConnectionPtr> connected;
+   server.setConnectionCallback([&](const TcpConnectionPtr &conn) {
+      if (conn->connected()) { connected.set_value(conn); }
+   });
+   server.setRecvMessageCallback(
+     [](const TcpConnectionPtr &conn, const MessageBuffer *buffer) {
+        conn->send(StringView{buffer->peek(), buffer->readableBytes()});
+        buffer->retrieveAll();
+     });
+   startServer(mainThread, server);
+
+   int   fd   = connectTo(server.address().toPort());
+   auto  conn = connected.get_future().get();
+   auto *loop = conn->getLoop();
+   conn->migrateTo(foreignThread.getLoop());
+   // The move would start in a task queued by the first one.
+   for (int i = 0; i < 2; ++i)
+   {
+      std::promise<void> done;
+      loop->queueInLoop([&done]() { done.set_value(); });
+      done.get_future().get();
+   }
+   CHECK_EQ(conn->getLoop(), loop);
+   char c = 'x';
+   REQUIRE_EQ(::write(fd, &c, 1), 1);
+   REQUIRE_EQ(::read(fd, &c, 1), 1);
+   CHECK_EQ(c, 'x');
+   CHECK_EQ(server.getIoLoopThreadPool()->connectionNum(0), 1);
+   ::close(fd);
+}
+#endif
@@ -0,0 +1,204 @@
+#include <doctest/doctest.h>
+#include <netpoll/net/eventloop_thread.h>
+#include <netpoll/net/inner/deadline_wheel.h>
+#include <netpoll/net/tcp_server.h>
+
+#ifndef _WIN32
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "inner/tcp_helper.h"
+
+using namespace netpoll;
+
+TEST_CASE("test deadline wheel")
+{
+   EventLoop        loop;
+   DeadlineWheel    wheel(&loop, 0.01, 8);
+   std::vector<int> fired;
+   auto             begin = std::chrono::steady_clock::now();
+   wheel.add(0.05, [&fired]() { fired.push_back(1); });
+   auto cancelled = wheel.add(0.1, [&fired]() { fired.push_back(2); });
+   // Longer than one turn of the wheel
+   wheel.add(0.2, [&]() {
+      fired.push_back(3);
+      // A deadline added while the expired ones run
+      wheel.add(0.02, [&]() {
+         fired.push_back(4);
+         loop.quit();
+      });
+   });
+   CHECK_EQ(wheel.size(), 3);
+   CHECK(wheel.cancel(cancelled));
+   CHECK_FALSE(wheel.cancel(cancelled));
+   loop.loop();
+   auto elapsed = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - begin)
+                    .count();
+   CHECK_EQ(fired, std::vector<int>{1, 3, 4});
+   CHECK_GE(elapsed, 0.22);
+   CHECK_LT(elapsed, 1);
+   CHECK_EQ(wheel.size(), 0);
+}
+
+namespace {
+// Return true if the server closed the connection within timeoutMs.
+bool closedWithin(int fd, int timeoutMs)
+{
+   pollfd pfd{fd, POLLIN, 0};
+   char   buffer[4096];
+   auto   deadline = std::chrono::steady_clock::now() +
+                   std::chrono::milliseconds(timeoutMs);
+   while (std::chrono::steady_clock::now() < deadline)
+   {
+      if (::poll(&pfd, 1, 10) == 1 && ::read(fd, buffer, sizeof(buffer)) <= 0)
+      {
+         return true;
+      }
+   }
+   return false;
+}
+
+// Every complete line is answered, a line starting with "slow" arms a
+// deadline which answers "late" unless the next line comes first.
+void serveLines(EventLoopThread &mainThread, TcpServer &server)
+{
+   server.setRecvMessageCallback(
+     [](const TcpConnectionPtr &conn, const MessageBuffer *buffer) {
+        auto *end = buffer->findCRLF();
+        while (end)
+        {
+           std::string line(buffer->peek(), end);
+           buffer->retrieveUntil(end + 2);
+           if (conn->hasContext())
+           {
+              conn->cancelDeadline(any_cast<uint64_t>(conn->getContext()));
+              conn->clearContext();
+           }
+           if (line.compare(0, 4, "slow") == 0)
+           {
+              conn->setContext(conn->armDeadline(
+                0.1, [](const TcpConnectionPtr &c) { c->send("late\n"); }));
+           }
+           else { conn->send(line + "\n"); }
+           end = buffer->findCRLF();
+        }
+     });
+   startServer(mainThread, server);
+}
+}   // namespace
+
+TEST_CASE("test connection deadlines")
+{
+   EventLoopThread mainThread("deadline_main");
+   mainThread.run();
+   TcpServer server(mainThread.getLoop(), InetAddress(0, true), "deadline");
+   server.setIoLoopNum(1);
+   server.setConnectionCallback([](const TcpConnectionPtr &conn) {
+      if (!conn->connected()) { return; }
+      conn->setReadTimeout(0.2);
+      conn->setWriteTimeout(0.5);
+   });
+   serveLines(mainThread, server);
+   auto port = server.address().toPort();
+
+   SUBCASE("an incomplete message times out")
+   {
+      int fd = connectTo(port);
+      // Complete lines keep the connection open past the timeout.
+      for (int i = 0; i < 3; ++i)
+      {
+         REQUIRE_EQ(::write(fd, "hi\r\n", 4), 4);
+         char buffer[3];
+         REQUIRE_EQ(::read(fd, buffer, 3), 3);
+         std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      }
+      CHECK_FALSE(closedWithin(fd, 300));
+      REQUIRE_EQ(::write(fd, "partial", 7), 7);
+      CHECK(closedWithin(fd, 1000));
+      ::close(fd);
+   }
+
+   SUBCASE("a request deadline fires unless cancelled")
+   {
+      int fd = connectTo(port);
+      REQUIRE_EQ(::write(fd, "slow\r\n", 6), 6);
+      std::string reply(5, '\0');
+      REQUIRE_EQ(::read(fd, &reply[0], 5), 5);
+      CHECK_EQ(reply, "late\n");
+      REQUIRE_EQ(::write(fd, "slow\r\nok\r\n", 10), 10);
+      reply.assign(3, '\0');
+      REQUIRE_EQ(::read(fd, &reply[0], 3), 3);
+      CHECK_EQ(reply, "ok\n");
+      pollfd pfd{fd, POLLIN, 0};
+      CHECK_EQ(::poll(&pfd, 1, 300), 0);
+      ::close(fd);
+   }
+
+   SUBCASE("a peer which does not read times out")
+   {
+      int fd     = connectTo(port);
+      int bufLen = 4096;
+      ::setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufLen, sizeof(bufLen));
+      // Answers pile up in the output queue of the server.
+      std::string lines;
+      for (int i = 0; i < 100000; ++i)
+      {
+         lines += std::string(100, 'x') + "\r\n";
+      }
+      size_t written = 0;
+      while (written < lines.size())
+      {
+         auto n = ::send(fd, lines.data() + written, lines.size() - written,
+                         MSG_NOSIGNAL);
+         if (n <= 0) { break; }
+         written += n;
+      }
+      // The server gives up on the peer, the kernel still holds what it could
+      // not send.
+      for (int i = 0; i < 200 && server.connectionNum() > 0; ++i)
+      {
+         std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+      CHECK_EQ(server.connectionNum(), 0);
+      ::close(fd);
+   }
+}
+
+// Both deadlines expire on the same tick, the first to run cancels the other.
+TEST_CASE("test deadline cancelled by another deadline")
+{
+   EventLoopThread mainThread("deadline_cancel_main");
+   mainThread.run();
+   TcpServer server(mainThread.getLoop(), InetAddress(0, true), "deadline");
+   server.setIoLoopNum(1);
+   std::atomic<int> fired{0};
+   server.setConnectionCallback([&fired](const TcpConnectionPtr &conn) {
+      if (!conn->connected()) { return; }
+      auto ids = std::make_shared<std::vector<uint64_t>>(2);
+      for (size_t i = 0; i < 2; ++i)
+      {
+         (*ids)[i] = conn->armDeadline(
+           0.05, [ids, i, &fired](const TcpConnectionPtr &c) {
+              ++fired;
+              c->cancelDeadline((*ids)[1 - i]);
+           });
+      }
+   });
+   startServer(mainThread, server);
+
+   int fd = connectTo(server.address().toPort());
+   std::this_thread::sleep_for(std::chrono::milliseconds(300));
+   CHECK_EQ(fired.load(), 1);
+   ::close(fd);
+}
+#endif
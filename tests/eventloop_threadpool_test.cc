@@ -3,6 +3,13 @@
 #include <elog/logger.h>
 #include <netpoll/net/eventloop_threadpool.h>
 #include <netpoll/util/defer_call.h>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include <algorithm>
+#include <future>
 using namespace netpoll;
 using namespace elog;
 const int s_thread_num = 8;
@@ -93,3 +100,112 @@ TEST_CASE("test EventLoopThreadPool")
       });
    }
 }
+
+TEST_CASE("test EventLoopThreadPool placement")
+{
+   EventLoopThreadPool threadPool(4);
+   threadPool.start();
+   auto deferWait = makeDeferCall([&]() {
+      for (auto&& loop : threadPool.getLoops()) { loop->quit(); }
+      threadPool.wait();
+   });
+   InetAddress peer("10.0.0.1", 8080);
+   SUBCASE("LeastConnections")
+   {
+      threadPool.setPlacement(LoopPlacement::LeastConnections);
+      for (int i = 0; i < 8; ++i)
+      {
+         threadPool.onConnectionOpened(threadPool.getLoopForPeer(peer));
+      }
+      for (size_t i = 0; i < threadPool.size(); ++i)
+      {
+         CHECK_EQ(threadPool.connectionNum(i), 2);
+      }
+      threadPool.onConnectionClosed(threadPool.getLoop(3));
+      CHECK_EQ(threadPool.getLoopForPeer(peer), threadPool.getLoop(3));
+   }
+   SUBCASE("PeerHash")
+   {
+      threadPool.setPlacement(LoopPlacement::PeerHash);
+      auto* loop = threadPool.getLoopForPeer(peer);
+      CHECK_EQ(threadPool.getLoopForPeer(InetAddress("10.0.0.1", 9090)), loop);
+   }
+   SUBCASE("PowerOfTwoChoices")
+   {
+      threadPool.setPlacement(LoopPlacement::PowerOfTwoChoices);
+      auto loops = threadPool.getLoops();
+      for (int i = 0; i < 16; ++i)
+      {
+         auto* loop = threadPool.getLoopForPeer(peer);
+         CHECK(std::find(loops.begin(), loops.end(), loop) != loops.end());
+      }
+   }
+   SUBCASE("custom selector")
+   {
+      threadPool.setPlacement(
+        [](const EventLoopThreadPool& pool, const InetAddress&) {
+           return pool.size() - 1;
+        });
+      CHECK_EQ(threadPool.getLoopForPeer(peer), threadPool.getLoop(3));
+   }
+   SUBCASE("policy of the caller")
+   {
+      threadPool.setPlacement(
+        [](const EventLoopThreadPool& pool, const InetAddress&) {
+           return pool.size() - 1;
+        });
+      auto first = [](const EventLoopThreadPool&, const InetAddress&) {
+         return size_t{0};
+      };
+      CHECK_EQ(threadPool.getLoopForPeer(peer, LoopPlacement::RoundRobin,
+                                         first),
+               threadPool.getLoop(0));
+      auto* loop = threadPool.getLoopForPeer(peer, LoopPlacement::PeerHash,
+                                             nullptr);
+      CHECK_EQ(threadPool.getLoopForPeer(InetAddress("10.0.0.1", 9090),
+                                         LoopPlacement::PeerHash, nullptr),
+               loop);
+      // The pool keeps its own policy.
+      CHECK_EQ(threadPool.getLoopForPeer(peer), threadPool.getLoop(3));
+   }
+}
+
+#ifdef __linux__
+TEST_CASE("test EventLoopThreadPool pinToCpus")
+{
+   // Confined to the last allowed CPU, as by taskset, which pinToCpus() must
+   // not leave.
+   cpu_set_t allowed;
+   CPU_ZERO(&allowed);
+   REQUIRE_EQ(::sched_getaffinity(0, sizeof(allowed), &allowed), 0);
+   int last = -1;
+   for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+   {
+      if (CPU_ISSET(cpu, &allowed)) { last = cpu; }
+   }
+   REQUIRE_GE(last, 0);
+   cpu_set_t confined;
+   CPU_ZERO(&confined);
+   CPU_SET(last, &confined);
+   REQUIRE_EQ(::sched_setaffinity(0, sizeof(confined), &confined), 0);
+   auto restore = makeDeferCall(
+     [&]() { ::sched_setaffinity(0, sizeof(allowed), &allowed); });
+
+   EventLoopThreadPool threadPool(3);
+   threadPool.start();
+   CHECK(threadPool.pinToCpus());
+   for (auto* loop : threadPool.getLoops())
+   {
+      std::promise<bool> pinned;
+      loop->queueInLoop([&pinned, last]() {
+         cpu_set_t cpus;
+         CPU_ZERO(&cpus);
+         ::sched_getaffinity(0, sizeof(cpus), &cpus);
+         pinned.set_value(CPU_COUNT(&cpus) == 1 && CPU_ISSET(last, &cpus));
+      });
+      CHECK(pinned.get_future().get());
+      loop->quit();
+   }
+   threadPool.wait();
+}
+#endif
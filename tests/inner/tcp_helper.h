@@ -0,0 +1,80 @@
+#ifndef TESTS_TCP_HELPER_H
+#define TESTS_TCP_HELPER_H
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <doctest/doctest.h>
+#include <netinet/in.h>
+#include <netpoll/net/eventloop_thread.h>
+#include <netpoll/net/tcp_server.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <string>
+#include <thread>
+#include <vector>
+
+// The address of the port on the loopback.
+inline sockaddr_in loopbackAddress(uint16_t port)
+{
+   sockaddr_in addr{};
+   addr.sin_family      = AF_INET;
+   addr.sin_port        = htons(port);
+   addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   return addr;
+}
+
+// Connect a blocking socket to the port on the loopback.
+inline int connectTo(uint16_t port)
+{
+   int  fd   = ::socket(AF_INET, SOCK_STREAM, 0);
+   auto addr = loopbackAddress(port);
+   REQUIRE_EQ(::connect(fd, (sockaddr *)&addr, sizeof(addr)), 0);
+   return fd;
+}
+
+// Open num connections to the port on the loopback.
+inline std::vector<int> connectAll(uint16_t port, int num)
+{
+   std::vector<int> fds;
+   for (int i = 0; i < num; ++i) { fds.push_back(connectTo(port)); }
+   return fds;
+}
+
+// Read until the peer closes the connection.
+inline std::string readAll(int fd)
+{
+   std::string data;
+   char        buffer[65536];
+   ssize_t     n = 0;
+   while ((n = ::read(fd, buffer, sizeof(buffer))) > 0)
+   {
+      data.append(buffer, n);
+   }
+   return data;
+}
+
+// Wait up to 5 seconds for the count to reach expected.
+inline void waitFor(const std::atomic<int> &count, int expected)
+{
+   for (int i = 0; i < 500 && count < expected; ++i)
+   {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+   }
+}
+
+// Start the server and wait until it listens.
+inline void startServer(netpoll::EventLoopThread &mainThread,
+                        netpoll::TcpServer       &server)
+{
+   server.start();
+   std::promise<void> started;
+   mainThread.getLoop()->queueInLoop([&started]() { started.set_value(); });
+   started.get_future().get();
+}
+#endif
+
+#endif   // TESTS_TCP_HELPER_H
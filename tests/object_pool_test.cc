@@ -0,0 +1,144 @@
+#include <doctest/doctest.h>
+#include <netpoll/net/eventloop_thread.h>
+#include <netpoll/net/tcp_server.h>
+#include <netpoll/util/message_buffer.h>
+#include <netpoll/util/object_pool.h>
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "inner/tcp_helper.h"
+#include "inner/timer.h"
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+using namespace netpoll;
+
+#ifndef NETPOLL_NO_OBJECT_POOL
+TEST_CASE("BlockPool reuses the freed blocks")
+{
+   using Pool = BlockPool<96>;
+   void *ptr  = Pool::allocate();
+   Pool::deallocate(ptr);
+   CHECK_EQ(Pool::allocate(), ptr);
+   Pool::deallocate(ptr);
+}
+
+TEST_CASE("blocks freed in another thread come back to the allocating thread")
+{
+   using Pool = BlockPool<200>;
+   std::vector<void *> blocks;
+   for (size_t i = 0; i < 4 * Pool::kBatch; ++i)
+   {
+      blocks.push_back(Pool::allocate());
+   }
+   std::set<void *> allocated(blocks.begin(), blocks.end());
+   std::thread([&blocks]() {
+      for (auto *block : blocks) { Pool::deallocate(block); }
+   }).join();
+
+   size_t reused = 0;
+   blocks.clear();
+   for (size_t i = 0; i < 2 * Pool::kBatch; ++i)
+   {
+      blocks.push_back(Pool::allocate());
+      if (allocated.count(blocks.back())) { ++reused; }
+   }
+   CHECK_GE(reused, Pool::kBatch);
+   for (auto *block : blocks) { Pool::deallocate(block); }
+}
+#endif
+
+TEST_CASE("pooled objects behave as usual")
+{
+   auto ptr = std::allocate_shared<std::string>(PoolAllocator<std::string>(),
+                                                "netpoll");
+   std::weak_ptr<std::string> weak = ptr;
+   CHECK_EQ(*ptr, "netpoll");
+   ptr.reset();
+   CHECK(weak.expired());
+
+   MessageBuffer buffer;
+   buffer.pushBack(StringView{"hello"});
+   MessageBuffer copy(buffer);
+   MessageBuffer moved(std::move(buffer));
+   copy.ensureWritableBytes(4 * kBufferDefaultLength);
+   copy.pushBack(StringView{" world"});
+   CHECK_EQ(copy.read(copy.readableBytes()), "hello world");
+   CHECK_EQ(moved.read(moved.readableBytes()), "hello");
+}
+
+TEST_CASE("benchmark block allocation across threads")
+{
+   // Blocks are allocated in one thread and freed in another one, like the
+   // connections accepted by the server loop and destroyed by an I/O loop.
+   const size_t kBlockNum = 1000000;
+   auto         run       = [&](void *(*alloc)(), void (*dealloc)(void *)) {
+      std::vector<void *> blocks(1024);
+      ::Timer             timer;
+      for (size_t done = 0; done < kBlockNum; done += blocks.size())
+      {
+         for (auto &block : blocks) { block = alloc(); }
+         std::thread([&]() {
+            for (auto *block : blocks) { dealloc(block); }
+         }).join();
+      }
+   };
+   printf("operator new: ");
+   run([]() { return ::operator new(2056); },
+       [](void *ptr) { ::operator delete(ptr); });
+   printf("BlockPool:    ");
+   run([]() { return BlockPool<2056>::allocate(); },
+       [](void *ptr) { BlockPool<2056>::deallocate(ptr); });
+}
+
+#ifndef _WIN32
+TEST_CASE("benchmark connection churn")
+{
+   const int       kClientNum = 4;
+   const int       kConnNum   = 2000;
+   EventLoopThread mainThread("churn_main");
+   mainThread.run();
+   std::atomic<int> closed{0};
+   TcpServer        server(mainThread.getLoop(), InetAddress(0, true), "churn");
+   server.setIoLoopNum(2);
+   server.setConnectionCallback([&](const TcpConnectionPtr &conn) {
+      if (conn->disconnected()) { ++closed; }
+   });
+   server.setRecvMessageCallback(
+     [](const TcpConnectionPtr &, const MessageBuffer *buffer) {
+        buffer->retrieveAll();
+     });
+   startServer(mainThread, server);
+
+   auto addr  = loopbackAddress(server.address().toPort());
+   auto begin = std::chrono::steady_clock::now();
+   std::vector<std::thread> clients;
+   for (int i = 0; i < kClientNum; ++i)
+   {
+      clients.emplace_back([&addr]() {
+         for (int j = 0; j < kConnNum; ++j)
+         {
+            int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+            if (::connect(fd, (sockaddr *)&addr, sizeof(addr)) != 0) { break; }
+            ::close(fd);
+         }
+      });
+   }
+   for (auto &t : clients) { t.join(); }
+   waitFor(closed, kClientNum * kConnNum);
+   auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - begin)
+                    .count();
+   printf("connection churn: %.0f accepts/s\n",
+          kClientNum * kConnNum * 1e6 / elapsed);
+   CHECK_EQ(closed.load(), kClientNum * kConnNum);
+}
+#endif
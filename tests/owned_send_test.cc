@@ -0,0 +1,74 @@
+#include <doctest/doctest.h>
+#include <netpoll/net/eventloop_thread.h>
+#include <netpoll/net/tcp_server.h>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "inner/tcp_helper.h"
+
+using namespace netpoll;
+
+// Sends which hand their storage over keep their order with the copied ones,
+// and a shared buffer is queued in place for every peer until it is written.
+TEST_CASE("test sends taking over the storage")
+{
+   const size_t kSize = 4 << 20;
+   std::string  text(kSize, '\0');
+   for (size_t i = 0; i < kSize; ++i)
+   {
+      text[i] = static_cast<char>('a' + i % 26);
+   }
+   auto shared = std::make_shared<MessageBuffer>();
+   shared->pushBack(text);
+   const std::string expected = "copied|" + text + "|" + text + text +
+                                "|moved|" + text + "|end";
+
+   EventLoopThread mainThread("owned_main");
+   mainThread.run();
+   TcpServer server(mainThread.getLoop(), InetAddress(0, true), "owned");
+   server.setIoLoopNum(1);
+   std::promise<void> sent;
+   int                connections = 0;
+   server.setConnectionCallback([&](const TcpConnectionPtr &conn) {
+      if (!conn->connected()) { return; }
+      conn->send("copied|");
+      conn->send(std::string(text));
+      conn->send("|");
+      conn->send(std::vector<char>(text.begin(), text.end()));
+      conn->send(shared);
+      conn->send("|moved|");
+      MessageBuffer buffer;
+      buffer.pushBack(text);
+      conn->send(std::move(buffer));
+      conn->send("|end");
+      conn->shutdown();
+      if (++connections == 2) { sent.set_value(); }
+   });
+   startServer(mainThread, server);
+
+   int fd1 = connectTo(server.address().toPort());
+   int fd2 = connectTo(server.address().toPort());
+   sent.get_future().get();
+   // Neither peer has read yet, both queue the buffer without a copy.
+   CHECK_EQ(shared.use_count(), 3);
+   CHECK(readAll(fd1) == expected);
+   CHECK(readAll(fd2) == expected);
+   for (int i = 0; i < 100 && shared.use_count() > 1; ++i)
+   {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+   }
+   CHECK_EQ(shared.use_count(), 1);
+   CHECK_EQ(shared->readableBytes(), kSize);
+   ::close(fd1);
+   ::close(fd2);
+}
+#endif
@@ -0,0 +1,103 @@
+#include <doctest/doctest.h>
+#include <netpoll/core.h>
+
+#ifndef _WIN32
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <set>
+#include <string>
+#include <thread>
+
+#include "inner/tcp_helper.h"
+
+using namespace netpoll;
+
+namespace {
+// Every message is answered with the pid of the worker.
+struct PidServer
+{
+   void onMessage(TcpConnectionPtr const &conn, const MessageBuffer *buffer)
+   {
+      buffer->retrieveAll();
+      conn->send(std::to_string(::getpid()) + "\n");
+   }
+};
+
+// Return the pid of the worker which served a new connection, -1 if no
+// worker answered.
+pid_t askPid(uint16_t port)
+{
+   auto addr = loopbackAddress(port);
+   for (int i = 0; i < 200; ++i)
+   {
+      int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+      if (::connect(fd, (sockaddr *)&addr, sizeof(addr)) == 0 &&
+          ::write(fd, "?", 1) == 1)
+      {
+         std::string line;
+         char        c = 0;
+         while (::read(fd, &c, 1) == 1 && c != '\n') { line.push_back(c); }
+         ::close(fd);
+         if (!line.empty()) { return static_cast<pid_t>(std::stol(line)); }
+      }
+      else { ::close(fd); }
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+   }
+   return -1;
+}
+
+void servePrefork(uint16_t port, bool reusePortPerWorker)
+{
+   std::thread supervisor([port, reusePortPerWorker]() {
+      auto loop     = NewEventLoop(1, "prefork");
+      auto listener = tcp::Listener::New({port}, "prefork");
+      listener.enablePrefork(2, reusePortPerWorker).bind<PidServer>();
+      loop.serve(listener);
+   });
+
+   std::set<pid_t> pids;
+   for (int i = 0; i < 100 && pids.size() < 2; ++i)
+   {
+      auto pid = askPid(port);
+      REQUIRE_GT(pid, 0);
+      CHECK_NE(pid, ::getpid());
+      pids.insert(pid);
+   }
+   // The reuseport group spreads the connections over both workers.
+   if (reusePortPerWorker) { CHECK_EQ(pids.size(), 2); }
+
+   // A crashed worker is replaced, the others keep serving.
+   auto crashed = *pids.begin();
+   REQUIRE_EQ(::kill(crashed, SIGKILL), 0);
+   pid_t respawned = -1;
+   for (int i = 0; i < 250 && respawned < 0; ++i)
+   {
+      auto pid = askPid(port);
+      REQUIRE_GT(pid, 0);
+      CHECK_NE(pid, crashed);
+      if (!pids.count(pid)) { respawned = pid; }
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+   }
+   REQUIRE_GT(respawned, 0);
+   pids.insert(respawned);
+   pids.erase(crashed);
+
+   QuitAllEventLoop();
+   supervisor.join();
+   for (auto pid : pids) { CHECK_NE(::kill(pid, 0), 0); }
+}
+}   // namespace
+
+TEST_CASE("prefork workers share the listening socket")
+{
+   servePrefork(16971, false);
+}
+
+TEST_CASE("prefork workers bind a socket each")
+{
+   servePrefork(16972, true);
+}
+#endif
@@ -0,0 +1,109 @@
+#include <doctest/doctest.h>
+#include <netpoll/net/eventloop_thread.h>
+#include <netpoll/net/tcp_server.h>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <string>
+#include <thread>
+
+#include "inner/tcp_helper.h"
+
+using namespace netpoll;
+
+namespace {
+const size_t s_rate = 1024 * 1024;
+
+double secondsSince(std::chrono::steady_clock::time_point begin)
+{
+   return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                        begin)
+     .count();
+}
+}   // namespace
+
+TEST_CASE("the receive rate limit pauses the reading")
+{
+   const size_t    kDataSize = 2 * s_rate;
+   EventLoopThread mainThread("rate_main");
+   mainThread.run();
+   TcpServer server(mainThread.getLoop(), InetAddress(0, true), "recv_rate");
+   server.setIoLoopNum(1);
+   std::atomic<size_t>        received{0};
+   std::promise<void>         done;
+   TcpConnectionPtr           connection;
+   std::promise<void>         connected;
+   server.setConnectionCallback([&](const TcpConnectionPtr &conn) {
+      if (!conn->connected()) { return; }
+      conn->setRecvRateLimit(s_rate);
+      connection = conn;
+      connected.set_value();
+   });
+   server.setRecvMessageCallback(
+     [&](const TcpConnectionPtr &, const MessageBuffer *buffer) {
+        received += buffer->readableBytes();
+        buffer->retrieveAll();
+        if (received == kDataSize) { done.set_value(); }
+     });
+   startServer(mainThread, server);
+
+   int fd = connectTo(server.address().toPort());
+   connected.get_future().get();
+   auto        begin = std::chrono::steady_clock::now();
+   std::thread writer([fd, kDataSize]() {
+      std::string data(kDataSize, 'x');
+      size_t      written = 0;
+      while (written < data.size())
+      {
+         auto n = ::write(fd, data.data() + written, data.size() - written);
+         if (n <= 0) { break; }
+         written += n;
+      }
+   });
+   // Half of the data takes about a second, then the limit is lifted.
+   std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+   auto halfway = received.load();
+   CHECK_GT(halfway, s_rate / 2);
+   CHECK_LT(halfway, s_rate * 3 / 2);
+   connection->setRecvRateLimit(0);
+   done.get_future().get();
+   CHECK_LT(secondsSince(begin), 1.5);
+   writer.join();
+   ::close(fd);
+}
+
+TEST_CASE("the send rate limit paces the writing")
+{
+   const size_t    kDataSize = s_rate;
+   EventLoopThread mainThread("rate_main");
+   mainThread.run();
+   TcpServer server(mainThread.getLoop(), InetAddress(0, true), "send_rate");
+   server.setIoLoopNum(1);
+   server.setConnectionCallback([&](const TcpConnectionPtr &conn) {
+      if (!conn->connected()) { return; }
+      conn->setSendRateLimit(s_rate / 2);
+      conn->send(std::string(kDataSize, 'x'));
+      conn->shutdown();
+   });
+   startServer(mainThread, server);
+
+   int     fd    = connectTo(server.address().toPort());
+   auto    begin = std::chrono::steady_clock::now();
+   size_t  received = 0;
+   char    buffer[65536];
+   ssize_t n = 0;
+   while ((n = ::read(fd, buffer, sizeof(buffer))) > 0) { received += n; }
+   auto elapsed = secondsSince(begin);
+   CHECK_EQ(received, kDataSize);
+   // Two seconds at the rate, less the bytes let through by the first burst
+   // of the kernel pacing.
+   CHECK_GT(elapsed, 1);
+   CHECK_LT(elapsed, 4);
+   ::close(fd);
+}
+#endif
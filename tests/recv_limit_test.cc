@@ -0,0 +1,234 @@
+#include <doctest/doctest.h>
+#include <netpoll/net/eventloop_thread.h>
+#include <netpoll/net/tcp_server.h>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "inner/tcp_helper.h"
+
+using namespace netpoll;
+
+namespace {
+// Write size bytes, it blocks while the server does not read.
+std::thread writeInBackground(int fd, size_t size)
+{
+   return std::thread([fd, size]() {
+      std::string data(64 << 10, 'x');
+      for (size_t sent = 0; sent < size;)
+      {
+         auto n = ::write(fd, &data[0], std::min(data.size(), size - sent));
+         if (n <= 0) { break; }
+         sent += n;
+      }
+   });
+}
+
+template <typename T>
+T callInLoop(EventLoop *loop, const std::function<T()> &func)
+{
+   std::promise<T> result;
+   loop->queueInLoop([&]() { result.set_value(func()); });
+   return result.get_future().get();
+}
+
+// Wait until the value stops changing.
+template <typename T>
+T waitStable(EventLoop *loop, const std::function<T()> &func)
+{
+   T value{};
+   for (int i = 0; i < 100; ++i)
+   {
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      auto now = callInLoop(loop, func);
+      if (i > 0 && now == value) { break; }
+      value = now;
+   }
+   return value;
+}
+}   // namespace
+
+TEST_CASE("test receive buffer limit")
+{
+   const size_t    kLimit = 64 << 10;
+   const size_t    kTotal = 4 << 20;
+   EventLoopThread mainThread("recv_limit_main");
+   mainThread.run();
+   TcpServer server(mainThread.getLoop(), InetAddress(0, true), "recv_limit");
+   server.setIoLoopNum(1);
+   std::promise<TcpConnectionPtr> connected;
+   std::promise<void>             closed;
+   // The message is never complete until consume is set.
+   std::atomic<bool>              consume{false};
+   std::atomic<bool>              closeOnLimit{false};
+   server.setConnectionCallback([&](const TcpConnectionPtr &conn) {
+      if (conn->connected())
+      {
+         conn->setRecvBufferLimit(kLimit, closeOnLimit);
+         connected.set_value(conn);
+      }
+      else { closed.set_value(); }
+   });
+   server.setRecvMessageCallback(
+     [&](const TcpConnectionPtr &, const MessageBuffer *buffer) {
+        if (consume) { buffer->retrieveAll(); }
+     });
+   startServer(mainThread, server);
+   auto *loop = server.getIoLoops()[0];
+
+   SUBCASE("the reading pauses")
+   {
+      int  fd     = connectTo(server.address().toPort());
+      auto conn   = connected.get_future().get();
+      auto writer = writeInBackground(fd, kTotal);
+      auto buffered = waitStable<size_t>(loop, [conn]() -> size_t {
+         return conn->getRecvBuffer()->readableBytes();
+      });
+      CHECK_EQ(buffered, kLimit);
+      CHECK_EQ(loop->recvMemory(), kLimit);
+
+      // Consumed out of the message callback, the reading resumes.
+      consume = true;
+      loop->queueInLoop([conn]() { conn->getRecvBuffer()->retrieveAll(); });
+      writer.join();
+      auto received = waitStable<size_t>(
+        loop, [conn]() -> size_t { return conn->bytesReceived(); });
+      CHECK_EQ(received, kTotal);
+      ::close(fd);
+      closed.get_future().get();
+   }
+   SUBCASE("the connection closes")
+   {
+      closeOnLimit = true;
+      int  fd      = connectTo(server.address().toPort());
+      auto conn    = connected.get_future().get();
+      auto writer  = writeInBackground(fd, kTotal);
+      closed.get_future().get();
+      CHECK_LE(callInLoop<size_t>(
+                 loop, [conn]() -> size_t { return conn->bytesReceived(); }),
+               kLimit);
+      ::shutdown(fd, SHUT_RDWR);
+      writer.join();
+      ::close(fd);
+   }
+   // Released once the connection is destroyed.
+   CHECK_EQ(waitStable<size_t>(loop, [loop]() { return loop->recvMemory(); }),
+            0);
+}
+
+TEST_CASE("test receive memory budget")
+{
+   const size_t    kBudget  = 256 << 10;
+   const size_t    kTotal   = 4 << 20;
+   const int       kClients = 3;
+   EventLoopThread mainThread("recv_budget_main");
+   mainThread.run();
+   TcpServer server(mainThread.getLoop(), InetAddress(0, true), "budget");
+   server.setIoLoopNum(1);
+   auto *loop = server.getIoLoops()[0];
+   loop->setRecvMemoryBudget(kBudget);
+   // Only touched in the io loop.
+   std::vector<TcpConnectionPtr> conns;
+   server.setConnectionCallback([&](const TcpConnectionPtr &conn) {
+      if (conn->connected()) { conns.push_back(conn); }
+   });
+   server.setRecvMessageCallback(
+     [](const TcpConnectionPtr &, const MessageBuffer *) {});
+   startServer(mainThread, server);
+
+   std::vector<int>         fds;
+   std::vector<std::thread> writers;
+   for (int i = 0; i < kClients; ++i)
+   {
+      fds.push_back(connectTo(server.address().toPort()));
+      writers.push_back(writeInBackground(fds.back(), kTotal));
+   }
+   auto held =
+     waitStable<size_t>(loop, [loop]() { return loop->recvMemory(); });
+   CHECK_GE(held, kBudget);
+   // Each connection may read once more past the budget.
+   CHECK_LT(held, kBudget + kClients * kBudget);
+
+   for (auto fd : fds) { ::shutdown(fd, SHUT_RDWR); }
+   for (auto &writer : writers) { writer.join(); }
+   loop->queueInLoop([&conns]() {
+      for (auto &conn : conns) { conn->forceClose(); }
+      conns.clear();
+   });
+   CHECK_EQ(waitStable<size_t>(loop, [loop]() { return loop->recvMemory(); }),
+            0);
+   for (auto fd : fds) { ::close(fd); }
+}
+
+TEST_CASE("test receive memory budget spares the small readers")
+{
+   const size_t    kBudget  = 256 << 10;
+   const size_t    kTotal   = 4 << 20;
+   const int       kHolders = 2;
+   EventLoopThread mainThread("recv_share_main");
+   mainThread.run();
+   TcpServer server(mainThread.getLoop(), InetAddress(0, true), "share");
+   server.setIoLoopNum(1);
+   auto *loop = server.getIoLoops()[0];
+   loop->setRecvMemoryBudget(kBudget);
+   // Only touched in the io loop.
+   std::vector<TcpConnectionPtr> conns;
+   server.setConnectionCallback([&](const TcpConnectionPtr &conn) {
+      if (conn->connected()) { conns.push_back(conn); }
+   });
+   // The bulk data is kept, every line is answered.
+   server.setRecvMessageCallback(
+     [](const TcpConnectionPtr &conn, const MessageBuffer *buffer) {
+        if (*buffer->peek() == 'x') { return; }
+        while (auto *end = buffer->findCRLF())
+        {
+           buffer->retrieveUntil(end + 2);
+           conn->send("pong\n");
+        }
+     });
+   startServer(mainThread, server);
+
+   std::vector<int>         fds;
+   std::vector<std::thread> writers;
+   for (int i = 0; i < kHolders; ++i)
+   {
+      fds.push_back(connectTo(server.address().toPort()));
+      writers.push_back(writeInBackground(fds.back(), kTotal));
+   }
+   CHECK_GE(waitStable<size_t>(loop, [loop]() { return loop->recvMemory(); }),
+            kBudget);
+
+   // A connection consuming its input is served while the budget is held.
+   int     fd = connectTo(server.address().toPort());
+   timeval timeout{2, 0};
+   ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+   for (int i = 0; i < 20; ++i)
+   {
+      REQUIRE_EQ(::write(fd, "ping\r\n", 6), 6);
+      char reply[5];
+      REQUIRE_EQ(::recv(fd, reply, sizeof(reply), MSG_WAITALL), 5);
+      CHECK_EQ(std::string(reply, 5), "pong\n");
+   }
+   ::close(fd);
+
+   for (auto fd : fds) { ::shutdown(fd, SHUT_RDWR); }
+   for (auto &writer : writers) { writer.join(); }
+   loop->queueInLoop([&conns]() {
+      for (auto &conn : conns) { conn->forceClose(); }
+      conns.clear();
+   });
+   CHECK_EQ(waitStable<size_t>(loop, [loop]() { return loop->recvMemory(); }),
+            0);
+   for (auto fd : fds) { ::close(fd); }
+}
+#endif
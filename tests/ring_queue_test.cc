@@ -0,0 +1,52 @@
+#include <doctest/doctest.h>
+#include <netpoll/util/ring_queue.h>
+
+#include <memory>
+#include <string>
+
+using namespace netpoll;
+
+TEST_CASE("test ring queue")
+{
+   RingQueue<std::string> queue;
+   CHECK(queue.empty());
+   CHECK_EQ(queue.capacity(), 4);
+
+   // Wrap around before growing, the order must survive the move.
+   int pushed = 0, popped = 0;
+   for (; pushed < 3; ++pushed) { queue.push_back(std::to_string(pushed)); }
+   for (; popped < 2; ++popped)
+   {
+      CHECK_EQ(queue.front(), std::to_string(popped));
+      queue.pop_front();
+   }
+   for (; pushed < 20; ++pushed) { queue.push_back(std::to_string(pushed)); }
+   CHECK_EQ(queue.size(), 18);
+   CHECK_EQ(queue.capacity(), 32);
+   CHECK_EQ(queue.back(), "19");
+   for (size_t i = 0; i < queue.size(); ++i)
+   {
+      CHECK_EQ(queue[i], std::to_string(popped + i));
+   }
+   queue.pop_back();
+   CHECK_EQ(queue.back(), "18");
+   while (!queue.empty())
+   {
+      CHECK_EQ(queue.front(), std::to_string(popped++));
+      queue.pop_front();
+   }
+   CHECK_EQ(popped, 19);
+}
+
+TEST_CASE("test ring queue releases popped items")
+{
+   RingQueue<std::shared_ptr<int>> queue;
+   auto                            item = std::make_shared<int>(1);
+   queue.push_back(std::shared_ptr<int>(item));
+   queue.push_back(std::shared_ptr<int>(item));
+   CHECK_EQ(item.use_count(), 3);
+   queue.pop_front();
+   CHECK_EQ(item.use_count(), 2);
+   queue.pop_back();
+   CHECK_EQ(item.use_count(), 1);
+}
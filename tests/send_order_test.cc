@@ -0,0 +1,132 @@
+#include <doctest/doctest.h>
+#include <netpoll/net/eventloop_thread.h>
+#include <netpoll/net/tcp_server.h>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <functional>
+#include <future>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "inner/tcp_helper.h"
+
+using namespace netpoll;
+
+// Lines "<sender> <seq>" sent by several threads, by the loop thread and
+// across a migration must arrive in the order of each sender.
+TEST_CASE("sends keep their order per sender")
+{
+   const int       kSenders  = 3;
+   const int       kMessages = 20000;
+   EventLoopThread mainThread("order_main");
+   mainThread.run();
+   TcpServer server(mainThread.getLoop(), InetAddress(0, true), "order");
+   server.setIoLoopNum(2);
+   std::promise<TcpConnectionPtr> connected;
+   server.setConnectionCallback([&](const TcpConnectionPtr &conn) {
+      if (conn->connected()) { connected.set_value(conn); }
+   });
+   startServer(mainThread, server);
+
+   int  fd   = connectTo(server.address().toPort());
+   auto conn = connected.get_future().get();
+   auto sendLine = [conn](int sender, int seq) {
+      conn->send(std::to_string(sender) + " " + std::to_string(seq) + "\n");
+   };
+   std::vector<std::thread> senders;
+   for (int sender = 0; sender < kSenders; ++sender)
+   {
+      senders.emplace_back([sender, kMessages, &sendLine]() {
+         for (int seq = 0; seq < kMessages; ++seq) { sendLine(sender, seq); }
+      });
+   }
+   // The loop thread sends in batches, so that its fast path mixes with the
+   // queued sends of the other threads.
+   std::promise<void>       loopDone;
+   std::function<void(int)> loopBatch = [&](int seq) {
+      for (int end = seq + 100; seq < end; ++seq) { sendLine(kSenders, seq); }
+      if (seq == kMessages / 2)
+      {
+         auto loops = server.getIoLoops();
+         conn->migrateTo(loops[0] == conn->getLoop() ? loops[1] : loops[0]);
+      }
+      if (seq < kMessages)
+      {
+         conn->getLoop()->queueInLoop([&loopBatch, seq]() { loopBatch(seq); });
+      }
+      else { loopDone.set_value(); }
+   };
+   conn->getLoop()->queueInLoop([&loopBatch]() { loopBatch(0); });
+   for (auto &thread : senders) { thread.join(); }
+   loopDone.get_future().get();
+   conn->shutdown();
+
+   std::string data;
+   char        buffer[65536];
+   ssize_t     n = 0;
+   while ((n = ::read(fd, buffer, sizeof(buffer))) > 0)
+   {
+      data.append(buffer, n);
+   }
+   std::istringstream lines(data);
+   std::map<int, int> next;
+   int                sender = 0, seq = 0;
+   bool               ordered = true;
+   while (lines >> sender >> seq)
+   {
+      ordered = ordered && next[sender] == seq;
+      next[sender] = seq + 1;
+   }
+   CHECK(ordered);
+   for (int i = 0; i <= kSenders; ++i) { CHECK_EQ(next[i], kMessages); }
+   ::close(fd);
+}
+
+// Sends queued while the loop is busy are drained together, runs of data are
+// cut by the other calls and by the size of one writev().
+TEST_CASE("sends queued behind a busy loop are drained in order")
+{
+   const int       kMessages = 5000;
+   EventLoopThread mainThread("drain_main");
+   mainThread.run();
+   TcpServer server(mainThread.getLoop(), InetAddress(0, true), "drain");
+   server.setIoLoopNum(1);
+   std::promise<TcpConnectionPtr> connected;
+   server.setConnectionCallback([&](const TcpConnectionPtr &conn) {
+      if (conn->connected()) { connected.set_value(conn); }
+   });
+   startServer(mainThread, server);
+
+   int                fd   = connectTo(server.address().toPort());
+   auto               conn = connected.get_future().get();
+   std::promise<void> release;
+   auto               released = release.get_future().share();
+   conn->getLoop()->queueInLoop([released]() { released.wait(); });
+   std::string expected;
+   for (int seq = 0; seq < kMessages; ++seq)
+   {
+      auto line = std::to_string(seq) + "\n";
+      expected += line;
+      conn->send(line);
+      if (seq % 700 == 0) { conn->flush(); }
+   }
+   conn->shutdown();
+   release.set_value();
+
+   std::string data;
+   char        buffer[65536];
+   ssize_t     n = 0;
+   while ((n = ::read(fd, buffer, sizeof(buffer))) > 0)
+   {
+      data.append(buffer, n);
+   }
+   CHECK(data == expected);
+   ::close(fd);
+}
+#endif
@@ -0,0 +1,71 @@
+#include <doctest/doctest.h>
+#include <netpoll/net/eventloop_thread.h>
+#include <netpoll/net/tcp_server.h>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <future>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "inner/tcp_helper.h"
+
+using namespace netpoll;
+
+TEST_CASE("test sendv")
+{
+   const std::string path = "/tmp/netpoll_sendv_test.txt";
+   const std::string fileData(100000, 'f');
+   {
+      auto *fp = ::fopen(path.c_str(), "wb");
+      REQUIRE(fp);
+      ::fwrite(fileData.data(), 1, fileData.size(), fp);
+      ::fclose(fp);
+   }
+   // More fragments than one writev() takes, with empty ones in between.
+   std::vector<std::string> parts;
+   for (int i = 0; i < 3000; ++i)
+   {
+      parts.push_back(i % 7 == 0 ? std::string() : std::to_string(i) + ",");
+   }
+   std::vector<StringView> fragments(parts.begin(), parts.end());
+   std::string             joined;
+   for (auto &part : parts) { joined += part; }
+   const std::string big(1 << 20, 'b');
+
+   EventLoopThread mainThread("sendv_main");
+   mainThread.run();
+   TcpServer server(mainThread.getLoop(), InetAddress(0, true), "sendv");
+   server.setIoLoopNum(1);
+   std::promise<TcpConnectionPtr> connected;
+   server.setConnectionCallback([&](const TcpConnectionPtr &conn) {
+      if (!conn->connected()) { return; }
+      conn->sendv({"header:", "value\r\n", "\r\n"});
+      conn->sendv(fragments.data(), fragments.size());
+      // Queued behind the data the peer has not read yet, around a file.
+      conn->send(big);
+      conn->sendv({"before", "-file|"});
+      conn->sendFile(path.c_str());
+      conn->sendv({"after", "-file|"});
+      connected.set_value(conn);
+   });
+   startServer(mainThread, server);
+
+   int  fd   = connectTo(server.address().toPort());
+   auto conn = connected.get_future().get();
+   // From another thread the fragments are copied.
+   conn->sendv(fragments.data(), fragments.size());
+   conn->shutdown();
+   std::this_thread::sleep_for(std::chrono::milliseconds(100));
+   auto data = readAll(fd);
+   CHECK_EQ(data, "header:value\r\n\r\n" + joined + big + "before-file|" +
+                    fileData + "after-file|" + joined);
+   ::close(fd);
+   ::remove(path.c_str());
+}
+#endif
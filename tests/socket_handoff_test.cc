@@ -0,0 +1,283 @@
+#include <doctest/doctest.h>
+#include <netpoll/net/eventloop_thread.h>
+#include <netpoll/net/inner/socket_handoff.h>
+#include <netpoll/net/tcp_server.h>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <future>
+#include <string>
+#include <thread>
+
+#include "inner/tcp_helper.h"
+
+using namespace netpoll;
+
+namespace {
+std::string readLine(int fd)
+{
+   std::string line;
+   char        c = 0;
+   while (::read(fd, &c, 1) == 1 && c != '\n') { line.push_back(c); }
+   return line;
+}
+
+// Reply to every complete line with the name of the server, the rest stays in
+// the buffer.
+void serveLines(TcpServer &server, const std::string &name)
+{
+   server.setRecvMessageCallback(
+     [name](const TcpConnectionPtr &conn, const MessageBuffer *buffer) {
+        auto *end = buffer->findCRLF();
+        while (end)
+        {
+           std::string line(buffer->peek(), end);
+           buffer->retrieveUntil(end + 2);
+           conn->send(name + ":" + line + "\n");
+           end = buffer->findCRLF();
+        }
+     });
+}
+
+// A Unix socket standing in for the receiving process.
+int listenUnix(const std::string &path)
+{
+   ::unlink(path.c_str());
+   int         fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+   sockaddr_un addr{};
+   addr.sun_family = AF_UNIX;
+   path.copy(addr.sun_path, sizeof(addr.sun_path) - 1);
+   REQUIRE_EQ(::bind(fd, (sockaddr *)&addr, sizeof(addr)), 0);
+   REQUIRE_EQ(::listen(fd, 1), 0);
+   return fd;
+}
+}   // namespace
+
+TEST_CASE("test socket handoff")
+{
+   const std::string path = "/tmp/netpoll_handoff_test.sock";
+   EventLoopThread   oldThread("old_main");
+   EventLoopThread   newThread("new_main");
+   oldThread.run();
+   newThread.run();
+
+   std::atomic<int> oldClosed{0};
+   TcpServer oldServer(oldThread.getLoop(), InetAddress(0, true), "old");
+   oldServer.setIoLoopNum(2);
+   oldServer.setConnectionCallback([&](const TcpConnectionPtr &conn) {
+      if (conn->disconnected()) { ++oldClosed; }
+   });
+   serveLines(oldServer, "old");
+   startServer(oldThread, oldServer);
+   auto port = oldServer.address().toPort();
+
+   // A connection with a partial line in the buffer of the old server.
+   int idleFd = connectTo(port);
+   REQUIRE_EQ(::write(idleFd, "one\r\n", 5), 5);
+   CHECK_EQ(readLine(idleFd), "old:one");
+   REQUIRE_EQ(::write(idleFd, "tw", 2), 2);
+   std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+   // The new server binds next to the old one and waits for its sockets.
+   TcpServer newServer(newThread.getLoop(), InetAddress(port, true), "new");
+   newServer.setIoLoopNum(2);
+   serveLines(newServer, "new");
+   auto adopted = std::async(std::launch::async, [&]() {
+      return newServer.adoptFrom(path, 5);
+   });
+   bool handedOff = false;
+   for (int i = 0; i < 100 && !handedOff; ++i)
+   {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      handedOff = oldServer.handOff(path, true);
+   }
+   REQUIRE(handedOff);
+   REQUIRE(adopted.get());
+   newServer.start();
+
+   // The connection moved with its unread input, the peer did not notice.
+   REQUIRE_EQ(::write(idleFd, "o\r\n", 3), 3);
+   CHECK_EQ(readLine(idleFd), "new:two");
+   CHECK_EQ(oldClosed.load(), 1);
+
+   // New connections go to the new server only.
+   for (int i = 0; i < 10; ++i)
+   {
+      int fd = connectTo(port);
+      REQUIRE_EQ(::write(fd, "hi\r\n", 4), 4);
+      CHECK_EQ(readLine(fd), "new:hi");
+      ::close(fd);
+   }
+   ::close(idleFd);
+   oldServer.stop(1);
+}
+
+TEST_CASE("test no write while detached for the handoff")
+{
+   const std::string path = "/tmp/netpoll_handoff_detach_test.sock";
+   EventLoopThread   mainThread("main");
+   mainThread.run();
+
+   // Every connection is sent a counter by a timer of its loop.
+   std::vector<TimerId> timers;
+   TcpServer            server(mainThread.getLoop(), InetAddress(0, true),
+                               "detach");
+   server.setIoLoopNum(1);
+   server.setConnectionCallback([&timers](const TcpConnectionPtr &conn) {
+      if (!conn->connected()) { return; }
+      std::weak_ptr<TcpConnection> weak = conn;
+      auto                         count = std::make_shared<int>(0);
+      timers.push_back(conn->getLoop()->runEvery(0.01, [weak, count](TimerId) {
+         auto conn = weak.lock();
+         if (conn) { conn->send(std::to_string((*count)++) + "\n"); }
+      }));
+   });
+   startServer(mainThread, server);
+   int fd = connectTo(server.address().toPort());
+
+   std::string received;
+   auto        receive = [&received, fd](int flags) {
+      char buffer[4096];
+      auto n = ::recv(fd, buffer, sizeof(buffer), flags);
+      if (n > 0) { received.append(buffer, n); }
+      return n;
+   };
+   auto lines = [&received]() {
+      return std::count(received.begin(), received.end(), '\n');
+   };
+   while (lines() < 3) { receive(0); }
+
+   // The receiver holds the handoff open, then fails without acknowledging
+   // it.
+   int                listenFd = listenUnix(path);
+   std::promise<void> accepted;
+   std::promise<void> release;
+   auto               receiver = std::async(std::launch::async, [&]() {
+      int handoffFd = ::accept(listenFd, nullptr, nullptr);
+      accepted.set_value();
+      release.get_future().wait();
+      ::close(handoffFd);
+   });
+   auto handedOff = std::async(std::launch::async,
+                               [&]() { return server.handOff(path, true); });
+   accepted.get_future().wait();
+
+   // Detached, the ticks of the timer wait in the write queue.
+   while (receive(MSG_DONTWAIT) > 0) {}
+   std::this_thread::sleep_for(std::chrono::milliseconds(200));
+   CHECK_LT(receive(MSG_DONTWAIT), 0);
+   release.set_value();
+   receiver.get();
+   CHECK_FALSE(handedOff.get());
+
+   // Reattached, the queued ticks come first and none is lost.
+   auto before = lines();
+   while (lines() < before + 25) { receive(0); }
+   std::string expected;
+   for (int i = 0; i < lines(); ++i) { expected += std::to_string(i) + "\n"; }
+   CHECK_EQ(received.substr(0, expected.size()), expected);
+
+   ::close(fd);
+   ::close(listenFd);
+   ::unlink(path.c_str());
+   auto              *ioLoop = server.getIoLoops().front();
+   std::promise<void> cancelled;
+   ioLoop->runInLoop([&]() {
+      for (auto id : timers) { ioLoop->cancelTimer(id); }
+      cancelled.set_value();
+   });
+   cancelled.get_future().wait();
+   server.stop(1);
+}
+
+TEST_CASE("test handoff needs the acknowledgement")
+{
+   const std::string path = "/tmp/netpoll_handoff_ack_test.sock";
+   int               fds[2];
+   REQUIRE_EQ(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+   HandoffState state;
+   state.connections.emplace_back(fds[0], "unread");
+
+   // Nobody listens.
+   ::unlink(path.c_str());
+   CHECK_FALSE(handoff::send(path, state, 1));
+
+   // The receiver reads the data but fails before acknowledging it.
+   int  listenFd = listenUnix(path);
+   auto failing  = std::async(std::launch::async, [listenFd]() {
+      int  fd = ::accept(listenFd, nullptr, nullptr);
+      char buffer[64];
+      ::read(fd, buffer, sizeof(buffer));
+      ::close(fd);
+   });
+   CHECK_FALSE(handoff::send(path, state, 1));
+   failing.get();
+
+   // The receiver hangs, the sender gives up after the timeout.
+   auto start = std::chrono::steady_clock::now();
+   CHECK_FALSE(handoff::send(path, state, 0.2));
+   CHECK(std::chrono::steady_clock::now() - start <
+         std::chrono::seconds(2));
+
+   ::close(listenFd);
+   ::unlink(path.c_str());
+   ::close(fds[0]);
+   ::close(fds[1]);
+}
+
+TEST_CASE("test handoff rejects an oversized unread input")
+{
+   const std::string path = "/tmp/netpoll_handoff_size_test.sock";
+   ::unlink(path.c_str());
+   auto receiving = std::async(std::launch::async, [&path]() {
+      HandoffState state;
+      return handoff::receive(path, 2, &state);
+   });
+
+   sockaddr_un addr{};
+   addr.sun_family = AF_UNIX;
+   path.copy(addr.sun_path, sizeof(addr.sun_path) - 1);
+   int sock = ::socket(AF_UNIX, SOCK_STREAM, 0);
+   for (int i = 0; i < 200 && ::connect(sock, (sockaddr *)&addr,
+                                        sizeof(addr)) < 0;
+        ++i)
+   {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+   }
+   int fds[2];
+   REQUIRE_EQ(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+   // A header with one connection, in the layout of the sender.
+   uint32_t header[4] = {0x6e706866, 0, 1, 0};
+   char     control[CMSG_SPACE(sizeof(int))]{};
+   iovec    iov{header, sizeof(header)};
+   msghdr   msg{};
+   msg.msg_iov        = &iov;
+   msg.msg_iovlen     = 1;
+   msg.msg_control    = control;
+   msg.msg_controllen = sizeof(control);
+   auto *cmsg         = CMSG_FIRSTHDR(&msg);
+   cmsg->cmsg_level   = SOL_SOCKET;
+   cmsg->cmsg_type    = SCM_RIGHTS;
+   cmsg->cmsg_len     = CMSG_LEN(sizeof(int));
+   std::memcpy(CMSG_DATA(cmsg), &fds[0], sizeof(int));
+   REQUIRE_EQ(::sendmsg(sock, &msg, 0), (ssize_t)sizeof(header));
+   uint64_t size = UINT64_MAX;
+   REQUIRE_EQ(::write(sock, &size, sizeof(size)), (ssize_t)sizeof(size));
+
+   CHECK_FALSE(receiving.get());
+   // No acknowledgement.
+   char c = 0;
+   CHECK_LE(::read(sock, &c, 1), 0);
+
+   ::close(sock);
+   ::unlink(path.c_str());
+   ::close(fds[0]);
+   ::close(fds[1]);
+}
+#endif
@@ -0,0 +1,185 @@
+#include <doctest/doctest.h>
+#include <netpoll/net/eventloop_thread.h>
+#include <netpoll/net/spsc_loop_channel.h>
+#include <netpoll/util/spsc_queue.h>
+
+#include <chrono>
+#include <future>
+
+using namespace netpoll;
+
+TEST_CASE("pushed items are invisible until published")
+{
+   SpscQueue<int> queue(4);
+   int            out = 0;
+   CHECK_EQ(queue.capacity(), 4);
+   CHECK(queue.push(1));
+   CHECK(queue.push(2));
+   CHECK_EQ(queue.unpublished(), 2);
+   CHECK_FALSE(queue.pop(out));
+   CHECK(queue.publish());
+   CHECK_FALSE(queue.publish());
+   CHECK(queue.pop(out));
+   CHECK_EQ(out, 1);
+   CHECK(queue.pop(out));
+   CHECK_EQ(out, 2);
+   CHECK(queue.empty());
+}
+
+TEST_CASE("popped slots are reusable after release")
+{
+   SpscQueue<int> queue(4);
+   int            out = 0;
+   for (int i = 0; i < 4; ++i) { CHECK(queue.push(i)); }
+   CHECK_FALSE(queue.push(4));
+   queue.publish();
+   CHECK(queue.pop(out));
+   CHECK_FALSE(queue.push(4));
+   queue.release();
+   CHECK(queue.push(4));
+   queue.publish();
+   for (int i = 1; i <= 4; ++i)
+   {
+      CHECK(queue.pop(out));
+      CHECK_EQ(out, i);
+   }
+}
+
+TEST_CASE("test SpscLoopChannel")
+{
+   const int       kItemNum = 100000;
+   EventLoopThread producerThread("producer");
+   EventLoopThread consumerThread("consumer");
+   producerThread.run();
+   consumerThread.run();
+   auto *producer = producerThread.getLoop();
+   auto *consumer = consumerThread.getLoop();
+
+   std::promise<bool> done;
+   int                expected = 0;
+   bool               ordered  = true;
+   // A small ring makes the producer spill and wait for the consumer.
+   auto               channel  = SpscLoopChannel<int>::New(
+     producer, consumer,
+     [&](int &item) {
+        consumer->assertInLoopThread();
+        if (item != expected) { ordered = false; }
+        if (++expected == kItemNum) { done.set_value(ordered); }
+     },
+     64);
+
+   // Every queued task is one producer iteration, a batch of 1000 items.
+   for (int batch = 0; batch < kItemNum / 1000; ++batch)
+   {
+      producer->queueInLoop([channel, batch]() {
+         for (int i = 0; i < 1000; ++i) { channel->send(batch * 1000 + i); }
+      });
+   }
+   CHECK(done.get_future().get());
+   channel->close();
+   producer->quit();
+   consumer->quit();
+}
+
+// The channel out of the middle loop is bound first, so its hook runs before
+// the hook draining the channel into that loop.
+TEST_CASE("test chained SpscLoopChannel")
+{
+   EventLoopThread firstThread("first");
+   EventLoopThread middleThread("middle");
+   EventLoopThread lastThread("last");
+   firstThread.run();
+   middleThread.run();
+   lastThread.run();
+   auto *first  = firstThread.getLoop();
+   auto *middle = middleThread.getLoop();
+   auto *last   = lastThread.getLoop();
+
+   std::promise<int> received;
+   auto              out = SpscLoopChannel<int>::New(
+     middle, last, [&](int &item) { received.set_value(item); });
+   auto in = SpscLoopChannel<int>::New(
+     first, middle, [out](int &item) { out->send(item + 1); });
+   first->queueInLoop([in]() { in->send(1); });
+
+   auto future = received.get_future();
+   REQUIRE_EQ(future.wait_for(std::chrono::seconds(2)),
+              std::future_status::ready);
+   CHECK_EQ(future.get(), 2);
+   in->close();
+   out->close();
+   first->quit();
+   middle->quit();
+   last->quit();
+}
+
+// A removed hook is destroyed after the round, it may still use what it holds.
+TEST_CASE("test iteration hook removing itself")
+{
+   EventLoopThread loopThread("hooks");
+   loopThread.run();
+   auto *loop = loopThread.getLoop();
+
+   std::promise<int> value;
+   uint64_t          hook = 0;
+   loop->queueInLoop([&]() {
+      auto data = std::make_shared<int>(42);
+      hook      = loop->addIterationHook([&, data]() {
+         loop->removeIterationHook(hook);
+         value.set_value(*data);
+      });
+   });
+   CHECK_EQ(value.get_future().get(), 42);
+   loop->quit();
+}
+
+// Functions queued after the queued functions of the iteration have run must
+// not wait for the poll timeout.
+TEST_CASE("test function queued from the end of the iteration")
+{
+   EventLoopThread loopThread("hooks");
+   loopThread.run();
+   auto *loop = loopThread.getLoop();
+
+   std::promise<void> fromHook, fromEnd;
+   uint64_t           hook = 0;
+   loop->queueInLoop([&]() {
+      hook = loop->addIterationHook([&]() {
+         loop->removeIterationHook(hook);
+         loop->queueInLoop([&]() { fromHook.set_value(); });
+      });
+      loop->runAtIterationEnd([&]() {
+         loop->queueInLoop([&]() { fromEnd.set_value(); });
+      });
+   });
+   CHECK_EQ(fromHook.get_future().wait_for(std::chrono::seconds(2)),
+            std::future_status::ready);
+   CHECK_EQ(fromEnd.get_future().wait_for(std::chrono::seconds(2)),
+            std::future_status::ready);
+   loop->quit();
+}
+
+// The hooks hold the last reference to the channel, the handler closes it
+// while the hook draining it is running.
+TEST_CASE("test SpscLoopChannel closed by its handler")
+{
+   EventLoopThread loopThread("channel");
+   loopThread.run();
+   auto *loop = loopThread.getLoop();
+
+   std::weak_ptr<SpscLoopChannel<int>> weak;
+   std::promise<void>                  handled;
+   loop->queueInLoop([&]() {
+      auto channel = SpscLoopChannel<int>::New(loop, loop, [&](int &) {
+         weak.lock()->close();
+         handled.set_value();
+      });
+      weak         = channel;
+      channel->send(1);
+   });
+   handled.get_future().get();
+   std::promise<bool> expired;
+   loop->queueInLoop([&]() { expired.set_value(weak.expired()); });
+   CHECK(expired.get_future().get());
+   loop->quit();
+}
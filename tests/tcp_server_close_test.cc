@@ -0,0 +1,160 @@
+#include <doctest/doctest.h>
+#include <netpoll/net/eventloop_thread.h>
+#include <netpoll/net/tcp_server.h>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <thread>
+#include <vector>
+
+#include "inner/tcp_helper.h"
+
+using namespace netpoll;
+
+namespace {
+const int s_conn_num = 2000;
+}   // namespace
+
+TEST_CASE("connections close in their own loops")
+{
+   EventLoopThread mainThread("close_main");
+   mainThread.run();
+   std::atomic<int> established{0};
+   std::atomic<int> closed{0};
+   TcpServer        server(mainThread.getLoop(), InetAddress(0, true), "close");
+   server.setIoLoopNum(4);
+   server.setConnectionCallback([&](const TcpConnectionPtr &conn) {
+      if (conn->connected()) { ++established; }
+      else { ++closed; }
+   });
+   startServer(mainThread, server);
+
+   auto fds = connectAll(server.address().toPort(), s_conn_num);
+   waitFor(established, s_conn_num);
+   REQUIRE_EQ(established.load(), s_conn_num);
+
+   // The server loop is blocked while the peers close, the I/O loops still
+   // destroy every connection.
+   std::promise<void>       blocked;
+   std::promise<void>       release;
+   std::shared_future<void> releaseFuture = release.get_future();
+   mainThread.getLoop()->queueInLoop([&blocked, releaseFuture]() {
+      blocked.set_value();
+      releaseFuture.wait();
+   });
+   blocked.get_future().get();
+   auto begin = std::chrono::steady_clock::now();
+   for (auto fd : fds) { ::close(fd); }
+   waitFor(closed, s_conn_num);
+   auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - begin)
+                    .count();
+   release.set_value();
+   CHECK_EQ(closed.load(), s_conn_num);
+   printf("closed %d connections in %lld us\n", s_conn_num, (long long)elapsed);
+   auto pool = server.getIoLoopThreadPool();
+   for (size_t i = 0; i < pool->size(); ++i)
+   {
+      CHECK_EQ(pool->connectionNum(i), 0);
+   }
+}
+
+TEST_CASE("stop closes the connections of every loop")
+{
+   EventLoopThread mainThread("close_main");
+   mainThread.run();
+   std::atomic<int> established{0};
+   std::atomic<int> closed{0};
+   TcpServer        server(mainThread.getLoop(), InetAddress(0, true), "stop");
+   server.setIoLoopNum(4);
+   server.kickoffIdleConnections(60);
+   server.setConnectionCallback([&](const TcpConnectionPtr &conn) {
+      if (conn->connected()) { ++established; }
+      else { ++closed; }
+   });
+   startServer(mainThread, server);
+
+   auto fds = connectAll(server.address().toPort(), s_conn_num);
+   waitFor(established, s_conn_num);
+   REQUIRE_EQ(established.load(), s_conn_num);
+   auto begin = std::chrono::steady_clock::now();
+   server.stop();
+   auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - begin)
+                    .count();
+   printf("stopped %d connections in %lld us\n", s_conn_num,
+          (long long)elapsed);
+   CHECK_EQ(closed.load(), s_conn_num);
+   // The peers see the close.
+   char c = 0;
+   CHECK_EQ(::read(fds.front(), &c, 1), 0);
+   for (auto fd : fds) { ::close(fd); }
+}
+
+TEST_CASE("stop drains the queued data")
+{
+   const size_t    kDataSize = 8 * 1024 * 1024;
+   EventLoopThread mainThread("close_main");
+   mainThread.run();
+   TcpServer server(mainThread.getLoop(), InetAddress(0, true), "drain");
+   server.setIoLoopNum(2);
+   std::promise<void> queued;
+   server.setConnectionCallback([&](const TcpConnectionPtr &conn) {
+      if (!conn->connected()) { return; }
+      // Far more than the socket buffers hold, most of it stays queued.
+      conn->send(std::string(kDataSize, 'x'));
+      queued.set_value();
+   });
+   startServer(mainThread, server);
+
+   auto fds = connectAll(server.address().toPort(), 1);
+   queued.get_future().get();
+   // The peer reads everything and closes once it sees the end of the data.
+   std::atomic<size_t> received{0};
+   std::thread         reader([&received, fd = fds.front()]() {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      char    buffer[65536];
+      ssize_t n = 0;
+      while ((n = ::read(fd, buffer, sizeof(buffer))) > 0) { received += n; }
+      ::close(fd);
+   });
+   auto begin = std::chrono::steady_clock::now();
+   server.stop(10);
+   auto elapsed = std::chrono::steady_clock::now() - begin;
+   reader.join();
+   CHECK_EQ(received.load(), kDataSize);
+   CHECK_LT(elapsed, std::chrono::seconds(5));
+}
+
+TEST_CASE("drain closes the remaining connections at the deadline")
+{
+   EventLoopThread mainThread("close_main");
+   mainThread.run();
+   std::atomic<int> established{0};
+   std::atomic<int> closed{0};
+   TcpServer        server(mainThread.getLoop(), InetAddress(0, true), "drain");
+   server.setIoLoopNum(4);
+   server.setConnectionCallback([&](const TcpConnectionPtr &conn) {
+      if (conn->connected()) { ++established; }
+      else { ++closed; }
+   });
+   startServer(mainThread, server);
+
+   // The peers never close.
+   auto fds = connectAll(server.address().toPort(), 100);
+   waitFor(established, 100);
+   REQUIRE_EQ(established.load(), 100);
+   auto begin = std::chrono::steady_clock::now();
+   server.stop(0.3);
+   auto elapsed = std::chrono::steady_clock::now() - begin;
+   CHECK_EQ(closed.load(), 100);
+   CHECK_GE(elapsed, std::chrono::milliseconds(250));
+   CHECK_LT(elapsed, std::chrono::seconds(2));
+   for (auto fd : fds) { ::close(fd); }
+}
+#endif
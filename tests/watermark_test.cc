@@ -0,0 +1,207 @@
+#include <doctest/doctest.h>
+#include <netpoll/net/eventloop_thread.h>
+#include <netpoll/net/tcp_client.h>
+#include <netpoll/net/tcp_server.h>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <future>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "inner/tcp_helper.h"
+
+using namespace netpoll;
+
+namespace {
+// bytesReceived() read in the loop of the connection.
+size_t bytesReceived(const TcpConnectionPtr &conn)
+{
+   std::promise<size_t> received;
+   conn->getLoop()->queueInLoop(
+     [&]() { received.set_value(conn->bytesReceived()); });
+   return received.get_future().get();
+}
+}   // namespace
+
+// The server forwards the data of the first connection to the second one,
+// which is not read for a while. The forwarding must pause the reading of
+// the source instead of queueing everything.
+TEST_CASE("test write watermarks pause the reader")
+{
+   const size_t    kTotal = 64 << 20;
+   EventLoopThread mainThread("watermark_main");
+   mainThread.run();
+   TcpServer server(mainThread.getLoop(), InetAddress(0, true), "watermark");
+   server.setIoLoopNum(1);
+   // Only touched in the io loop.
+   std::vector<TcpConnectionPtr> conns;
+   std::promise<void>            ready;
+   server.setConnectionCallback([&](const TcpConnectionPtr &conn) {
+      if (!conn->connected()) { return; }
+      conns.push_back(conn);
+      if (conns.size() == 2)
+      {
+         conns[1]->setWriteWatermarks(1 << 20, 0, conns[0]);
+         ready.set_value();
+      }
+   });
+   server.setRecvMessageCallback(
+     [&](const TcpConnectionPtr &conn, const MessageBuffer *buffer) {
+        if (conn == conns[0])
+        {
+           conns[1]->send(*buffer);
+           buffer->retrieveAll();
+        }
+     });
+   startServer(mainThread, server);
+
+   int source = connectTo(server.address().toPort());
+   int sink   = connectTo(server.address().toPort());
+   ready.get_future().get();
+   std::promise<TcpConnectionPtr> sourceConn;
+   server.getIoLoops()[0]->queueInLoop(
+     [&]() { sourceConn.set_value(conns[0]); });
+   auto reader = sourceConn.get_future().get();
+
+   std::thread writer([source, kTotal]() {
+      std::string chunk(64 << 10, '\0');
+      for (size_t sent = 0, seq = 0; sent < kTotal; sent += chunk.size())
+      {
+         for (auto &c : chunk) { c = static_cast<char>(seq++ % 251); }
+         size_t off = 0;
+         while (off < chunk.size())
+         {
+            auto n = ::write(source, &chunk[off], chunk.size() - off);
+            REQUIRE_GT(n, 0);
+            off += n;
+         }
+      }
+      ::shutdown(source, SHUT_WR);
+   });
+   // Wait until the forwarding stalls.
+   size_t received = 0;
+   for (int i = 0; i < 100; ++i)
+   {
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      auto now = bytesReceived(reader);
+      if (now == received) { break; }
+      received = now;
+   }
+   // The high mark plus what the kernel buffers on both sides.
+   CHECK_LT(received, kTotal / 4);
+
+   size_t  got = 0, seq = 0;
+   bool    intact = true;
+   char    buffer[65536];
+   ssize_t n = 0;
+   while (got < kTotal && (n = ::read(sink, buffer, sizeof(buffer))) > 0)
+   {
+      for (ssize_t i = 0; i < n; ++i)
+      {
+         intact = intact && buffer[i] == static_cast<char>(seq++ % 251);
+      }
+      got += n;
+   }
+   CHECK(intact);
+   CHECK_EQ(got, kTotal);
+   writer.join();
+   CHECK_EQ(bytesReceived(reader), kTotal);
+   ::close(source);
+   ::close(sink);
+}
+// The writer is destroyed with its client while the source is paused for it,
+// the source must read again.
+TEST_CASE("test write watermarks released by a destroyed writer")
+{
+   const size_t    kTotal = 16 << 20;
+   EventLoopThread mainThread("watermark_main");
+   mainThread.run();
+   TcpServer server(mainThread.getLoop(), InetAddress(0, true), "watermark");
+   server.setIoLoopNum(1);
+   auto *loop = server.getIoLoops()[0];
+   // Only touched in the io loop.
+   TcpConnectionPtr               writerConn;
+   std::promise<TcpConnectionPtr> sourceConn;
+   server.setConnectionCallback([&](const TcpConnectionPtr &conn) {
+      if (conn->connected()) { sourceConn.set_value(conn); }
+   });
+   server.setRecvMessageCallback(
+     [&](const TcpConnectionPtr &, const MessageBuffer *buffer) {
+        if (writerConn) { writerConn->send(*buffer); }
+        buffer->retrieveAll();
+     });
+   startServer(mainThread, server);
+   int  source = connectTo(server.address().toPort());
+   auto reader = sourceConn.get_future().get();
+
+   // The client writes to a peer which never reads.
+   int         sinkListener = ::socket(AF_INET, SOCK_STREAM, 0);
+   sockaddr_in addr{};
+   socklen_t   addrLen = sizeof(addr);
+   addr.sin_family      = AF_INET;
+   addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   REQUIRE_EQ(::bind(sinkListener, (sockaddr *)&addr, sizeof(addr)), 0);
+   REQUIRE_EQ(::listen(sinkListener, 1), 0);
+   REQUIRE_EQ(::getsockname(sinkListener, (sockaddr *)&addr, &addrLen), 0);
+   auto client =
+     TcpClient::New(loop, InetAddress(ntohs(addr.sin_port), true), "writer");
+   std::promise<void> ready;
+   client->setConnectionCallback([&](const TcpConnectionPtr &conn) {
+      if (!conn->connected()) { return; }
+      conn->setWriteWatermarks(1 << 20, 0, reader);
+      writerConn = conn;
+      ready.set_value();
+   });
+   client->connect();
+   int sink = ::accept(sinkListener, nullptr, nullptr);
+   ready.get_future().get();
+
+   std::thread writer([source, kTotal]() {
+      std::string chunk(64 << 10, 'x');
+      for (size_t sent = 0; sent < kTotal; sent += chunk.size())
+      {
+         size_t off = 0;
+         while (off < chunk.size())
+         {
+            auto n = ::write(source, &chunk[off], chunk.size() - off);
+            REQUIRE_GT(n, 0);
+            off += n;
+         }
+      }
+   });
+   size_t received = 0;
+   for (int i = 0; i < 100; ++i)
+   {
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      auto now = bytesReceived(reader);
+      if (now == received) { break; }
+      received = now;
+   }
+   REQUIRE_LT(received, kTotal);
+
+   std::weak_ptr<TcpConnection> weakWriter;
+   std::promise<void>           dropped;
+   loop->queueInLoop([&]() {
+      weakWriter = writerConn;
+      writerConn.reset();
+      dropped.set_value();
+   });
+   dropped.get_future().get();
+   client.reset();
+   writer.join();
+   for (int i = 0; i < 100 && bytesReceived(reader) < kTotal; ++i)
+   {
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+   }
+   CHECK_EQ(bytesReceived(reader), kTotal);
+   CHECK(weakWriter.expired());
+   ::close(source);
+   ::close(sink);
+   ::close(sinkListener);
+}
+#endif
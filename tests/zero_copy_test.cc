@@ -0,0 +1,136 @@
+#include <doctest/doctest.h>
+#include <nanobench.h>
+#include <netpoll/net/eventloop_thread.h>
+#include <netpoll/net/tcp_server.h>
+
+#ifdef __linux__
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "inner/tcp_helper.h"
+
+using namespace netpoll;
+
+namespace {
+std::shared_ptr<MessageBuffer> makeBuffer(size_t size, char seed)
+{
+   auto        buffer = std::make_shared<MessageBuffer>();
+   std::string data(size, '\0');
+   for (size_t i = 0; i < size; ++i)
+   {
+      data[i] = static_cast<char>(seed + i % 251);
+   }
+   buffer->pushBack(data);
+   return buffer;
+}
+}   // namespace
+
+TEST_CASE("test zero copy send")
+{
+   EventLoopThread mainThread("zero_copy_main");
+   mainThread.run();
+   TcpServer server(mainThread.getLoop(), InetAddress(0, true), "zero_copy");
+   server.setIoLoopNum(1);
+   std::promise<TcpConnectionPtr> connected;
+   server.setConnectionCallback([&](const TcpConnectionPtr &conn) {
+      if (conn->connected()) { connected.set_value(conn); }
+   });
+   startServer(mainThread, server);
+
+   int  fd   = connectTo(server.address().toPort());
+   auto conn = connected.get_future().get();
+   if (!conn->setZeroCopyThreshold(64 * 1024))
+   {
+      MESSAGE("SO_ZEROCOPY is not supported");
+      ::close(fd);
+      return;
+   }
+   auto          big = makeBuffer(4 << 20, 'a');
+   auto          mid = makeBuffer(1 << 20, 'k');
+   MessageBuffer moved(*mid);
+   std::string   expected = "head|";
+   expected.append(big->peek(), big->readableBytes());
+   expected.append(mid->peek(), mid->readableBytes());
+   expected += "|tail";
+   conn->send("head|");
+   conn->send(big);
+   conn->send(std::move(moved));
+   conn->send("|tail");
+   conn->shutdown();
+   // Once the loop ran the sends, the peer has not read yet and the buffer
+   // is pinned by the connection.
+   std::promise<void> sent;
+   conn->getLoop()->queueInLoop([&sent]() { sent.set_value(); });
+   sent.get_future().get();
+   CHECK_GT(big.use_count(), 1);
+   auto data = readAll(fd);
+   CHECK_EQ(data.size(), expected.size());
+   CHECK(data == expected);
+   // Released once the kernel reports the sends complete.
+   for (int i = 0; i < 100 && big.use_count() > 1; ++i)
+   {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+   }
+   CHECK_EQ(big.use_count(), 1);
+   ::close(fd);
+}
+
+// Each iteration sends one buffer and waits until the peer has read it. On
+// loopback the kernel copies the pages on delivery and reports the sends as
+// copied, so the zero copy never wins here, it only shows the cost of the
+// completions. The crossover on a NIC is to be measured the same way.
+TEST_CASE("zero copy crossover on loopback")
+{
+   EventLoopThread mainThread("zero_copy_bench");
+   mainThread.run();
+   TcpServer server(mainThread.getLoop(), InetAddress(0, true), "zc_bench");
+   server.setIoLoopNum(1);
+   std::promise<TcpConnectionPtr> connected;
+   server.setConnectionCallback([&](const TcpConnectionPtr &conn) {
+      if (conn->connected()) { connected.set_value(conn); }
+   });
+   startServer(mainThread, server);
+
+   int                 fd   = connectTo(server.address().toPort());
+   auto                conn = connected.get_future().get();
+   std::atomic<size_t> received{0};
+   std::thread         reader([fd, &received]() {
+      char    buffer[65536];
+      ssize_t n = 0;
+      while ((n = ::read(fd, buffer, sizeof(buffer))) > 0) { received += n; }
+   });
+   size_t target = 0;
+   for (size_t size :
+        {4 << 10, 16 << 10, 64 << 10, 256 << 10, 1 << 20, 4 << 20})
+   {
+      auto                     buffer = makeBuffer(size, 'x');
+      ankerl::nanobench::Bench bench;
+      bench.title("send " + std::to_string(size >> 10) + "KB")
+        .unit("byte")
+        .batch(size)
+        .relative(true)
+        .warmup(3)
+        .minEpochIterations(20);
+      for (bool zeroCopy : {false, true})
+      {
+         if (!conn->setZeroCopyThreshold(zeroCopy ? 1 : 0)) { continue; }
+         bench.run(zeroCopy ? "MSG_ZEROCOPY" : "copy", [&]() {
+            target += size;
+            conn->send(buffer);
+            while (received.load() < target) { std::this_thread::yield(); }
+         });
+      }
+   }
+   CHECK_EQ(received.load(), target);
+   conn->shutdown();
+   reader.join();
+   ::close(fd);
+}
+#endif